@@ -12,6 +12,7 @@
 #include "object.hh"
 #include "insdata.hh"
 #include "precompile.hh"
+#include "stats.hh"
 
 static std::map<unsigned, std::string> PrevBranchLabel; // What "-" means (for each length of "-")
 static std::map<unsigned, std::string> NextBranchLabel; // What "+" means (for each length of "+")
@@ -21,14 +22,20 @@ static std::map<unsigned, std::string> NextBranchLabel; // What "+" means (for e
 
 namespace
 {
+    StatTimer   ParseTime("parse");
+    StatTimer   AddrModeTime("parse.addrmode");
+    StatCounter LineCount("lines");
+    StatCounter InstructionCount("instructions");
+
     struct OpcodeChoice
     {
         typedef std::pair<unsigned, struct ins_parameter> paramtype;
         std::vector<paramtype> parameters;
         bool is_certain;
+        bool is_code; // Opcodes and their operands, not data
 
     public:
-        OpcodeChoice(): parameters(), is_certain(false) { }
+        OpcodeChoice(): parameters(), is_certain(false), is_code(false) { }
         void FlipREL8();
     };
 
@@ -59,7 +66,7 @@ namespace
             std::sprintf(Buf, "Parameter 2 is not byte (size is %u bytes)", parameters[1].first);
             errors.push_back(Buf);
         }
-        if(!parameters[0].second.exp->IsConst())
+        if(!parameters[0].second.exp.IsConst())
         {
             char Buf[128];
             std::sprintf(Buf, "Parameter 1 is not const");
@@ -88,7 +95,7 @@ namespace
             return;
         }
 
-        unsigned char opcode = parameters[0].second.exp->GetConst();
+        unsigned char opcode = parameters[0].second.exp.GetConst();
 
         // 10 30 bpl bmi
         // 50 70 bvc bvs
@@ -147,31 +154,26 @@ namespace
     {
         unsigned value = 0;
 
-        std::set<std::string> labels;
-        FindExprUsedLabels(p.exp, labels);
+        std::set<unsigned> labels;
+        p.exp.FindLabels(labels);
 
-        for(const std::string& label: labels)
+        for(unsigned label: labels)
         {
             SegmentSelection seg;
-            if(obj.FindLabel(label, seg, value))
+            if(obj.FindLabel(LabelName(label), seg, value))
             {
-                std::string before = p.exp->Dump();
-                SubstituteExprLabel(p.exp, label, value);
-                p.exp->Optimize(p.exp);
-                /*fprintf(stderr, "Label substituted(%s)value($%X), result before(%s) after(%s)\n",
-                    label.c_str(), value,
-                    before.c_str(), p.exp->Dump().c_str());*/
+                p.exp.SubstituteLabel(label, value);
             }
             else
             {
                 fprintf(stderr,
                     "Error: Undefined label \"%s\" in expression - got \"%s\"\n",
-                    label.c_str(), p.Dump().c_str());
+                    LabelName(label).c_str(), p.Dump().c_str());
             }
         }
 
-        if(p.exp->IsConst())
-            value = p.exp->GetConst();
+        if(p.exp.IsConst())
+            value = p.exp.GetConst();
         else
         {
             fprintf(stderr,
@@ -182,6 +184,74 @@ namespace
         return value;
     }
 
+    /* Counts the cycles of the code in the choice into the scope.
+     * Called before the code is generated, so that the labels
+     * that are already defined are the ones behind it.
+     */
+    void CountCycles(const OpcodeChoice& c, Object& result)
+    {
+        unsigned base = 0, max = 0;
+        for(unsigned b=0; b<c.parameters.size(); )
+        {
+            const unsigned char opcode = c.parameters[b++].second.exp.GetConst();
+            const OpcodeTiming t = GetOpcodeTiming(opcode);
+            const unsigned operandsize = GetOperandSize(t.mode);
+
+            const expression* operand = nullptr;
+            for(unsigned size=0; size < operandsize && b < c.parameters.size(); )
+            {
+                if(!operand) operand = &c.parameters[b].second.exp;
+                size += c.parameters[b++].first;
+            }
+
+            std::string target;
+            long offset = 0;
+            if(operand && !operand->IsConst())
+                if(unsigned label = operand->GetLabelSum().first)
+                {
+                    target = LabelName(label);
+                    offset = operand->GetLabelSum().second;
+                }
+
+            base += t.cycles;
+            max  += t.cycles;
+            switch(t.extra)
+            {
+                case OpcodeTiming::PageCross:
+                    // Indexing from the start of a page can't cross it
+                    if(!operand || operandsize != 2 || !operand->IsConst()
+                    || (operand->GetConst() & 0xFF))
+                        ++max;
+                    break;
+                case OpcodeTiming::Branch:
+                    max += 2;
+                    break;
+                case OpcodeTiming::Halt:
+                    result.AddUnboundedCycles("kil");
+                    break;
+                case OpcodeTiming::None: ;
+            }
+
+            if(opcode == 0x00)
+                result.AddUnboundedCycles("brk");
+            else if(opcode == 0x6C)
+                result.AddUnboundedCycles("jmp (indirect)");
+            else if(opcode == 0x20) // jsr
+            {
+                if(target.empty() || offset)
+                    result.AddUnboundedCycles("jsr " + operand->Dump());
+                else
+                    result.AddCall(target);
+            }
+            else if((opcode == 0x4C || t.extra == OpcodeTiming::Branch) && !target.empty())
+                result.AddJump(target);
+
+            // What follows a jmp here (the nops of .nop) is jumped over
+            if(opcode == 0x4C || opcode == 0x6C) break;
+        }
+        result.AddCycles(base, max);
+    }
+
     void ParseIns(ParseData& data, Object& result)
     {
     MoreLabels:
@@ -259,12 +329,13 @@ GotLabel:
 
         std::vector<OpcodeChoice> choices;
 
-        const struct ins *insdata = std::lower_bound(ins, ins+InsCount, tok);
-        if(insdata == ins+InsCount || tok != insdata->token)
+        const InsRecord* insdata = FindInstruction(tok);
+        const int directive = insdata ? insdata->action[0] : (int)NoMode;
+        if(!insdata || directive >= ActByte)
         {
             /* Other mnemonic */
 
-            if(tok == ".byt")
+            if(directive == ActByte)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -314,7 +385,7 @@ GotLabel:
                     choices.emplace_back(std::move(choice));
                 }
             }
-            else if(tok == ".word")
+            else if(directive == ActWord)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -347,7 +418,7 @@ GotLabel:
                     choices.emplace_back(std::move(choice));
                 }
             }
-            else if(tok == ".long")
+            else if(directive == ActLong)
             {
                 OpcodeChoice choice;
                 bool first=true, ok=true;
@@ -399,7 +470,7 @@ GotLabel:
                     unsigned value = ParseConst(p, result);
                     //fprintf(stderr, "Label '%s' defined as %u\n", tok.c_str(), value);
 
-                    p.exp.reset();
+                    p.exp = expression();
 
                     if(tok == "*") // Handles '*='
                     {
@@ -435,41 +506,51 @@ GotLabel:
             /* Found mnemonic */
 
             bool something_ok = false;
-            for(unsigned addrmode=0; insdata->opcodes[addrmode*3]; ++addrmode)
+            for(unsigned addrmode=0; addrmode < insdata->modecount; ++addrmode)
             {
-                const std::string op(insdata->opcodes+addrmode*3, 2);
-                if(op != "--")
+                const int op = insdata->action[addrmode];
+                if(op != NoMode)
                 {
                     ins_parameter p1, p2;
 
                     const ParseData::StateType state = data.SaveState();
 
-                    tristate valid = ParseAddrMode(data, addrmode, p1, p2, result);
+                    tristate valid = false;
+                    {
+                        StatScope timing(AddrModeTime);
+                        valid = ParseAddrMode(data, addrmode, p1, p2, result);
+                    }
                     if(!valid.is_false())
                     {
                         something_ok = true;
 
-                        if(op == "sb") result.StartScope();
-                        else if(op == "eb") result.EndScope();
-                        else if(op == "gt") result.SelectTEXT();
-                        else if(op == "gd") result.SelectDATA();
-                        else if(op == "gz") result.SelectZERO();
-                        else if(op == "gb") result.SelectBSS();
-                        else if(op == "li")
+                        if(op == ActStartBlock) result.StartScope();
+                        else if(op == ActEndBlock) result.EndScope();
+                        else if(op == ActSelectTEXT) result.SelectTEXT();
+                        else if(op == ActSelectDATA) result.SelectDATA();
+                        else if(op == ActSelectZERO) result.SelectZERO();
+                        else if(op == ActSelectBSS) result.SelectBSS();
+                        else if(op == ActLink)
                         {
                             assert(addrmode == 12 || addrmode == 13);
                             if(addrmode == 12) // .link group 1
                             {
                                 result.SetLinkageGroup(ParseConst(p1, result));
-                                p1.exp.reset();
+                                p1.exp = expression();
                             }
                             else // .link page $FF
                             {
                                 result.SetLinkagePage(ParseConst(p1, result));
-                                p1.exp.reset();
+                                p1.exp = expression();
                             }
                         }
-                        else if(op == "np")
+                        else if(op == ActCycles) // .cycles 2000
+                        {
+                            assert(addrmode == 14);
+                            result.SetCycleBudget(ParseConst(p1, result));
+                            p1.exp = expression();
+                        }
+                        else if(op == ActNop)
                         {
                             assert(addrmode == 14);
 
@@ -485,11 +566,8 @@ GotLabel:
                                 // jmp
                                 choice.parameters.emplace_back(1, 0x4C); // JMP
 
-                                expression* e = new expr_label(NopLabel);
-                                std::unique_ptr<expression> tmp(e);
-
                                 p1.prefix = FORCE_ABSWORD;
-                                p1.exp.swap(tmp);
+                                p1.exp    = expression(NopLabel);
                                 choice.parameters.emplace_back(2, std::move(p1));
 
                                 imm16 -= 3;
@@ -500,12 +578,12 @@ GotLabel:
                                 choice.parameters.emplace_back(1, 0xEA);
 
                             choice.is_certain = valid.is_true();
+                            choice.is_code    = true;
                             choices.emplace_back(std::move(choice));
                         }
                         else
                         {
-                            // Opcode in hex.
-                            unsigned char opcode = std::strtol(op.c_str(), NULL, 16);
+                            unsigned char opcode = op;
 
                             OpcodeChoice choice;
                             unsigned op1size = GetOperand1Size(addrmode);
@@ -518,24 +596,24 @@ GotLabel:
                             if(op2size) choice.parameters.emplace_back(op2size, std::move(p2));
 
                             choice.is_certain = valid.is_true();
+                            choice.is_code    = true;
                             choices.emplace_back(std::move(choice));
                         }
 #if SHOW_POSSIBLES
-                        std::fprintf(stderr, "- %s mode %u (%s) (%u bytes)\n",
+                        std::fprintf(stderr, "- %s mode %u ($%02X) (%u bytes)\n",
                             valid.is_true() ? "Is" : "Could be",
-                            addrmode, op.c_str(),
+                            addrmode, op,
                             GetOperandSize(addrmode)
                                     );
-                        if(p1.exp)
+                        if(!p1.exp.empty())
                             std::fprintf(stderr, "  - p1=\"%s\"\n", p1.Dump().c_str());
-                        if(p2.exp)
+                        if(!p2.exp.empty())
                             std::fprintf(stderr, "  - p2=\"%s\"\n", p2.Dump().c_str());
 #endif
                     }
 
                     data.LoadState(state);
                 }
-                if(!insdata->opcodes[addrmode*3+2]) break;
             }
 
             if(!something_ok)
@@ -602,12 +680,15 @@ GotLabel:
         }
 
         OpcodeChoice& c = choices[smallestnum];
+        InstructionCount.Add();
 
         if(result.ShouldFlipHere())
         {
             //std::fprintf(stderr, "Flipping...\n");
             c.FlipREL8();
         }
+        if(c.is_code)
+            CountCycles(c, result);
 
 #if SHOW_CHOICES
         std::fprintf(stderr, "Choice %u:", smallestnum);
@@ -620,65 +701,21 @@ GotLabel:
             unsigned size              = c.parameters[b].first;
             const ins_parameter& param = c.parameters[b].second;
 
-            const auto& e = param.exp;
+            const expression& e = param.exp;
 
-            if(e->IsConst())
+            if(e.IsConst())
             {
-                value = e->GetConst();
+                value = e.GetConst();
             }
-            else if(const expr_label* l = dynamic_cast<const expr_label*> (e.get()))
+            else if(unsigned label = e.GetLabelSum().first)
             {
-                ref = l->GetName();
-            }
-            else if(const sum_group* s = dynamic_cast<const sum_group*> (e.get()))
-            {
-                /* constant should always be last in a sum group. */
-
-                /* sum_group always has at least 2 elements.
-                 * If it has 0, it's converted to expr_number.
-                 * if it has 1, it's converter into the element itself (or expr_negate).
-                 */
-
-                auto first = s->contents.begin(), last = std::prev(s->contents.end());
-
-                std::string label;
-                const char *error = NULL;
-                if(s->contents.size() != 2)
-                {
-                    error = "must have 2 elements";
-                }
-                else if(!last->first->IsConst()) // If 2nd isn't const
-                {
-                    error = "2nd elem isn't const";
-                }
-                else if(first->second)          // If 1st isn't positive
-                {
-                    error = "1st elem must not be negative";
-                }
-                else if(const expr_label* lbl = dynamic_cast<const expr_label *> (first->first.get()))
-                {
-                    label = lbl->GetName();
-                }
-                else
-                {
-                    error = "1st elem must be a label";
-                }
-                if(error)
-                {
-                    /* Invalid pointer arithmetic */
-                    std::fprintf(stderr, "Invalid pointer arithmetic (%s): '%s'\n",
-                        error,
-                        e->Dump().c_str());
-                    continue;
-                }
-
-                ref   = std::move(label);
-                value = last->first->GetConst();
+                ref   = LabelName(label);
+                value = e.GetLabelSum().second;
             }
             else
             {
                 fprintf(stderr, "Invalid parameter (not a label/const/label+const): '%s'\n",
-                    e->Dump().c_str());
+                    e.Dump().c_str());
                 continue;
             }
 
@@ -756,11 +793,12 @@ GotLabel:
         std::fprintf(stderr, "\n");
 #endif
 
-        // *FIXME* choices not properly deallocated
     }
 
     void ParseLine(Object& result, const std::string& s)
     {
+        StatScope timing(ParseTime);
+
         // Break into statements, assemble each by each
         for(unsigned a=0; a<s.size(); )
         {
@@ -780,6 +818,9 @@ GotLabel:
                 //std::fprintf(stderr, "Parsing '%s'\n", tmp.c_str());
                 ParseData data(tmp);
                 ParseIns(data, result);
+
+                // The expressions of the statement are gone now
+                ExprArena::Reset();
             }
             a = b+1;
         }
@@ -800,6 +841,40 @@ const std::string& GetNextBranchLabel(unsigned length)
     return l;
 }
 
+namespace
+{
+    void BeginAssembly(Object& obj)
+    {
+        obj.StartScope();
+        obj.SelectTEXT();
+    }
+
+    void AssembleLine(Object& obj, const std::string& line)
+    {
+        if(line[0] == '#')
+        {
+            // Probably something generated by gcc
+            return;
+        }
+        LineCount.Add();
+        ParseLine(obj, line);
+    }
+
+    void EndAssembly(Object& obj)
+    {
+        obj.EndScope();
+
+        for(std::list<std::string>::const_iterator
+            i = DefinedBranchLabels.begin();
+            i != DefinedBranchLabels.end();
+            ++i)
+        {
+            obj.UndefineLabel(*i);
+        }
+        DefinedBranchLabels.clear();
+    }
+}
+
 void AssemblePrecompiled(std::FILE *fp, Object& obj)
 {
     if(!fp)
@@ -807,30 +882,31 @@ void AssemblePrecompiled(std::FILE *fp, Object& obj)
         return;
     }
 
-    obj.StartScope();
-    obj.SelectTEXT();
+    BeginAssembly(obj);
 
     for(;;)
     {
         char Buf[65536];
         if(!std::fgets(Buf, sizeof Buf, fp)) break;
 
-        if(Buf[0] == '#')
-        {
-            // Probably something generated by gcc
-            continue;
-        }
-        ParseLine(obj, Buf);
+        AssembleLine(obj, Buf);
     }
 
-    obj.EndScope();
+    EndAssembly(obj);
+}
 
-    for(std::list<std::string>::const_iterator
-        i = DefinedBranchLabels.begin();
-        i != DefinedBranchLabels.end();
-        ++i)
+void AssemblePrecompiled(const std::string& text, Object& obj)
+{
+    BeginAssembly(obj);
+
+    for(std::string::size_type begin = 0; begin < text.size(); )
     {
-        obj.UndefineLabel(*i);
+        std::string::size_type end = text.find('\n', begin);
+        end = (end == text.npos) ? text.size() : end+1;
+
+        AssembleLine(obj, text.substr(begin, end-begin));
+        begin = end;
     }
-    DefinedBranchLabels.clear();
+
+    EndAssembly(obj);
 }
@@ -33,5 +33,6 @@ const std::string& GetPrevBranchLabel(unsigned length); // What "-" means for ea
 const std::string& GetNextBranchLabel(unsigned length); // What "+" means for each length of "+"
 
 void AssemblePrecompiled(std::FILE *fp, Object& obj);
+void AssemblePrecompiled(const std::string& text, Object& obj);
 
 #endif
@@ -31,12 +31,31 @@
 
 // Users are welcomed to improve the algorithm.
 
+// Alternative methods can be selected:
+//
+//   BinPackFirstFit: Items are handled biggest-first,
+//                    and each item goes to the first bin it fits in.
+//   BinPackExact:    The greedy result is used when it is good.
+//                    Otherwise a depth-first branch-and-bound search
+//                    is done over all placements, until a solution
+//                    is found or the time budget runs out, in which
+//                    case the greedy result is returned.
+
+enum BinPackingMethod
+{
+    BinPackGreedy,
+    BinPackFirstFit,
+    BinPackExact
+};
+
 template<typename sizetype>
 // Return value: itemno=>binno
 const std::vector<unsigned> PackBins
 (
    const std::vector<sizetype> &bins, // binno=>size
-   const std::vector<sizetype> &items // itemno=>size
+   const std::vector<sizetype> &items, // itemno=>size
+   BinPackingMethod method = BinPackGreedy,
+   unsigned budget_ms = 1000 // for BinPackExact
 );
 
 // User should verify the results:
@@ -8,6 +8,7 @@
 #define BINPACKER_DUMP_ITEMS 0
 
 #include <set>
+#include <chrono>
 #include <algorithm>
 
 #if BINPACKER_DUMP
@@ -27,7 +28,9 @@ namespace
            // Input: List of holes. Value = hole size
            const std::vector<sizetype> &Holes,
            // Input: List of items. Value = item size
-           const std::vector<sizetype> &Items
+           const std::vector<sizetype> &Items,
+           BinPackingMethod Method,
+           unsigned BudgetMs
         );
         
         const std::vector<unsigned> GetResult() const;
@@ -61,13 +64,21 @@ namespace
         unsigned GetItemLocation(unsigned itemno) const { return items[itemno].location; }
         
         void Shuffle();
+        void ShuffleFirstFit();
+        void ShuffleExact(unsigned budget_ms);
+
+        typedef std::chrono::steady_clock clock;
+        bool Search(unsigned itemno, clock::time_point deadline,
+                    unsigned long& nodes, bool& timeout);
     };
 
     template<typename sizetype>
     BinPacker<sizetype>::BinPacker
     (
        const std::vector<sizetype> &Holes,
-       const std::vector<sizetype> &Items
+       const std::vector<sizetype> &Items,
+       BinPackingMethod Method,
+       unsigned BudgetMs
     ) : holes(Holes.size()),
         items(Items.size())
     {
@@ -82,7 +93,12 @@ namespace
             holes[a].size     = Holes[a];
             holes[a].used     = 0;
         }
-        Shuffle();
+        switch(Method)
+        {
+            case BinPackGreedy:   Shuffle(); break;
+            case BinPackFirstFit: ShuffleFirstFit(); break;
+            case BinPackExact:    ShuffleExact(BudgetMs); break;
+        }
     }
 
     template<typename sizetype>
@@ -164,6 +180,91 @@ namespace
         
     }
 
+    template<typename sizetype>
+    void BinPacker<sizetype>::ShuffleFirstFit()
+    {
+        if(holes.empty()) return;
+
+        sort(items.begin(), items.end());
+
+        for(unsigned a=0; a<items.size(); ++a)
+        {
+            unsigned besthole=0;
+            for(unsigned b=0; b<holes.size(); ++b)
+                if(holes[b].used+items[a].size <= holes[b].size)
+                    { besthole = b; break; }
+            MoveItem(a, besthole);
+        }
+    }
+
+    template<typename sizetype>
+    void BinPacker<sizetype>::ShuffleExact(unsigned budget_ms)
+    {
+        Shuffle();
+        if(holes.empty() || IsGood()) return;
+
+        // Remember the greedy result in case the search gives up
+        std::vector<unsigned> greedy(items.size());
+        for(unsigned a=0; a<items.size(); ++a)
+        {
+            greedy[a] = items[a].location;
+            MoveItem(a, BinPackerNowhere);
+        }
+
+        unsigned long nodes = 0;
+        bool timeout = false;
+        clock::time_point deadline = clock::now() + std::chrono::milliseconds(budget_ms);
+        if(Search(0, deadline, nodes, timeout)) return;
+
+        for(unsigned a=0; a<items.size(); ++a)
+            MoveItem(a, greedy[a]);
+    }
+
+    template<typename sizetype>
+    bool BinPacker<sizetype>::Search
+        (unsigned itemno, clock::time_point deadline,
+         unsigned long& nodes, bool& timeout)
+    {
+        if(itemno >= items.size()) return true;
+        if(timeout) return false;
+        if(!(++nodes & 1023) && clock::now() >= deadline)
+        {
+            timeout = true;
+            return false;
+        }
+
+        // Items are sorted biggest-first, so the last one is the smallest.
+        // Space in holes where not even it fits is wasted for good.
+        sizetype smallest = items.back().size, usable = 0, needed = 0;
+        for(unsigned a=itemno; a<items.size(); ++a) needed += items[a].size;
+        for(unsigned b=0; b<holes.size(); ++b)
+        {
+            sizetype free = holes[b].size - holes[b].used;
+            if(free >= smallest) usable += free;
+        }
+        if(usable < needed) return false;
+
+        // Try the fullest holes first, like the greedy method does.
+        // Holes with equal free space are interchangeable; try only one.
+        std::vector<std::pair<sizetype, unsigned> > candidates;
+        for(unsigned b=0; b<holes.size(); ++b)
+        {
+            if(holes[b].used+items[itemno].size > holes[b].size) continue;
+            candidates.push_back(std::make_pair(holes[b].size - holes[b].used, b));
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for(unsigned c=0; c<candidates.size(); ++c)
+        {
+            if(c > 0 && candidates[c].first == candidates[c-1].first) continue;
+            MoveItem(itemno, candidates[c].second);
+            if(Search(itemno+1, deadline, nodes, timeout)) return true;
+            MoveItem(itemno, BinPackerNowhere);
+            if(timeout) break;
+        }
+        return false;
+    }
+
 #if BINPACKER_DUMP
     template<typename sizetype>
     void BinPacker<sizetype>::Dump() const
@@ -214,9 +315,11 @@ namespace
 template<typename sizetype>
 const std::vector<unsigned> PackBins
    (const std::vector<sizetype> &Bins,
-    const std::vector<sizetype> &Items)
+    const std::vector<sizetype> &Items,
+    BinPackingMethod Method,
+    unsigned BudgetMs)
 {
-    BinPacker<sizetype> packer(Bins, Items);
+    BinPacker<sizetype> packer(Bins, Items, Method, BudgetMs);
 #if BINPACKER_DUMP
     if(!packer.IsGood()) packer.Dump();
 #endif
@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "chrlink.hh"
+#include "o65linker.hh"
+#include "space.hh"
+#include "stats.hh"
+
+static StatCounter CHRbytes("CHR bytes");
+
+namespace
+{
+    struct CHRfile
+    {
+        std::string name, filename;
+        std::vector<unsigned char> data;
+        unsigned long addr; // in the CHR-ROM
+    };
+    std::vector<CHRfile> files;
+
+    unsigned long BankSize = 0x2000;
+    unsigned long CHRsize  = 0; // 0 = as small as the files fit in
+
+    const unsigned TileSize = 16;
+
+    const std::string MakeName(const std::string& filename)
+    {
+        std::string base = filename.substr(filename.find_last_of('/') + 1);
+        base = base.substr(0, base.find('.'));
+
+        std::string result = "chr_";
+        for(char c: base)
+            result += std::isalnum((unsigned char)c) ? c : '_';
+        return result;
+    }
+}
+
+bool AddCHRfile(const char* arg)
+{
+    CHRfile file;
+    file.filename = arg;
+    if(const char* eq = std::strchr(arg, '='))
+    {
+        file.name.assign(arg, eq);
+        file.filename = eq+1;
+    }
+    else
+        file.name = MakeName(file.filename);
+
+    std::FILE* fp = std::fopen(file.filename.c_str(), "rb");
+    if(!fp)
+    {
+        std::perror(file.filename.c_str());
+        return false;
+    }
+    unsigned char Buf[4096];
+    for(std::size_t n; (n = std::fread(Buf, 1, sizeof Buf, fp)) > 0; )
+        file.data.insert(file.data.end(), Buf, Buf+n);
+    std::fclose(fp);
+
+    if(file.data.empty())
+    {
+        std::fprintf(stderr, "%s: Empty CHR file\n", file.filename.c_str());
+        return false;
+    }
+    file.addr = 0;
+    files.push_back(file);
+    return true;
+}
+
+bool SetCHRbankSize(unsigned long size)
+{
+    if(size != 0x400 && size != 0x800 && size != 0x1000 && size != 0x2000)
+        return false;
+    BankSize = size;
+    return true;
+}
+
+bool SetCHRsize(unsigned long size)
+{
+    if(size % 0x2000) return false;
+    CHRsize = size;
+    return true;
+}
+
+bool LinkCHR(O65linker& linker)
+{
+    if(files.empty()) return true;
+
+    /* The biggest first; they take whole banks from the start.
+     * Sizes are rounded up to whole tiles, so that every file
+     * that shares a bank begins at a tile boundary.
+     */
+    std::vector<unsigned> order(files.size());
+    for(unsigned a=0; a<order.size(); ++a) order[a] = a;
+    std::stable_sort(order.begin(), order.end(), [](unsigned a, unsigned b)
+    {
+        return files[a].data.size() > files[b].data.size();
+    });
+    auto Rounded = [](const CHRfile& f)
+    {
+        return (f.data.size() + TileSize-1) / TileSize * TileSize;
+    };
+
+    const bool grow = !CHRsize;
+    const unsigned long nbanks = CHRsize / BankSize;
+
+    freespacemap space(BankSize);
+    space.SetQuiet(grow);
+
+    unsigned long next = 0; // first bank not yet in use or in "space"
+    bool ok = true;
+    for(unsigned a: order)
+    {
+        CHRfile& f = files[a];
+        const unsigned long length = Rounded(f);
+        if(length < BankSize) break;
+
+        f.addr = next * BankSize;
+        next  += (length + BankSize-1) / BankSize;
+        /* The rest of its last bank is still free */
+        if(length % BankSize)
+            space.Add(f.addr + length, BankSize - length % BankSize);
+    }
+    if(!grow)
+    {
+        if(next > nbanks)
+        {
+            std::fprintf(stderr, "Error: The CHR files don't fit in %lu bytes of CHR-ROM\n", CHRsize);
+            return false;
+        }
+        for(; next < nbanks; ++next) space.Add(next, 0, BankSize);
+    }
+
+    for(unsigned a: order)
+    {
+        CHRfile& f = files[a];
+        const unsigned long length = Rounded(f);
+        if(length >= BankSize) continue;
+
+        unsigned pos;
+        while((pos = space.FindFromAnyPage(length)) == NOWHERE && grow)
+            space.Add(next++, 0, BankSize);
+        if(pos == NOWHERE)
+        {
+            std::fprintf(stderr, "Error: No room for %s in the CHR-ROM\n", f.filename.c_str());
+            ok = false;
+            continue;
+        }
+        f.addr = pos;
+    }
+    if(!ok) return false;
+
+    if(grow)
+        CHRsize = std::max(1ul, (next * BankSize + 0x1FFF) / 0x2000) * 0x2000;
+
+    for(const CHRfile& f: files)
+    {
+        const unsigned bank = f.addr / BankSize;
+        const unsigned tile = f.addr % BankSize / TileSize;
+        std::fprintf(stderr, "%s will be linked in CHR bank %u, tile %u, as %s\n",
+            f.filename.c_str(), bank, tile, f.name.c_str());
+
+        linker.DefineSymbol(f.name, bank);
+        if(linker.IsKnownSymbol(f.name + "_tile"))
+            linker.DefineSymbol(f.name + "_tile", tile);
+
+        CHRbytes.Add(f.data.size());
+    }
+    return true;
+}
+
+unsigned long GetCHRsize()
+{
+    return files.empty() ? 0 : CHRsize;
+}
+
+void AppendCHR(std::vector<unsigned char>& image, unsigned char fill)
+{
+    if(files.empty()) return;
+
+    const std::size_t base = image.size();
+    image.resize(base + CHRsize, fill);
+    for(const CHRfile& f: files)
+    {
+        if(f.addr + f.data.size() > CHRsize)
+        {
+            std::fprintf(stderr, "Internal error: %s is placed past the end of the CHR-ROM\n",
+                f.filename.c_str());
+            continue;
+        }
+        std::copy(f.data.begin(), f.data.end(), image.begin() + base + f.addr);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef bqtChrLinkHH
+#define bqtChrLinkHH
+
+#include <vector>
+
+/* CHR-ROM linking of neslink.
+ *
+ * Pattern tables given with --chr [<name>=]<file> are placed into
+ * the CHR-ROM, which is switched in banks of --chrbank bytes (1k, 2k,
+ * 4k or 8k). A file bigger than a bank takes consecutive whole banks;
+ * smaller ones share banks, starting at tile (16-byte) boundaries.
+ *
+ * For each file, the symbol <name> is defined as its first bank
+ * number, and <name>_tile, if any object refers to it, as its first
+ * tile within that bank. The default name is chr_ followed by the
+ * file name without the directory and the extension.
+ *
+ * The CHR-ROM is --chrsize bytes, or by default as small as the
+ * files fit in, in 8k units. It follows the PRG-ROM in the output.
+ */
+
+class O65linker;
+
+/* Handles the argument of --chr. Returns false if the file can't be read. */
+bool AddCHRfile(const char* arg);
+/* Returns false if the size isn't 1k, 2k, 4k or 8k */
+bool SetCHRbankSize(unsigned long size);
+/* Returns false if the size isn't a multiple of 8k */
+bool SetCHRsize(unsigned long size);
+
+/* Places the files and defines their symbols. Call before linking.
+ * Returns false if they don't fit.
+ */
+bool LinkCHR(O65linker& linker);
+
+/* Size of the CHR-ROM in bytes, 0 if there is none */
+unsigned long GetCHRsize();
+
+/* Appends the CHR-ROM to the image, with fill in the unused space */
+void AppendCHR(std::vector<unsigned char>& image, unsigned char fill);
+
+#endif
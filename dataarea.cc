@@ -178,6 +178,31 @@ unsigned DataArea::FindNextBlob(unsigned where, unsigned& length) const
     return i->first;
 }
 
+unsigned DataArea::FindNextBlob(unsigned where, unsigned& length,
+                                const unsigned char*& data) const
+{
+    map::const_iterator i = blobs.lower_bound(where);
+    if(i == blobs.end()) { length = 0; data = 0; return 0; }
+    length = i->second.size();
+    data   = i->second.data();
+    return i->first;
+}
+
+unsigned DataArea::FindBlobAt(unsigned where, unsigned& length,
+                              const unsigned char*& data) const
+{
+    map::const_iterator i = blobs.upper_bound(where);
+    if(i != blobs.begin())
+    {
+        map::const_iterator prev = i; --prev;
+        if(prev->first + prev->second.size() > where) i = prev;
+    }
+    if(i == blobs.end()) { length = 0; data = 0; return 0; }
+    length = i->second.size();
+    data   = i->second.data();
+    return i->first;
+}
+
 unsigned DataArea::GetUtilization(unsigned begin, unsigned size) const
 {
     unsigned result = 0;
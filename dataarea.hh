@@ -27,6 +27,12 @@ public:
     unsigned GetSize() const { return GetTop() - GetBase(); }
 
     unsigned FindNextBlob(unsigned where, unsigned& length) const;
+    /* Same, but also gives direct access to the blob's bytes */
+    unsigned FindNextBlob(unsigned where, unsigned& length,
+                          const unsigned char*& data) const;
+    /* Finds the blob that covers the given position, or else the next one */
+    unsigned FindBlobAt(unsigned where, unsigned& length,
+                        const unsigned char*& data) const;
 
     /* Returns the number of bytes that actually exist within the given range. */
     unsigned GetUtilization(unsigned begin, unsigned size) const;
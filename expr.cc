@@ -1,217 +1,311 @@
+#include <vector>
+#include <unordered_map>
+
 #include "expr.hh"
 
-void expression::Optimize(std::unique_ptr<expression>& self_ptr)
+namespace
 {
-    if(self_ptr.get() != this) return;
-    if(IsConst() && !dynamic_cast<class expr_number*> (this) )
+    class Arena
+    {
+        static const std::size_t BlockSize = 65536;
+
+        std::vector<char*> blocks; // Kept over resets
+        std::vector<char*> large;  // Allocations that don't fit in a block
+        std::size_t current, used;
+    public:
+        Arena(): blocks(), large(), current(0), used(0) { }
+        ~Arena()
+        {
+            Reset();
+            for(char* p: blocks) delete[] p;
+        }
+
+        void* Allocate(std::size_t size)
+        {
+            const std::size_t align = alignof(std::max_align_t);
+            size = (size + align-1) & ~(align-1);
+
+            if(size > BlockSize)
+            {
+                large.push_back(new char[size]);
+                return large.back();
+            }
+            if(blocks.empty() || used + size > BlockSize)
+            {
+                if(!blocks.empty()) ++current;
+                if(current == blocks.size()) blocks.push_back(new char[BlockSize]);
+                used = 0;
+            }
+            void* result = blocks[current] + used;
+            used += size;
+            return result;
+        }
+
+        void Reset()
+        {
+            for(char* p: large) delete[] p;
+            large.clear();
+            current = 0;
+            used    = 0;
+        }
+    } ExpressionArena;
+
+    struct LabelTable
+    {
+        std::unordered_map<std::string, unsigned> ids;
+        std::vector<const std::string*> names;
+
+        LabelTable(): ids(), names()
+        {
+            InternName(std::string()); // id 0: no label
+        }
+        unsigned InternName(const std::string& name)
+        {
+            auto i = ids.emplace(name, names.size());
+            if(i.second) names.push_back(&i.first->first);
+            return i.first->second;
+        }
+    };
+    LabelTable& Labels()
     {
-        self_ptr = std::unique_ptr<expression>(new expr_number(GetConst()));
+        static LabelTable table;
+        return table;
     }
 }
 
-void expr_bitnot::Optimize(std::unique_ptr<expression>& self_ptr)
+void* ExprArena::Allocate(std::size_t size)
 {
-    expr_unary::Optimize(self_ptr);
-    if(self_ptr.get() != this) return;
-    if(expr_bitnot* tmp = dynamic_cast<expr_bitnot*> (sub.get()))
-    {
-        self_ptr = std::move(tmp->sub);
-    }
+    return ExpressionArena.Allocate(size);
 }
 
-void expr_negate::Optimize(std::unique_ptr<expression>& self_ptr)
+void ExprArena::Reset()
 {
-    expr_unary::Optimize(self_ptr);
-    if(self_ptr.get() != this) return;
-    if(sum_group* s = dynamic_cast<sum_group*> (sub.get()))
-    {
-        s->Negate();
-        self_ptr = std::move(sub);
-        return;
-    }
-    if(expr_negate* tmp = dynamic_cast<expr_negate*> (sub.get()))
-    {
-        self_ptr = std::move(tmp->sub);
-    }
+    ExpressionArena.Reset();
 }
 
-void SubstituteExprLabel(std::unique_ptr<expression>& e, const std::string& name, long value)
+unsigned InternLabel(const std::string& name)
 {
-    if(expr_label* l = dynamic_cast<expr_label*> (e.get()))
-    {
-        if(l->GetName() == name)
-        {
-            e = std::unique_ptr<expression>(new expr_number(value));
-        }
-    }
-    else if(expr_unary* u = dynamic_cast<expr_unary*> (e.get()))
-    {
-        SubstituteExprLabel(u->sub, name, value);
-    }
-    else if(expr_binary* b = dynamic_cast<expr_binary*> (e.get()))
-    {
-        SubstituteExprLabel(b->left, name, value);
-        SubstituteExprLabel(b->right, name, value);
-    }
-    else if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
-    {
-        for(auto& child: s->contents)
-        {
-            SubstituteExprLabel(child.first, name, value);
-        }
-    }
+    return Labels().InternName(name);
 }
 
-void FindExprUsedLabels(const std::unique_ptr<expression>& e, std::set<std::string>& labels)
+const std::string& LabelName(unsigned id)
 {
-    if(const expr_label* l = dynamic_cast<const expr_label*> (e.get()))
-    {
-        labels.insert(l->GetName());
-    }
-    else if(const expr_unary* u = dynamic_cast<const expr_unary*> (e.get()))
-    {
-        FindExprUsedLabels(u->sub, labels);
-    }
-    else if(const expr_binary* b = dynamic_cast<const expr_binary*> (e.get()))
-    {
-        FindExprUsedLabels(b->left, labels);
-        FindExprUsedLabels(b->right, labels);
-    }
-    else if(const sum_group* s = dynamic_cast<const sum_group*> (e.get()))
-    {
-        for(const auto& child: s->contents)
-        {
-            FindExprUsedLabels(child.first, labels);
-        }
-    }
+    return *Labels().names[id];
 }
 
-sum_group::sum_group(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r, bool is_negative)
+expression::expression(long number): ops(), sum()
 {
-     contents.emplace_back(std::move(l), false);
-     contents.emplace_back(std::move(r), is_negative);
+    ops.push_back(Op{Number, number});
+    sum.offset = number;
 }
 
-bool sum_group::IsConst() const
+expression::expression(const std::string& label): ops(), sum()
 {
-     for(const auto& child: contents)
-          if(!child.first->IsConst())
-              return false;
-     return true;
+    const unsigned id = InternLabel(label);
+    ops.push_back(Op{Label, (long)id});
+    sum.label = id;
+    sum.scale = 1;
 }
-long sum_group::GetConst() const
+
+expression expression::Unary(OpType op, expression&& sub)
 {
-     long result = 0;
-     for(const auto& child: contents)
-          if(child.second)
-               result -= child.first->GetConst();
-          else
-               result += child.first->GetConst();
-     //std::fprintf(stderr, "Const value: $%lX of '%s'\n", result, Dump().c_str());
-     return result;
+    expression result(std::move(sub));
+    result.ops.push_back(Op{op, 0});
+    result.sum = Apply(op, result.sum, Linear());
+    result.Canonicalize();
+    return result;
 }
 
-const std::string sum_group::Dump() const
+expression expression::Binary(OpType op, expression&& left, expression&& right)
 {
-     std::string result = "(";
-     for(const auto& child: contents)
-     {
-          result += child.second ? '-' : '+';
-          result += child.first->Dump();
-     }
-     result += ')';
-     return result;
+    expression result(std::move(left));
+    result.ops.insert(result.ops.end(), right.ops.begin(), right.ops.end());
+    result.ops.push_back(Op{op, 0});
+    result.sum = Apply(op, result.sum, right.sum);
+    result.Canonicalize();
+    return result;
 }
 
-void sum_group::Optimize(std::unique_ptr<expression>& self_ptr)
+const expression::Linear expression::Apply(OpType op, const Linear& a, const Linear& b)
 {
-    long const_sum = 0;
-    for(list_t::iterator i = contents.begin(); i != contents.end(); )
+    Linear result = Linear();
+    result.complex = true;
+    if(a.complex || b.complex) return result;
+
+    switch(op)
     {
-        std::unique_ptr<expression>& e = i->first;
-        e->Optimize(e);
-        if(e->IsConst())
-        {
-            //std::fprintf(stderr, "Found const (%ld)%s\n", e->GetConst(), i->second?" (negated)":"");
-            if(i->second)
-                const_sum -= e->GetConst();
-            else
-                const_sum += e->GetConst();
-            i = contents.erase(i);
-            continue;
-        }
-        if(expr_negate* n = dynamic_cast<expr_negate*> (e.get()))
-        {
-            *i = elem_t(std::move(n->sub), !i->second);
-            // Reanalyze same item
-            continue;
-        }
-        if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
+        case Number:
+        case Label:
+            return result;
+        case Negate:
+            result = a;
+            result.offset = -a.offset;
+            result.scale  = -a.scale;
+            return result;
+        case Add:
+        case Sub:
         {
-            if(i->second) s->Negate();
-            contents.splice(contents.end(), std::move(s->contents));
-            i = contents.erase(i);
-            continue;
+            const long sign = op == Sub ? -1 : 1;
+            if(a.scale && b.scale && a.label != b.label) return result;
+            result.complex = false;
+            result.offset  = a.offset + sign*b.offset;
+            result.scale   = a.scale  + sign*b.scale;
+            result.label   = result.scale ? (a.scale ? a.label : b.label) : 0;
+            return result;
         }
-        ++i;
+        case Mul:
+            if(a.scale && b.scale) return result;
+            result.complex = false;
+            if(a.scale)
+            {
+                result.scale  = a.scale  * b.offset;
+                result.offset = a.offset * b.offset;
+                result.label  = result.scale ? a.label : 0;
+            }
+            else
+            {
+                result.scale  = b.scale  * a.offset;
+                result.offset = b.offset * a.offset;
+                result.label  = result.scale ? b.label : 0;
+            }
+            return result;
+        default:
+            break;
     }
-    if(contents.empty())
+
+    // The rest are only known for constants
+    if(a.scale || b.scale) return result;
+    result.complex = false;
+    switch(op)
     {
-        //std::fprintf(stderr, "Replaced with const sum=%ld\n", const_sum);
-        self_ptr = std::unique_ptr<expression>(new expr_number(const_sum));
-        return;
+        case BitNot: result.offset = ~a.offset; break;
+        case Div:
+            if(!b.offset) { result.complex = true; break; }
+            result.offset = a.offset / b.offset; break;
+        case Shl:    result.offset = a.offset << b.offset; break;
+        case Shr:    result.offset = a.offset >> b.offset; break;
+        case BitAnd: result.offset = a.offset & b.offset; break;
+        case BitOr:  result.offset = a.offset | b.offset; break;
+        case BitXor: result.offset = a.offset ^ b.offset; break;
+        default: break;
     }
-    if(const_sum)
+    return result;
+}
+
+void expression::Canonicalize()
+{
+    if(sum.complex) return;
+    if(!sum.scale)
     {
-        //std::fprintf(stderr, "Re-added const sum=%ld\n", const_sum);
-        contents.emplace_back(new expr_number(const_sum), false);
+        ops.clear();
+        ops.push_back(Op{Number, sum.offset});
     }
-    if(contents.size() == 1)
+    else if(sum.scale == 1 && ops.size() > 3)
     {
-        // Replace self with the first element.
-        auto& front = contents.front();
-        auto ptr = std::move(front.first);
-        if(front.second)
+        ops.clear();
+        ops.push_back(Op{Label, (long)sum.label});
+        if(sum.offset)
         {
-            // Negate it if necessary.
-            ptr = std::unique_ptr<expression>(new expr_negate(std::move(ptr)));
+            ops.push_back(Op{Number, sum.offset});
+            ops.push_back(Op{Add, 0});
         }
-        self_ptr = std::move(ptr);
     }
 }
 
-void sum_group::Negate()
+void expression::Reevaluate()
 {
-    for(auto& child: contents)
-        child.second = !child.second;
+    Linear local[16];
+    Linear* stack = local;
+    if(ops.size() > 16)
+        stack = (Linear*)ExprArena::Allocate(ops.size() * sizeof(Linear));
+
+    std::size_t depth = 0;
+    for(const Op& op: ops)
+    {
+        switch(op.type)
+        {
+            case Number:
+                stack[depth] = Linear();
+                stack[depth++].offset = op.value;
+                break;
+            case Label:
+                stack[depth] = Linear();
+                stack[depth].label = op.value;
+                stack[depth++].scale = 1;
+                break;
+            case Negate:
+            case BitNot:
+                stack[depth-1] = Apply(op.type, stack[depth-1], Linear());
+                break;
+            default:
+                --depth;
+                stack[depth-1] = Apply(op.type, stack[depth-1], stack[depth]);
+        }
+    }
+    sum = stack[0];
+    Canonicalize();
+}
+
+std::pair<unsigned, long> expression::GetLabelSum() const
+{
+    if(sum.complex || sum.scale != 1) return {0u, 0l};
+    return {sum.label, sum.offset};
+}
+
+void expression::FindLabels(std::set<unsigned>& labels) const
+{
+    for(const Op& op: ops)
+        if(op.type == Label)
+            labels.insert(op.value);
+}
+
+void expression::SubstituteLabel(unsigned label, long value)
+{
+    bool changed = false;
+    for(Op& op: ops)
+        if(op.type == Label && (unsigned)op.value == label)
+        {
+            op.type  = Number;
+            op.value = value;
+            changed  = true;
+        }
+    if(changed) Reevaluate();
 }
 
-std::pair<std::string, long> IsLabelSumExpression(const std::unique_ptr<expression>& e)
+const std::string expression::Render(std::size_t& end) const
 {
-    if(sum_group* s = dynamic_cast<sum_group*> (e.get()))
+    const Op& op = ops[--end];
+    switch(op.type)
     {
-        std::pair<std::string, long> result{ {}, {} };
-        for(const auto& e: s->contents)
+        case Number:
         {
-            if(e.first->IsConst())
-                { long val = e.first->GetConst(); if(e.second) val=-val; result.second += val; }
-            else if(e.second || !result.first.empty())
-                return {}; // Failed
+            char Buf[32];
+            if(op.value < 0)
+                std::sprintf(Buf, "$-%lX", -op.value);
             else
-            {
-                auto p = IsLabelSumExpression(e.first);
-                if(p.first.empty()) return {}; // Failed
-                result.first  = p.first;
-                result.second += p.second;
-            }
+                std::sprintf(Buf, "$%lX", op.value);
+            return Buf;
         }
-        return result;
+        case Label:
+            return LabelName(op.value);
+        case Negate:
+            return "-(" + Render(end) + ")";
+        case BitNot:
+            return "not(" + Render(end) + ")";
+        default:
+            break;
     }
-    else if(expr_label* l = dynamic_cast<expr_label*> (e.get()))
-    {
-        return {l->GetName(), 0l};
-    }
-    else if(e.get()->IsConst())
-        return {{}, e.get()->GetConst()};
-    return {};
+
+    static const char* const names[] =
+        { "", "", "", "", "+", "-", "*", "/", " shl ", " shr ", " and ", " or ", " xor " };
+    const std::string right = Render(end);
+    const std::string left  = Render(end);
+    return "(" + left + names[op.type] + right + ")";
+}
+
+const std::string expression::Dump() const
+{
+    if(ops.empty()) return "(nil)";
+    std::size_t end = ops.size();
+    return Render(end);
 }
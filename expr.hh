@@ -4,151 +4,105 @@
 #include <cstdio>
 #include <string>
 #include <utility>
-#include <list>
+#include <vector>
 #include <set>
-#include <memory>
+#include <cstddef>
 
-class expression
+/* Expressions only live while one statement is being assembled.
+ * Their storage is carved from a bump arena which is emptied after
+ * each statement, so building and dropping them costs no heap traffic.
+ */
+class ExprArena
 {
 public:
-    virtual ~expression() { }
-    virtual bool IsConst() const = 0;
-    virtual long GetConst() const { return 0; }
+    static void* Allocate(std::size_t size);
 
-    virtual const std::string Dump() const = 0;
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr);
+    /* Forgets every allocation at once. None may be in use anymore. */
+    static void Reset();
 };
-class expr_number: public expression
-{
-protected:
-    long value;
-public:
-    expr_number(long v): value(v) { }
-
-    virtual bool IsConst() const { return true; }
-    virtual long GetConst() const { return value; }
 
-    virtual const std::string Dump() const
-    {
-        char Buf[512];
-        if(value < 0)
-            std::sprintf(Buf, "$-%lX", -value);
-        else
-            std::sprintf(Buf, "$%lX", value);
-        return Buf;
-    }
-};
-class expr_label: public expression
+template<typename T>
+struct ArenaAllocator
 {
-protected:
-    std::string name;
-public:
-    expr_label(const std::string& s): name(s) { }
+    typedef T value_type;
 
-    virtual bool IsConst() const { return false; }
+    ArenaAllocator() { }
+    template<typename U> ArenaAllocator(const ArenaAllocator<U>&) { }
 
-    virtual const std::string Dump() const { return name; }
-    const std::string& GetName() const { return name; }
+    T* allocate(std::size_t n) { return (T*)ExprArena::Allocate(n * sizeof(T)); }
+    void deallocate(T*, std::size_t) { }
 };
-class expr_unary: public expression
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) { return false; }
+
+/* Label names in expressions are interned; 0 stands for no label */
+unsigned InternLabel(const std::string& name);
+const std::string& LabelName(unsigned id);
+
+/* An expression is a flat postfix sequence of operations.
+ *
+ * Alongside it, the value is kept summarized as scale*label + offset
+ * (or marked too complex for that). The summary is built as the
+ * expression is put together, so constants are folded while parsing
+ * and the const / label+const questions cost nothing to answer.
+ */
+class expression
 {
 public:
-    std::unique_ptr<expression> sub;
-public:
-    expr_unary(std::unique_ptr<expression>&& s): sub(std::move(s)) { }
-    virtual bool IsConst() const { return sub->IsConst(); }
-
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr)
+    enum OpType: unsigned char
     {
-         sub->Optimize(sub);
-         expression::Optimize(self_ptr);
-    }
-private:
-    expr_unary(const expr_unary &b);
-    void operator= (const expr_unary &b);
-};
-class expr_binary: public expression
-{
-public:
-    std::unique_ptr<expression> left;
-    std::unique_ptr<expression> right;
-public:
-    expr_binary(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r): left(std::move(l)), right(std::move(r)) { }
-    virtual bool IsConst() const { return left->IsConst() && right->IsConst(); }
-
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr)
+        Number, Label,                   // leaves
+        Negate, BitNot,                  // unary
+        Add, Sub, Mul, Div, Shl, Shr,    // binary
+        BitAnd, BitOr, BitXor
+    };
+    struct Op
     {
-         left->Optimize(left);
-         right->Optimize(right);
-         expression::Optimize(self_ptr);
-    }
-
-private:
-    expr_binary(const expr_binary &b);
-    void operator= (const expr_binary &b);
-};
-
-#define unary_class(classname, op, stringop) \
-    class classname: public expr_unary \
-    { \
-    public: \
-        classname(std::unique_ptr<expression>&& s): expr_unary(std::move(s)) { } \
-        virtual long GetConst() const { return op sub->GetConst(); } \
-    \
-        virtual const std::string Dump() const \
-        { return std::string(stringop) + "(" + sub->Dump() + ")"; } \
-        \
-        virtual void Optimize(std::unique_ptr<expression>& self_ptr); \
+        OpType type;
+        long   value; // Number: the number, Label: the label id
     };
 
-#define binary_class(classname, op, stringop) \
-    class classname: public expr_binary \
-    { \
-    public: \
-        classname(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r): expr_binary(std::move(l), std::move(r)) { } \
-        virtual long GetConst() const { return left->GetConst() op right->GetConst(); } \
-    \
-        virtual const std::string Dump() const \
-        { return std::string("(") + left->Dump() + stringop + right->Dump() + ")"; } \
-    };
+public:
+    expression(): ops(), sum() { } // No expression
+    explicit expression(long number);
+    explicit expression(const std::string& label);
 
-unary_class(expr_bitnot, ~, "not")
-unary_class(expr_negate, -, "-")
+    static expression Unary(OpType op, expression&& sub);
+    static expression Binary(OpType op, expression&& left, expression&& right);
 
-binary_class(expr_mul,    *, "*")
-binary_class(expr_div,    /, "/")
-binary_class(expr_shl,   <<, " shl ")
-binary_class(expr_shr,   >>, " shr ")
-binary_class(expr_bitand, &, " and")
-binary_class(expr_bitor,  |, " or ")
-binary_class(expr_bitxor, ^, " xor ")
+    bool empty() const { return ops.empty(); }
 
-class sum_group: public expression
-{
-public:
-    typedef std::pair<std::unique_ptr<expression>, bool> elem_t;
-    typedef std::list<elem_t> list_t;
-    list_t contents;
-public:
-    sum_group(std::unique_ptr<expression>&& l, std::unique_ptr<expression>&& r, bool is_negative);
+    bool IsConst() const { return !sum.complex && !sum.scale; }
+    long GetConst() const { return sum.offset; }
 
-    virtual bool IsConst() const;
-    virtual long GetConst() const;
+    /* Returns the label id and the offset, if this is label+const.
+     * Otherwise the id is 0.
+     */
+    std::pair<unsigned, long> GetLabelSum() const;
 
-    virtual const std::string Dump() const;
-    virtual void Optimize(std::unique_ptr<expression>& self_ptr);
-private:
-    friend class expr_negate;
-    void Negate();
+    void FindLabels(std::set<unsigned>& labels) const;
+    void SubstituteLabel(unsigned label, long value);
+
+    const std::string Dump() const;
 
 private:
-    sum_group(const sum_group &b);
-    void operator= (const sum_group &b);
-};
+    struct Linear
+    {
+        long     offset;
+        unsigned label;
+        long     scale;
+        bool     complex;
+    };
 
-void SubstituteExprLabel(std::unique_ptr<expression>&, const std::string& name, long value);
-void FindExprUsedLabels(const std::unique_ptr<expression>&, std::set<std::string>& labels);
+    std::vector<Op, ArenaAllocator<Op> > ops;
+    Linear sum;
 
-std::pair<std::string, long> IsLabelSumExpression(const std::unique_ptr<expression>&);
+    static const Linear Apply(OpType op, const Linear& a, const Linear& b);
+    void Reevaluate();
+    void Canonicalize();
+    const std::string Render(std::size_t& end) const;
+};
 
 #endif
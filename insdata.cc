@@ -1,7 +1,9 @@
+#include <cstring>
+
 #include "insdata.hh"
 #include "assemble.hh"
 
-const struct AddrMode AddrModes[] =
+constexpr struct AddrMode AddrModes[] =
 {
     /* Sorted in priority order - but the no-parameters-type must come first! */
 
@@ -19,24 +21,30 @@ const struct AddrMode AddrModes[] =
   { /* 10 lda $1234,y  */ '(', "",   ",y", AddrMode::tWord, AddrMode::tNone },//o W,y  AY
   { /* 11 lda ($1234)  */   0, "(",  ")",  AddrMode::tWord, AddrMode::tNone },//o (W)  IN
   { /* 12 .link group 1  */ 0, "group", "",AddrMode::tWord, AddrMode::tNone },
-  { /* 13 .link page $FF */ 0, "page",  "",AddrMode::tByte, AddrMode::tNone },
+  { /* 13 .link page $FF */ 0, "page",  "",AddrMode::tWord, AddrMode::tNone },
   { /* 14 .nop imm16  */    0, "",   "",   AddrMode::tWord, AddrMode::tNone }
 };
-const unsigned AddrModeCount = sizeof(AddrModes) / sizeof(AddrModes[0]);
+constexpr unsigned AddrModeCount = sizeof(AddrModes) / sizeof(AddrModes[0]);
+static_assert(AddrModeCount == MaxAddrModes, "MaxAddrModes is out of date");
 
-const struct ins ins[] =
+constexpr struct ins ins[] =
 {
-    // IMPORTANT: Alphabetical sorting!
+    // Keep in alphabetical order, for the reader.
 
   { ".(",    "sb" }, // start block, no params
   { ".)",    "eb" }, // end block, no params
   { ".bss",  "gb" }, // Select seG BSS
+  { ".byt",  "db" }, // Data bytes
+  { ".cycles",       // Cycle budget of the scope (mode 14)
+           "--'--'--'--'--'--'--'--'--'--'--'--'--'--'cy" },
   { ".data", "gd" }, // Select seG DATA
   { ".link",         // Select linkage (modes 12 and 13)
            "--'--'--'--'--'--'--'--'--'--'--'--'li'li" },
+  { ".long", "dl" }, // Data longs
   { ".nop",          // Nop macro (mode 14)
            "--'--'--'--'--'--'--'--'--'--'--'--'--'--'np" },
   { ".text", "gt" }, // Select seG TEXT
+  { ".word", "dw" }, // Data words
   { ".zero", "gz" }, // Select seG ZERO
 
   // ins     0  1  2  3  4  5  6  7  8  9 10 11
@@ -145,7 +153,175 @@ const struct ins ins[] =
   { "txs",  "9A'--'--'--'--'--'--'--'--'--'--'--"},
   { "tya",  "98'--'--'--'--'--'--'--'--'--'--'--"},
 };
-const unsigned InsCount = sizeof(ins) / sizeof(ins[0]);
+constexpr unsigned InsCount = sizeof(ins) / sizeof(ins[0]);
+
+namespace
+{
+    constexpr short DecodeAction(const char* s)
+    {
+        struct { char a, b; short action; } const specials[] =
+        {
+            {'-','-', NoMode},
+            {'s','b', ActStartBlock}, {'e','b', ActEndBlock},
+            {'g','t', ActSelectTEXT}, {'g','d', ActSelectDATA},
+            {'g','z', ActSelectZERO}, {'g','b', ActSelectBSS},
+            {'l','i', ActLink},       {'n','p', ActNop},
+            {'c','y', ActCycles},
+            {'d','b', ActByte}, {'d','w', ActWord}, {'d','l', ActLong}
+        };
+        for(const auto& sp: specials)
+            if(s[0] == sp.a && s[1] == sp.b)
+                return sp.action;
+
+        auto hex = [](char c) -> short
+            { return c >= 'A' ? c-'A'+10 : c-'0'; };
+        return hex(s[0])*16 + hex(s[1]);
+    }
+
+    struct InsRecords
+    {
+        InsRecord record[InsCount];
+    };
+
+    constexpr InsRecords DecodeInstructions()
+    {
+        InsRecords result {};
+        for(unsigned a=0; a<InsCount; ++a)
+        {
+            InsRecord& r = result.record[a];
+            r.token = ins[a].token;
+            for(const char* s = ins[a].opcodes; ; s += 3)
+            {
+                r.action[r.modecount++] = DecodeAction(s);
+                if(!s[2]) break;
+            }
+        }
+        return result;
+    }
+
+    constexpr InsRecords Decoded = DecodeInstructions();
+
+    /* The hash table is sparse enough that a collision-free
+     * seed is found within a few tries at compile time.
+     */
+    constexpr unsigned InsHashSize = 2048;
+    static_assert(InsCount < 0xFF, "Too many instructions for the hash");
+
+    constexpr std::size_t TokenLength(const char* s)
+    {
+        std::size_t n = 0;
+        while(s[n]) ++n;
+        return n;
+    }
+
+    constexpr unsigned HashToken(const char* s, std::size_t length, unsigned seed)
+    {
+        unsigned h = 2166136261u ^ seed;
+        for(std::size_t a=0; a<length; ++a)
+        {
+            h ^= (unsigned char)s[a];
+            h *= 16777619u;
+        }
+        return (h ^ (h >> 16)) & (InsHashSize-1);
+    }
+
+    struct InsHashTable
+    {
+        unsigned      seed;
+        unsigned char slot[InsHashSize]; // Index into Decoded, 0xFF if free
+    };
+
+    constexpr InsHashTable BuildInsHash()
+    {
+        for(unsigned seed = 1; ; ++seed)
+        {
+            InsHashTable table {};
+            table.seed = seed;
+            for(auto& s: table.slot) s = 0xFF;
+
+            bool ok = true;
+            for(unsigned a=0; a<InsCount && ok; ++a)
+            {
+                unsigned h = HashToken(ins[a].token, TokenLength(ins[a].token), seed);
+                if(table.slot[h] != 0xFF) ok = false;
+                else table.slot[h] = a;
+            }
+            if(ok) return table;
+        }
+    }
+
+    constexpr InsHashTable InsHash = BuildInsHash();
+
+    /* Cycles of each opcode, including the unofficial ones */
+    constexpr char CycleTable[] =
+        "7628335532224466" // 00
+        "2528444626274477" // 10
+        "6628335542224466" // 20
+        "2528444626274477" // 30
+        "6628335532223466" // 40
+        "2528444626274477" // 50
+        "6628335542225466" // 60
+        "2528444626274477" // 70
+        "2626333322224444" // 80
+        "2626444425255555" // 90
+        "2626333322224444" // A0
+        "2525444424244444" // B0
+        "2628335522224466" // C0
+        "2528444626274477" // D0
+        "2628335522224466" // E0
+        "2528444626274477";// F0
+
+    /* p = page-cross penalty, b = branch, h = halts (KIL) */
+    constexpr char ExtraTable[] =
+        "--h-------------" // 00
+        "bph------p--pp--" // 10
+        "--h-------------" // 20
+        "bph------p--pp--" // 30
+        "--h-------------" // 40
+        "bph------p--pp--" // 50
+        "--h-------------" // 60
+        "bph------p--pp--" // 70
+        "----------------" // 80
+        "b-h-------------" // 90
+        "----------------" // A0
+        "bphp-----p-ppppp" // B0
+        "----------------" // C0
+        "bph------p--pp--" // D0
+        "----------------" // E0
+        "bph------p--pp--";// F0
+
+    static_assert(sizeof(CycleTable) == 257 && sizeof(ExtraTable) == 257,
+                  "The timing tables must have 256 entries");
+
+    struct OpcodeModeTable
+    {
+        unsigned char mode[256];
+    };
+
+    constexpr OpcodeModeTable BuildOpcodeModes()
+    {
+        OpcodeModeTable result {};
+        for(const InsRecord& r: Decoded.record)
+            for(unsigned m=0; m<r.modecount; ++m)
+                if(r.action[m] >= 0 && r.action[m] < 0x100)
+                    result.mode[r.action[m]] = m;
+        return result;
+    }
+
+    constexpr OpcodeModeTable OpcodeModes = BuildOpcodeModes();
+}
+
+const InsRecord* FindInstruction(const std::string& token)
+{
+    const unsigned h = HashToken(token.data(), token.size(), InsHash.seed);
+    const unsigned index = InsHash.slot[h];
+    if(index == 0xFF) return nullptr;
+
+    const InsRecord& r = Decoded.record[index];
+    if(std::strncmp(r.token, token.data(), token.size()) || r.token[token.size()])
+        return nullptr;
+    return &r;
+}
 
 unsigned GetOperand1Size(unsigned modenum)
 {
@@ -178,12 +354,24 @@ unsigned GetOperandSize(unsigned modenum)
     return GetOperand1Size(modenum) + GetOperand2Size(modenum);
 }
 
+OpcodeTiming GetOpcodeTiming(unsigned char opcode)
+{
+    OpcodeTiming result;
+    result.mode   = OpcodeModes.mode[opcode];
+    result.cycles = CycleTable[opcode] - '0';
+    switch(ExtraTable[opcode])
+    {
+        case 'p': result.extra = OpcodeTiming::PageCross; break;
+        case 'b': result.extra = OpcodeTiming::Branch; break;
+        case 'h': result.extra = OpcodeTiming::Halt; break;
+        default:  result.extra = OpcodeTiming::None;
+    }
+    return result;
+}
+
 bool IsReservedWord(const std::string& s)
 {
-    const struct ins *insdata = std::lower_bound(ins, ins+InsCount, s);
-    return (insdata < ins+InsCount && s == insdata->token)
-         || s == ".byt"
-         || s == ".word";
+    return FindInstruction(s) != nullptr;
 }
 
 #if 0
@@ -21,7 +21,44 @@ struct ins
 {
     const char *token;
     const char *opcodes;
-    bool operator< (const std::string &s) const { return s > token; }
 };
 extern const struct ins ins[];
 extern const unsigned InsCount;
+
+enum { MaxAddrModes = 15 };
+
+/* What an addressing mode of a token does, besides emitting an opcode (0..255) */
+enum InsAction
+{
+    NoMode = -1,
+    ActStartBlock = 0x100, ActEndBlock,
+    ActSelectTEXT, ActSelectDATA, ActSelectZERO, ActSelectBSS,
+    ActLink, ActNop, ActCycles,
+    ActByte, ActWord, ActLong // Data directives, they take no addressing modes
+};
+
+/* An entry of ins[] with its opcodes decoded at compile time */
+struct InsRecord
+{
+    const char*   token;
+    unsigned char modecount;            // Addressing modes to try, in order
+    short         action[MaxAddrModes]; // Opcode or InsAction of each mode
+};
+
+/* Finds an instruction or a directive through a perfect hash.
+ * Returns NULL if the token isn't one.
+ */
+const InsRecord* FindInstruction(const std::string& token);
+
+/* How long an opcode takes on the NMOS 6502 */
+struct OpcodeTiming
+{
+    unsigned char mode;   // Addressing mode, for the operand size
+    unsigned char cycles; // When no page is crossed and no branch is taken
+    enum { None, PageCross, Branch, Halt } extra;
+};
+/* PageCross: +1 if the indexing crosses a page.
+ * Branch:    +1 if taken, +1 more if taken to another page.
+ * Halt:      never finishes.
+ */
+OpcodeTiming GetOpcodeTiming(unsigned char opcode);
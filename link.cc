@@ -1,26 +1,37 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cerrno>
 #include <vector>
 #include <cstring>
 
-#include <unistd.h> // For ftruncate
 
 using namespace std;
 
 #include "o65linker.hh"
 #include "msginsert.hh"
-#include "dataarea.hh"
 #include "romaddr.hh"
 #include "space.hh"
 
 #include "object.hh"
+#include "linkmap.hh"
+#include "placement.hh"
+#include "memmap.hh"
+#include "chrlink.hh"
+#include "parallel.hh"
+#include "stats.hh"
 
 #include <getopt.h>
 
-bool already_reprocessed = true; /* required by object.cc, not really used */
 bool assembly_errors = false;
 
-extern unsigned ROMmap_npages; // from romaddr.cc, number of 0x4000-byte pages
-static unsigned MapperNo = 2;
+static bool NES2header = false;
+static BinPackingMethod PackMethod = BinPackGreedy;
+static unsigned PackBudget = 1000; // milliseconds
+
+static StatTimer LoadTime("load");
+static StatTimer LinkTime("link");
+static StatTimer OutputTime("output");
 
 namespace
 {
@@ -43,6 +54,51 @@ namespace
             std::fprintf(stderr, "Error: Unknown output format %s'\n", s.c_str());
         }
     }
+
+    void SetPackingMethod(const std::string& s)
+    {
+        if(s == "greedy") PackMethod = BinPackGreedy;
+        else if(s == "ffd") PackMethod = BinPackFirstFit;
+        else if(s == "exact") PackMethod = BinPackExact;
+        else
+        {
+            std::fprintf(stderr, "Error: Unknown packing method `%s'\n", s.c_str());
+        }
+    }
+
+    /* Reads a size in bytes, with an optional K or M suffix */
+    bool ParseSize(const char* s, unsigned long& result)
+    {
+        char* end;
+        result = std::strtoul(s, &end, 0);
+        if(end == s) return false;
+        switch(*end)
+        {
+            case 'k': case 'K': result <<= 10; ++end; break;
+            case 'm': case 'M': result <<= 20; ++end; break;
+        }
+        return !*end;
+    }
+
+    /* NES 2.0 ROM size: the count of 16k (PRG) or 8k (CHR) units in 12 bits, or
+     * as 2^E*(2*M+1) bytes in the exponent-multiplier notation.
+     */
+    bool EncodeNES2size(unsigned long bytes, unsigned long unit, unsigned& lsb, unsigned& msb)
+    {
+        if(bytes % unit == 0 && bytes / unit < 0xF00)
+        {
+            lsb = (bytes / unit) & 0xFF;
+            msb = (bytes / unit) >> 8;
+            return true;
+        }
+        if(!bytes) return false;
+        unsigned exponent = 0;
+        while(!(bytes & 1)) { bytes >>= 1; ++exponent; }
+        if(bytes > 7) return false;
+        lsb = (exponent << 2) | (bytes >> 1);
+        msb = 0xF;
+        return true;
+    }
 }
 
 void MessageLinkingModules(unsigned count)
@@ -86,53 +142,121 @@ void MessageUndefinedSymbols(unsigned n)
     std::fprintf(stderr, "O65 linker: Still %u undefined symbol(s)\n", n);
 }
 
-static void MapNESintoROM(DataArea& area, const Object& obj)
+namespace
 {
-    unsigned base = obj.GetSegmentBase();
-    unsigned size = obj.GetSegmentSize();
+    struct InputFile
+    {
+        bool loaded   = false;
+        bool is_ips   = false;
+        O65 object;
+        std::map<SegmentSelection,LinkageWish> Linkage;
+        std::string messages; // printed when the file is added to the linker
+    };
+
+    void AddMessage(std::string& messages, const char* fmt, ...)
+    {
+        char Buf[1024];
+        va_list ap;
+        va_start(ap, fmt);
+        std::vsnprintf(Buf, sizeof(Buf), fmt, ap);
+        va_end(ap);
+        messages += Buf;
+    }
 
-    //fprintf(stderr, "base=%u, size=%u\n", base,size);
-    std::multimap<unsigned, std::pair<unsigned,unsigned>> blobs; //For sorting
-    while(size > 0)
+    /* Runs on a worker thread; must not touch anything but "in".
+     * The file is closed before returning, so that no more files are
+     * open at once than there are workers.
+     */
+    void LoadInput(const std::string& filename, InputFile& in)
     {
-        unsigned gran       = 0x2000;
-        unsigned base_begin = base - (base % gran);
-        unsigned base_end   = base_begin + gran;
+        char Buf[5] = {0};
+        std::FILE* fp = std::fopen(filename.c_str(), "rb");
+        if(!fp)
+        {
+            AddMessage(in.messages, "%s: %s\n", filename.c_str(), std::strerror(errno));
+            return;
+        }
+        in.loaded = true;
+
+        std::fread(Buf, 1, 5, fp);
+        if(!std::strncmp(Buf, "PATCH", 5) || !std::strncmp(Buf, "IPS32", 5))
+        {
+            /* IPS files are read by the linker itself, later */
+            in.is_ips = true;
+            std::fclose(fp);
+            return;
+        }
 
-        unsigned write_to    = NES2ROMaddr(base);
-        unsigned write_count = size;
-        if(base + write_count > base_end) write_count = base_end - base;
+        in.object.Load(fp);
+        std::fclose(fp);
 
-        blobs.emplace(write_to, std::pair<unsigned,unsigned>(base, write_count));
+        const vector<pair<unsigned char, string> >&
+            customheaders = in.object.GetCustomHeaders();
 
-        base += write_count;
-        size -= write_count;
-    }
-    for(auto& b: blobs)
-    {
-        unsigned write_to    = b.first;
-        unsigned base        = b.second.first;
-        unsigned write_count = b.second.second;
-        auto lump = obj.GetContent(base, write_count);
-        if(std::any_of(lump.begin(), lump.end(), [&](unsigned n){return n!=0;}))
+        for(unsigned b=0; b<customheaders.size(); ++b)
         {
-            std::fprintf(stderr, "  base=$%X, size=$%X, write_to=$%X, write_count=$%X\n",
-                base, size, write_to, write_count);
-
-            area.WriteLump(write_to, lump);
+            unsigned char type = customheaders[b].first;
+            const string& data = customheaders[b].second;
+            switch(type)
+            {
+                case 10: // linkage type
+                {
+                    unsigned param = 0;
+                    if(data.size() >= 5)
+                    {
+                        param = (data[1] & 0xFF)
+                              | ((data[2] & 0xFF) << 8)
+                              | ((data[3] & 0xFF) << 16)
+                              | ((data[4] & 0xFF) << 24);
+                    }
+                    unsigned seg = data[0] / 8, mode = data[0] & 7;
+                    switch(mode)
+                    {
+                        case 0:
+                            in.Linkage[SegmentSelection(seg)] = LinkageWish();
+                            break;
+                        case 1:
+                            in.Linkage[SegmentSelection(seg)].SetLinkageGroup(param);
+                            AddMessage(in.messages, "%s of %s will be linked in group %u\n",
+                                 GetSegmentName(SegmentSelection(seg)).c_str(),
+                                 filename.c_str(), param);
+                            break;
+                        case 2:
+                            unsigned addr = ROM2NESaddr(param*GetPageSize());
+                            param = addr/GetPageSize();
+                            in.Linkage[SegmentSelection(seg)].SetLinkagePage(param);
+                            AddMessage(in.messages, "%s of %s will be linked in page starting at address $%05X\n",
+                                GetSegmentName(SegmentSelection(seg)).c_str(),
+                                filename.c_str(), param*GetPageSize());
+                            break;
+                    }
+                    break;
+                }
+                case 0: // filename
+                case 1: // operating system header
+                case 2: // assembler name
+                case 3: // author
+                case 4: // creation date
+                    break;
+            }
         }
     }
 }
 
-static void FixupNES(Object& obj, std::FILE* stream)
+static void FixupNES(std::vector<unsigned char>& image)
 {
     bool Mirroring  = true;
     bool Mirroring2 = false;
     bool Trainer = false;
     bool Battery = false;
 
-    unsigned ROM_size  = ROMmap_npages;
-    unsigned VROM_size = 0;
+    const unsigned MapperNo = GetMapperNumber();
+    const unsigned long ROM_bytes = (unsigned long)ROMmap_npages * GetPageSize();
+
+    const unsigned long VROM_bytes = GetCHRsize();
+
+    unsigned ROM_size  = ROM_bytes / 0x4000;
+    unsigned VROM_size = VROM_bytes / 0x2000;
     unsigned ROM_type  = ((MapperNo & 0x0F) << 4)
                         | (Mirroring << 0)
                         | (Battery << 1)
@@ -149,24 +273,36 @@ static void FixupNES(Object& obj, std::FILE* stream)
          0,0,0,0,
          0,0,0,0};
 
-    fseek(stream, 0, SEEK_SET);
-    fwrite(NESheader, 1, 16, stream);
-
-    DataArea rom_obj;
-    obj.SelectTEXT();
-    MapNESintoROM(rom_obj, obj);
-    obj.SelectDATA();
-    MapNESintoROM(rom_obj, obj);
-
-    unsigned filesize = rom_obj.GetTop();
-    unsigned RomSize = ROMmap_npages * GetPageSize();
-    if(filesize < RomSize) filesize = RomSize;
-    std::vector<unsigned char> ROMdata = rom_obj.GetContent(0, filesize);
-
-    fseek(stream, 16, SEEK_SET);
-    fwrite(&ROMdata[0], 1, ROMdata.size(), stream);
+    /* iNES 1.0 has only 8 bits for the PRG size and the mapper number */
+    if(!NES2header && (ROM_size > 0xFF || VROM_size > 0xFF || MapperNo > 0xFF || ROM_bytes % 0x4000))
+    {
+        std::fprintf(stderr, "Note: The ROM doesn't fit an iNES 1.0 header, writing a NES 2.0 header\n");
+        NES2header = true;
+    }
+    if(NES2header)
+    {
+        unsigned ROM_lsb, ROM_msb, VROM_lsb, VROM_msb;
+        if(!EncodeNES2size(ROM_bytes, 0x4000, ROM_lsb, ROM_msb))
+        {
+            std::fprintf(stderr, "Error: The ROM size (%lu) can't be told in a NES 2.0 header\n", ROM_bytes);
+            assembly_errors = true;
+            ROM_lsb = ROM_msb = 0;
+        }
+        if(!EncodeNES2size(VROM_bytes, 0x2000, VROM_lsb, VROM_msb))
+        {
+            std::fprintf(stderr, "Error: The VROM size (%lu) can't be told in a NES 2.0 header\n", VROM_bytes);
+            assembly_errors = true;
+            VROM_lsb = VROM_msb = 0;
+        }
+        NESheader[4]  = ROM_lsb;
+        NESheader[5]  = VROM_lsb;
+        NESheader[7]  = (ROM_type2 & 0xF0) | 0x08; // NES 2.0 identifier
+        NESheader[8]  = (MapperNo >> 8) & 0x0F;   // no submapper
+        NESheader[9]  = (VROM_msb << 4) | ROM_msb;
+        NESheader[11] = VROM_size ? 0 : 7;        // 64<<7 = 8k of CHR-RAM
+    }
 
-    ftruncate(fileno(stream), ROMdata.size()+16);
+    std::copy(NESheader, NESheader+16, image.begin());
 }
 
 static void Import(O65linker& linker, Object& obj, SegmentSelection seg)
@@ -208,12 +344,22 @@ static void WriteOut(O65linker& linker, std::FILE* stream)
             obj.WriteO65(stream);
             break;
         case RAWformat:
-            obj.WriteRAW(stream, ROMmap_npages*GetPageSize());
+        {
+            std::vector<unsigned char> image;
+            obj.BuildRAW(image, ROMmap_npages*GetPageSize(), 0, GetFillByte());
+            AppendCHR(image, GetFillByte());
+            if(!image.empty()) std::fwrite(&image[0], 1, image.size(), stream);
             break;
+        }
         case NESformat:
-            obj.WriteRAW(stream, ROMmap_npages*GetPageSize(), 16);
-            FixupNES(obj, stream);
+        {
+            std::vector<unsigned char> image;
+            obj.BuildRAW(image, ROMmap_npages*GetPageSize(), 16, GetFillByte());
+            AppendCHR(image, GetFillByte());
+            FixupNES(image);
+            std::fwrite(&image[0], 1, image.size(), stream);
             break;
+        }
     }
     obj.Dump();
 }
@@ -225,6 +371,11 @@ int main(int argc, char** argv)
     std::FILE *output = NULL;
     std::string outfn;
 
+    unsigned long romsize = 0; // 0 = the default number of pages
+    bool drop_unreferenced = false;
+    std::vector<std::string> roots;
+    enum { NoFolding, FoldSafe, FoldAll } folding = NoFolding;
+
     for(;;)
     {
         int option_index = 0;
@@ -234,10 +385,25 @@ int main(int argc, char** argv)
             {"version",  0,0,'V'},
             {"output",   0,0,'o'},
             {"outformat", 0,0,'f'},
-            {"romsize",  0,0,'s'},
+            {"romsize",  1,0,'s'},
+            {"packer",   1,0,'p'},
+            {"packtime", 1,0,501},
+            {"jobs",     1,0,'j'},
+            {"stats",    2,0,502},
+            {"map",      1,0,503},
+            {"gc",       0,0,504},
+            {"root",     1,0,'u'},
+            {"fold",     2,0,505},
+            {"placement",1,0,506},
+            {"memmap",   1,0,'m'},
+            {"mapper",   1,0,507},
+            {"nes2",     0,0,508},
+            {"chr",      1,0,509},
+            {"chrbank",  1,0,510},
+            {"chrsize",  1,0,511},
             {0,0,0,0}
         };
-        int c = getopt_long(argc,argv, "hVo:f:s:", long_options, &option_index);
+        int c = getopt_long(argc,argv, "hVo:f:s:p:j:u:m:", long_options, &option_index);
         if(c==-1) break;
         switch(c)
         {
@@ -265,13 +431,42 @@ int main(int argc, char** argv)
                     " --version, -V         Displays version information\n"
                     " -f, --outformat <fmt> Select output format: ips,raw,o65,nes (default: ips)\n"
                     " -o <file>             Places the output into <file>\n"
-                    " -s <size>             Desired size of the ROM (must be a multiple of 16384)\n"
+                    " -s <size>             Desired size of the ROM, e.g. 131072, 0x20000 or 128K\n"
+                    "                         (must be a multiple of the bank size)\n"
+                    " --mapper <name|n>     Bank layout of the ROM: %s,\n"
+                    "                         or the iNES mapper number (default: unrom)\n"
+                    " --nes2                Write a NES 2.0 header in the nes format; it is also\n"
+                    "                         used when the ROM doesn't fit an iNES 1.0 header\n"
+                    " --chr [<name>=]<file> Place the pattern tables in <file> into the CHR-ROM\n"
+                    "                         and define <name> as their bank (see chrlink.hh)\n"
+                    " --chrbank <size>      CHR bank size: 1K, 2K, 4K or 8K (default: 8K)\n"
+                    " --chrsize <size>      CHR-ROM size (default: as small as the files fit in)\n"
+                    " -m, --memmap <file>   Read the free ROM and RAM areas from <file>\n"
+                    "                         (see memmap.hh for the syntax)\n"
+                    " -p, --packer <method> Select placement method: greedy,ffd,exact (default: greedy)\n"
+                    " --packtime <ms>       Time limit of the exact packer for each placement\n"
+                    "                         (default: %u); the pages tried for a group share it\n"
+                    " -j, --jobs <n>        Number of threads for loading and relocating (default: one per CPU)\n"
+                    " --stats[=<fmt>[:<file>]]\n"
+                    "                       Report phase times and counters as text or json\n"
+                    "                         (default: text to stderr)\n"
+                    " --map [<fmt>:]<file>  Write where each object and symbol was placed\n"
+                    "                         and how full each page is, as text or json\n"
+                    " --gc                  Leave out objects that nothing refers to\n"
+                    " -u, --root <symbol>   With --gc, keep whatever <symbol> needs\n"
+                    "                         (blocks at fixed addresses are always kept)\n"
+                    " --fold[=safe|all]     Place identical code and data segments only once\n"
+                    "                         safe: only self-contained segments (default)\n"
+                    "                         all: also those that refer to their own object\n"
+                    " --placement <file>    Keep unchanged objects where <file> says they were\n"
+                    "                         last time, and record this link into it\n"
                     "\n"
-                    "For the NES output format, currently only mapper-%u ROMs are supported with no VROM.\n"
+                    "The CHR-ROM follows the PRG-ROM in the nes and raw output formats.\n"
                     "\nNo warranty whatsoever.\n"
                     ,
                     argv[0],
-                    MapperNo);
+                    GetMapperNames().c_str(),
+                    PackBudget);
                 return 0;
             }
 
@@ -298,27 +493,137 @@ int main(int argc, char** argv)
                 SetOutputFormat(optarg);
                 break;
             }
+            case 'p':
+            {
+                SetPackingMethod(optarg);
+                break;
+            }
+            case 'j':
+            {
+                ParallelThreads = strtol(optarg, 0, 10);
+                break;
+            }
+            case 501:
+            {
+                PackBudget = strtol(optarg, 0, 10);
+                break;
+            }
+            case 502:
+            {
+                if(!SetStatsOption(optarg)) goto ErrorExit;
+                break;
+            }
+            case 503:
+            {
+                if(!SetMapOption(optarg)) goto ErrorExit;
+                break;
+            }
+            case 504:
+            {
+                drop_unreferenced = true;
+                break;
+            }
+            case 'u':
+            {
+                roots.push_back(optarg);
+                break;
+            }
+            case 'm':
+            {
+                if(!LoadMemoryMap(optarg)) goto ErrorExit;
+                break;
+            }
+            case 506:
+            {
+                SetPlacementFile(optarg);
+                break;
+            }
+            case 505:
+            {
+                if(!optarg || !std::strcmp(optarg, "safe")) folding = FoldSafe;
+                else if(!std::strcmp(optarg, "all")) folding = FoldAll;
+                else
+                {
+                    std::fprintf(stderr, "Error: --fold requires 'safe' or 'all'\n");
+                    goto ErrorExit;
+                }
+                break;
+            }
+            case 507:
+            {
+                if(!SelectMapper(optarg))
+                {
+                    std::fprintf(stderr, "Error: Unknown mapper `%s'\n", optarg);
+                    goto ErrorExit;
+                }
+                break;
+            }
+            case 508:
+            {
+                NES2header = true;
+                break;
+            }
+            case 509:
+            {
+                if(!AddCHRfile(optarg)) goto ErrorExit;
+                break;
+            }
+            case 510:
+            {
+                unsigned long size;
+                if(!ParseSize(optarg, size) || !SetCHRbankSize(size))
+                {
+                    std::fprintf(stderr, "Error: The CHR bank size must be 1K, 2K, 4K or 8K\n");
+                    goto ErrorExit;
+                }
+                break;
+            }
+            case 511:
+            {
+                unsigned long size;
+                if(!ParseSize(optarg, size) || !SetCHRsize(size))
+                {
+                    std::fprintf(stderr, "Error: The CHR-ROM size must be a multiple of 8K\n");
+                    goto ErrorExit;
+                }
+                break;
+            }
             case 's':
             {
-                unsigned outsize = strtol(optarg, 0, 10);
-                if(outsize % GetPageSize())
+                if(!ParseSize(optarg, romsize) || !romsize)
                 {
-                    std::fprintf(stderr, "Warning: The given ROMsize (%u, 0x%X) is not a multiple of 0x%X.\n"
-                        "         Using %u (0x%X) instead.\n",
-                        outsize, outsize,
-                        GetPageSize(),
-                        (outsize / GetPageSize())*GetPageSize(),
-                        (outsize / GetPageSize())*GetPageSize()
-                       );
+                    std::fprintf(stderr, "Error: Bad ROM size `%s'\n", optarg);
+                    goto ErrorExit;
                 }
-
-                ROMmap_npages = outsize / GetPageSize();
-                std::fprintf(stderr, "%u pages.\n", ROMmap_npages);
                 break;
             }
         }
     }
 
+    /* The bank size depends on the mapper, so the size is handled last */
+    bool romsize_given;
+    romsize_given = romsize != 0;
+    if(!romsize_given) romsize = ROMmap_npages * 0x4000ul;
+    if(romsize % GetPageSize())
+    {
+        std::fprintf(stderr, "Warning: The given ROMsize (%lu, 0x%lX) is not a multiple of 0x%X.\n"
+            "         Using %lu (0x%lX) instead.\n",
+            romsize, romsize,
+            GetPageSize(),
+            (romsize / GetPageSize())*GetPageSize(),
+            (romsize / GetPageSize())*GetPageSize()
+           );
+    }
+    ROMmap_npages = romsize / GetPageSize();
+    if(ROMmap_npages > 0x10000)
+    {
+        std::fprintf(stderr, "Error: At most 65536 banks (%lu bytes) are supported\n",
+            0x10000ul * GetPageSize());
+        goto ErrorExit;
+    }
+    if(romsize_given)
+        std::fprintf(stderr, "%u pages.\n", ROMmap_npages);
+
     while(optind < argc)
         files.push_back(argv[optind++]);
 
@@ -337,93 +642,49 @@ int main(int argc, char** argv)
 
     O65linker linker;
 
-    for(std::size_t a=0; a<files.size(); ++a)
+    /* Load and parse all inputs concurrently, then
+     * add them to the linker in command line order.
+     */
     {
-        char Buf[5];
-        FILE *fp = std::fopen(files[a].c_str(), "rb");
-        if(!fp)
-        {
-            std::perror(files[a].c_str());
-            continue;
-        }
-
-        std::fread(Buf, 1, 5, fp);
-        if(!std::strncmp(Buf, "PATCH", 5))
-        {
-            linker.LoadIPSfile(fp, files[a]);
-        }
-        else
-        {
-            O65 tmp;
-            tmp.Load(fp);
+        StatScope timing(LoadTime);
 
-            const vector<pair<unsigned char, string> >&
-                customheaders = tmp.GetCustomHeaders();
+        std::vector<InputFile> inputs(files.size());
+        ParallelFor(files.size(), [&](unsigned a) { LoadInput(files[a], inputs[a]); });
 
-            std::map<SegmentSelection,LinkageWish> Linkage;
+        for(std::size_t a=0; a<files.size(); ++a)
+        {
+            InputFile& in = inputs[a];
+            std::fputs(in.messages.c_str(), stderr);
+            if(!in.loaded) continue;
 
-            for(unsigned b=0; b<customheaders.size(); ++b)
+            if(in.is_ips)
             {
-                unsigned char type = customheaders[b].first;
-                const string& data = customheaders[b].second;
-                switch(type)
+                std::FILE* fp = std::fopen(files[a].c_str(), "rb");
+                if(!fp)
                 {
-                    case 10: // linkage type
-                    {
-                        unsigned param = 0;
-                        if(data.size() >= 5)
-                        {
-                            param = (data[1] & 0xFF)
-                                  | ((data[2] & 0xFF) << 8)
-                                  | ((data[3] & 0xFF) << 16)
-                                  | ((data[4] & 0xFF) << 24);
-                        }
-                        unsigned seg = data[0] / 8, mode = data[0] & 7;
-                        switch(mode)
-                        {
-                            case 0:
-                                Linkage[SegmentSelection(seg)] = LinkageWish();
-                                break;
-                            case 1:
-                                Linkage[SegmentSelection(seg)].SetLinkageGroup(param);
-                                std::fprintf(stderr, "%s of %s will be linked in group %u\n",
-                                     GetSegmentName(SegmentSelection(seg)).c_str(),
-                                     files[a].c_str(), param);
-                                break;
-                            case 2:
-                                unsigned addr = ROM2NESaddr(param*GetPageSize());
-                                param = addr/GetPageSize();
-                                Linkage[SegmentSelection(seg)].SetLinkagePage(param);
-                                std::fprintf(stderr, "%s of %s will be linked in page starting at address $%05X\n",
-                                    GetSegmentName(SegmentSelection(seg)).c_str(),
-                                    files[a].c_str(), param*GetPageSize());
-                                break;
-                        }
-                        break;
-                    }
-                    case 0: // filename
-                    case 1: // operating system header
-                    case 2: // assembler name
-                    case 3: // author
-                    case 4: // creation date
-                        break;
+                    std::perror(files[a].c_str());
+                    continue;
                 }
+                linker.LoadIPSfile(fp, files[a]);
+                std::fclose(fp);
             }
+            else
+                linker.AddObject(in.object, files[a], in.Linkage);
 
-            linker.AddObject(tmp, files[a], Linkage);
+            in.object = O65();
         }
-        std::fclose(fp);
     }
 
+    if(drop_unreferenced)
+        linker.DropUnreferenced(roots);
+    if(folding != NoFolding)
+        linker.FoldIdentical(folding == FoldAll);
+    LoadPlacement(linker);
+
     freespacemap freespace_code;
-    // Assume everything is free space!
-    /* FIXME: Make this configurable. */
+    freespace_code.SetPackingMethod(PackMethod, PackBudget);
+    AddROMSpace(freespace_code);
 
-    for(unsigned a=0; a<ROMmap_npages; ++a)
-    {
-        unsigned addr = ROM2NESaddr(a*GetPageSize());
-        freespace_code.Add(addr/GetPageSize(), addr%GetPageSize(), GetPageSize());
-    }
     for(unsigned a=0; a<ROMmap_npages; ++a)
     {
         unsigned addr = ROM2NESaddr(a*GetPageSize());
@@ -431,6 +692,8 @@ int main(int argc, char** argv)
     }
 
     /* Organize the code blobs */
+    KeepPlacement(linker, freespace_code, CODE);
+    KeepPlacement(linker, freespace_code, DATA);
     freespace_code.OrganizeO65linker(linker, CODE);
     freespace_code.OrganizeO65linker(linker, DATA);
 
@@ -443,33 +706,41 @@ int main(int argc, char** argv)
     /* ZERO & BSS all refer to the RAM. */
 
     freespacemap freespace_data;
+    freespace_data.SetPackingMethod(PackMethod, PackBudget);
 
     /* First link the zeropage. It may only use 8-bit addresses. */
-    bool add_mirrors = true;
-    freespace_data.Add(0x00, 0x0000, 0x100);
-    if(add_mirrors)
-        for(unsigned mirror=1; mirror<4; ++mirror)
-            freespace_data.AddAlias(0x00, mirror*0x800+0x0000, 0x100, 0x00,0x0000);
+    AddZeroPageSpace(freespace_data);
+    KeepPlacement(linker, freespace_data, ZERO);
     freespace_data.OrganizeO65linker(linker, ZERO);
 
-    /* 0x100..0x1FF is stack. Don't mark it as free space. */
+    /* 0x100..0x1FF is stack. The default map doesn't mark it as free space. */
 
     /* Then link BSS.
      * If 8-bit addresses remained free from the zeropage segment,
      * they may be used for data addresses.
      */
-
-    freespace_data.Add(0x00, 0x0200, 0x800 - 0x200);
-    if(add_mirrors)
-        for(unsigned mirror=1; mirror<4; ++mirror)
-            freespace_data.AddAlias(0x00, mirror*0x800+0x0200, 0x800-0x200, 0x00,0x0200);
+    AddRAMSpace(freespace_data);
+    KeepPlacement(linker, freespace_data, BSS);
     freespace_data.OrganizeO65linker(linker, BSS);
     freespace_data.DumpPageMap(0);
 
-    linker.Link();
+    if(!LinkCHR(linker)) goto ErrorExit;
+    if(GetCHRsize() && (format == IPSformat || format == O65format))
+        std::fprintf(stderr, "Warning: The CHR-ROM is only written in the nes and raw formats\n");
 
-    WriteOut(linker, output ? output : stdout);
+    {
+        StatScope timing(LinkTime);
+        linker.Link();
+    }
+    WriteLinkMap(linker, freespace_code, freespace_data);
+    SavePlacement(linker);
+    {
+        StatScope timing(OutputTime);
+        WriteOut(linker, output ? output : stdout);
+    }
     if(output) std::fclose(output);
 
+    ReportStats("neslink");
+
     return 0;
 }
@@ -0,0 +1,239 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "linkmap.hh"
+#include "o65linker.hh"
+#include "space.hh"
+#include "romaddr.hh"
+
+namespace
+{
+    std::string MapFile;
+    bool        MapJSON = false;
+
+    struct Placement
+    {
+        unsigned    addr, size;
+        SegmentSelection seg;
+        unsigned    objno;
+    };
+    struct Symbol
+    {
+        unsigned    addr, size;
+        SegmentSelection seg;
+        std::string name;
+        unsigned    objno;
+    };
+    struct PageUse
+    {
+        unsigned    used, free, holes;
+    };
+
+    bool IsRAM(SegmentSelection seg) { return seg == ZERO || seg == BSS; }
+
+    /* ROM bank of a CODE/DATA address, -1 for RAM */
+    int GetBank(SegmentSelection seg, unsigned addr)
+    {
+        if(IsRAM(seg)) return -1;
+        return NES2ROMaddr(addr) / GetPageSize();
+    }
+
+    const std::string JSONString(const std::string& s)
+    {
+        std::string result = "\"";
+        for(unsigned char c: s)
+        {
+            if(c == '"' || c == '\\') { result += '\\'; result += c; }
+            else if(c < 0x20)
+            {
+                char Buf[8];
+                std::sprintf(Buf, "\\u%04X", c);
+                result += Buf;
+            }
+            else result += c;
+        }
+        return result + "\"";
+    }
+
+    void CollectPages(const std::vector<Placement>& placements, bool ram,
+                      const freespacemap& space,
+                      std::map<unsigned, PageUse>& pages)
+    {
+        for(unsigned page: space.GetPageList()) pages[page];
+        for(const Placement& p: placements)
+            if(IsRAM(p.seg) == ram)
+                pages[p.addr / GetPageSize()].used += p.size;
+        for(auto& p: pages)
+        {
+            p.second.free  = space.Size(p.first);
+            p.second.holes = space.GetFragmentation(p.first);
+        }
+    }
+
+    double Percent(const PageUse& p)
+    {
+        const unsigned total = p.used + p.free;
+        return total ? p.used * 100.0 / total : 0.0;
+    }
+}
+
+bool SetMapOption(const char* arg)
+{
+    std::string file = arg;
+    MapJSON = false;
+    if(file.compare(0, 5, "json:") == 0) { MapJSON = true; file.erase(0, 5); }
+    else if(file.compare(0, 5, "text:") == 0) file.erase(0, 5);
+
+    if(file.empty())
+    {
+        std::fprintf(stderr, "Error: --map requires a file name\n");
+        return false;
+    }
+    MapFile = file;
+    return true;
+}
+
+void WriteLinkMap(const O65linker& linker,
+                  const freespacemap& rom,
+                  const freespacemap& ram)
+{
+    if(MapFile.empty()) return;
+
+    static const SegmentSelection segs[4] = { CODE, DATA, ZERO, BSS };
+
+    std::vector<Placement> placements;
+    std::vector<Symbol>    symbols;
+    for(SegmentSelection seg: segs)
+    {
+        const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+        const std::vector<unsigned> addrs = linker.GetAddrList(seg);
+        for(unsigned a=0; a<sizes.size(); ++a)
+        {
+            if(sizes[a]) placements.push_back(Placement{addrs[a], sizes[a], seg, a});
+
+            /* A folded segment has no size of its own; its twin is the same */
+            const unsigned twin = linker.GetFoldedInto(a, seg);
+            const unsigned segsize = twin != ~0U ? sizes[twin] : sizes[a];
+
+            /* Each symbol extends up to the next one, or to the end of the segment */
+            auto syms = linker.GetSymbolList(a, seg);
+            std::sort(syms.begin(), syms.end(),
+                      [](const std::pair<std::string, unsigned>& x,
+                         const std::pair<std::string, unsigned>& y)
+                      { return x.second < y.second; });
+            for(unsigned b=0; b<syms.size(); ++b)
+            {
+                const unsigned end = b+1 < syms.size() ? syms[b+1].second : addrs[a] + segsize;
+                const unsigned size = end > syms[b].second ? end - syms[b].second : 0;
+                symbols.push_back(Symbol{syms[b].second, size, seg, syms[b].first, a});
+            }
+        }
+    }
+
+    auto byaddr = [](const auto& x, const auto& y)
+    {
+        if(IsRAM(x.seg) != IsRAM(y.seg)) return IsRAM(y.seg);
+        return x.addr < y.addr;
+    };
+    std::stable_sort(placements.begin(), placements.end(), byaddr);
+    std::stable_sort(symbols.begin(), symbols.end(), byaddr);
+
+    std::map<unsigned, PageUse> rompages, rampages;
+    CollectPages(placements, false, rom, rompages);
+    CollectPages(placements, true,  ram, rampages);
+
+    std::FILE* fp = stderr;
+    if(MapFile != "-")
+    {
+        fp = std::fopen(MapFile.c_str(), "wt");
+        if(!fp)
+        {
+            std::perror(MapFile.c_str());
+            return;
+        }
+    }
+
+    if(MapJSON)
+    {
+        std::fprintf(fp, "{\"segments\":[");
+        const char* sep = "";
+        for(const Placement& p: placements)
+        {
+            std::fprintf(fp, "%s\n {\"object\":%s,\"segment\":\"%s\",\"address\":%u,\"size\":%u,\"bank\":%d}",
+                sep,
+                JSONString(linker.GetName(p.objno)).c_str(),
+                GetSegmentName(p.seg).c_str(),
+                p.addr, p.size, GetBank(p.seg, p.addr));
+            sep = ",";
+        }
+        std::fprintf(fp, "],\n \"pages\":[");
+        sep = "";
+        for(int r=0; r<2; ++r)
+            for(const auto& p: r ? rampages : rompages)
+            {
+                std::fprintf(fp, "%s\n {\"region\":\"%s\",\"page\":%u,\"bank\":%d,\"used\":%u,\"free\":%u,\"holes\":%u}",
+                    sep, r ? "RAM" : "ROM", p.first,
+                    r ? -1 : GetBank(CODE, p.first * GetPageSize()),
+                    p.second.used, p.second.free, p.second.holes);
+                sep = ",";
+            }
+        std::fprintf(fp, "],\n \"symbols\":[");
+        sep = "";
+        for(const Symbol& s: symbols)
+        {
+            std::fprintf(fp, "%s\n {\"name\":%s,\"object\":%s,\"segment\":\"%s\",\"address\":%u,\"size\":%u}",
+                sep,
+                JSONString(s.name).c_str(),
+                JSONString(linker.GetName(s.objno)).c_str(),
+                GetSegmentName(s.seg).c_str(),
+                s.addr, s.size);
+            sep = ",";
+        }
+        std::fprintf(fp, "]}\n");
+    }
+    else
+    {
+        std::fprintf(fp, "Segments:\n"
+                         "  Address   Size  Bank Seg  Object\n");
+        for(const Placement& p: placements)
+        {
+            const int bank = GetBank(p.seg, p.addr);
+            char Bank[16] = "--";
+            if(bank >= 0) std::sprintf(Bank, "%02X", bank);
+            std::fprintf(fp, "  $%05X  %5u  %-4s %-4s %s\n",
+                p.addr, p.size, Bank,
+                GetSegmentName(p.seg).c_str(),
+                linker.GetName(p.objno).c_str());
+        }
+
+        std::fprintf(fp, "\nPages:\n"
+                         "  Region Page Bank   Used   Free Holes    Use\n");
+        for(int r=0; r<2; ++r)
+            for(const auto& p: r ? rampages : rompages)
+            {
+                char Bank[16] = "--";
+                if(!r) std::sprintf(Bank, "%02X", GetBank(CODE, p.first * GetPageSize()));
+                std::fprintf(fp, "  %-6s %4X %-4s %6u %6u %5u %5.1f%%\n",
+                    r ? "RAM" : "ROM", p.first, Bank,
+                    p.second.used, p.second.free, p.second.holes,
+                    Percent(p.second));
+            }
+
+        std::fprintf(fp, "\nSymbols:\n"
+                         "  Address   Size Seg  Name (Object)\n");
+        for(const Symbol& s: symbols)
+        {
+            std::fprintf(fp, "  $%05X  %5u %-4s %s (%s)\n",
+                s.addr, s.size,
+                GetSegmentName(s.seg).c_str(),
+                s.name.c_str(),
+                linker.GetName(s.objno).c_str());
+        }
+    }
+
+    if(fp != stderr) std::fclose(fp);
+}
@@ -0,0 +1,27 @@
+#ifndef bqtLinkMapHH
+#define bqtLinkMapHH
+
+/* Placement report of neslink, written with --map.
+ *
+ * Lists every placed segment of every object with its address,
+ * size and ROM bank; the use and fragmentation of each page; and
+ * the public symbols sorted by address, each sized up to the next
+ * symbol. It may be written as text or as JSON.
+ */
+
+class O65linker;
+class freespacemap;
+
+/* Handles the argument of --map: [text:|json:]<file>, where - is stderr.
+ * Returns false if it wasn't understood.
+ */
+bool SetMapOption(const char* arg);
+
+/* Writes the report, if --map was given.
+ * Call after linking; rom and ram are the remaining free space.
+ */
+void WriteLinkMap(const O65linker& linker,
+                  const freespacemap& rom,
+                  const freespacemap& ram);
+
+#endif
@@ -1,16 +1,21 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <string>
+#include <thread>
 
 #include <unistd.h> // For unlink
 
 #include "assemble.hh"
 #include "precompile.hh"
 #include "warning.hh"
+#include "stats.hh"
+#include "server.hh"
+#include "objcache.hh"
 
 #include <getopt.h>
 
-bool already_reprocessed = true; // affects jump length counting
 bool assembly_errors = false;
 
 namespace
@@ -32,9 +37,13 @@ namespace
             std::fprintf(stderr, "Error: Unknown output format `%s'\n", s.c_str());
         }
     }
+
+    StatTimer AssembleTime("assemble");
+    StatTimer ReprocessTime("reprocess");
+    StatTimer OutputTime("output");
 }
 
-int main(int argc, char**argv)
+static int Assemble(int argc, char**argv)
 {
     bool assemble = true;
     std::vector<std::string> files;
@@ -42,6 +51,16 @@ int main(int argc, char**argv)
     std::FILE *output = NULL;
     std::string outfn;
 
+    /* Options that affect the output, for the object cache key */
+    std::string keyoptions;
+
+    unsigned jobs = 1;
+
+    bool list_cycles = false;
+
+    if(const char* cachedir = std::getenv("NESCOM_CACHE"))
+        SetObjectCacheDir(cachedir);
+
     for(;;)
     {
         int option_index = 0;
@@ -57,10 +76,21 @@ int main(int argc, char**argv)
             {"outformat", 0,0,'f'},
             {"out_ips",   0,0,'I'},
             {"warn",      0,0,'W'},
+            {"stats",     2,0,502},
+            {"cache",     1,0,503},
+            {"cache-size",1,0,504},
+            {"jobs",      1,0,'j'},
+            {"cycles",    0,0,505},
             {0,0,0,0}
         };
-        int c = getopt_long(argc,argv, "hVo:EcJf:IW:", long_options, &option_index);
+        int c = getopt_long(argc,argv, "hVo:EcJf:IW:j:", long_options, &option_index);
         if(c==-1) break;
+        if(c == 'J' || c == 'f' || c == 'I' || c == 'W')
+        {
+            keyoptions += (char)c;
+            if(optarg) keyoptions += optarg;
+            keyoptions += '\0';
+        }
         switch(c)
         {
             case 'V': //version
@@ -97,6 +127,28 @@ int main(int argc, char**argv)
 
             case 'I': SetOutputFormat("ips"); break;
 
+            case 502: //stats
+                if(!SetStatsOption(optarg)) goto ErrorExit;
+                break;
+
+            case 'j':
+                jobs = std::strtoul(optarg, 0, 10);
+                if(!jobs) jobs = std::thread::hardware_concurrency();
+                if(!jobs) jobs = 1;
+                break;
+
+            case 503: //cache
+                SetObjectCacheDir(optarg);
+                break;
+
+            case 504: //cache-size
+                SetObjectCacheSize(std::strtoul(optarg, 0, 10));
+                break;
+
+            case 505: //cycles
+                list_cycles = true;
+                break;
+
             case 'h':
                 std::printf(
                     "6502 assembler\n"
@@ -115,6 +167,15 @@ int main(int argc, char**argv)
                     " -f, --outformat <fmt> Select output format: ips,raw,o65 (default: o65)\n"
                     "                         -I is short for -fips\n"
                     " -W <type>             Enable warnings\n"
+                    " -j, --jobs <n>        Preprocess up to <n> inputs at once (0: all cores)\n"
+                    " --stats[=<fmt>[:<file>]]\n"
+                    "                       Report phase times and counters as text or json\n"
+                    "                         (default: text to stderr)\n"
+                    " --cache <dir>         Reuse outputs cached in <dir> (default: $NESCOM_CACHE)\n"
+                    " --cache-size <MB>     Limit the size of the cache (default: 256)\n"
+                    " --cycles              List the cycles that each scope takes\n"
+                    " --server <socket>     Run as a daemon serving requests on <socket>;\n"
+                    "                         set NESCOM_SERVER=<socket> to use it\n"
                     "\nNo warranty whatsoever.\n",
                     argv[0]);
                 return 0;
@@ -182,73 +243,127 @@ int main(int argc, char**argv)
      *        - Verbose errors
      */
 
-Reprocess:
-    obj.ClearMost();
+    /* With --jumps, the preprocessed inputs are kept in memory.
+     * Short jumps that are out of range are flipped into
+     * a reverse branch over a JMP, which grows the code and may
+     * push more of them out of range; so the kept inputs are
+     * assembled again until no new flips are needed.
+     */
+    std::vector<std::string> precompiled;
+
+    /* With an object cache, the output is looked up
+     * by the preprocessed inputs before assembling them.
+     */
+    std::string cachekey;
 
-    for(unsigned a=0; a<files.size(); ++a)
     {
-        std::FILE *fp = NULL;
+        StatScope timing(AssembleTime);
 
-        const std::string& filename = files[a];
-        if(filename != "-" && !filename.empty())
+        /* With --jobs, the inputs are preprocessed concurrently, but
+         * still assembled one after another in the command-line order:
+         * each continues in the segments and scopes the previous left.
+         */
+        if(assemble && (fix_jumps || ObjectCacheEnabled() || jobs > 1))
+            precompiled = PrecompileFilesToMemory(files, jobs);
+        else for(unsigned a=0; a<files.size(); ++a)
         {
-            fp = std::fopen(filename.c_str(), "rt");
-            if(!fp)
+            std::FILE *fp = NULL;
+
+            const std::string& filename = files[a];
+            if(filename != "-" && !filename.empty())
             {
-                std::perror(filename.c_str());
-                continue;
+                fp = std::fopen(filename.c_str(), "rt");
+                if(!fp)
+                {
+                    std::perror(filename.c_str());
+                    continue;
+                }
             }
+
+            if(!assemble)
+                Precompile(fp ? fp : stdin, output ? output : stdout);
+            else
+                PrecompileAndAssemble(fp ? fp : stdin, obj);
+
+            if(fp)
+                std::fclose(fp);
         }
-        else
+
+        /* The cycle listing isn't part of a cached output */
+        if(assemble && ObjectCacheEnabled() && !list_cycles)
         {
-            if(fix_jumps)
+            ObjectCacheKey key;
+            key.Add("nescom " VERSION);
+            key.Add(keyoptions);
+            for(unsigned a=0; a<precompiled.size(); ++a)
+                key.Add(precompiled[a]);
+            cachekey = key.Hex();
+
+            if(FetchCachedObject(cachekey, output ? output : stdout))
             {
-                std::fprintf(stderr, "Error: --jumps can't be used with stdin-input!\n");
-                assembly_errors=true;
+                assemble = false;
+                precompiled.clear();
             }
+            else
+                BeginCapturingMessages(); // To show them again on a hit
         }
 
-        if(assemble)
-            PrecompileAndAssemble(fp ? fp : stdin, obj);
-        else
-            Precompile(fp ? fp : stdin, output ? output : stdout);
-
-        if(fp)
-            std::fclose(fp);
+        for(unsigned a=0; a<precompiled.size(); ++a)
+            AssemblePrecompiled(precompiled[a], obj);
     }
 
     if(assemble && !assembly_errors)
     {
         obj.CloseSegments();
 
-        if(obj.NeedsFlipping())
+        while(obj.NeedsFlipping() && !assembly_errors)
         {
-            if(already_reprocessed)
-            {
-                std::fprintf(stderr, "Error: Three-pass jump fixing not supported, sorry\n");
-                assembly_errors = true;
-                goto ErrorExit;
-            }
-            already_reprocessed = true;
-            goto Reprocess;
+            StatScope timing(ReprocessTime);
+
+            obj.ClearMost();
+            for(unsigned a=0; a<precompiled.size(); ++a)
+                AssemblePrecompiled(precompiled[a], obj);
+            obj.CloseSegments();
         }
+    }
 
+    if(assemble && list_cycles)
+        obj.DumpCycles();
+
+    if(assemble && !assembly_errors)
+    {
         std::FILE* stream = output ? output : stdout;
 
-        switch(format)
+        std::string tempname;
+        std::FILE* cached = cachekey.empty() ? NULL : BeginCachedObject(tempname);
+        std::FILE* target = stream;
+
         {
-            case IPSformat:
-                obj.WriteIPS(stream);
-                break;
-            case O65format:
-                obj.WriteO65(stream);
-                break;
-            case RAWformat:
-                obj.WriteRAW(stream);
-                break;
+            StatScope timing(OutputTime);
+            if(cached) stream = cached;
+            switch(format)
+            {
+                case IPSformat:
+                    obj.WriteIPS(stream);
+                    break;
+                case O65format:
+                    obj.WriteO65(stream);
+                    break;
+                case RAWformat:
+                    obj.WriteRAW(stream);
+                    break;
+            }
         }
         obj.Dump();
+
+        /* Writing may fail too; such output is not filed */
+        const std::string messages = EndCapturingMessages();
+        if(cached && !assembly_errors)
+            StoreCachedObject(cachekey, tempname, cached, target, messages);
+        else if(cached)
+            DiscardCachedObject(tempname, cached, target);
     }
+    EndCapturingMessages();
 
     if(output) std::fclose(output);
 
@@ -257,5 +372,23 @@ Reprocess:
         unlink(outfn.c_str());
     }
 
+    ReportStats("nescom");
+
     return assembly_errors ? 1 : 0;
 }
+
+int main(int argc, char**argv)
+{
+    if(argc == 3 && !std::strcmp(argv[1], "--server"))
+    {
+        return RunServer(argv[2], Assemble);
+    }
+
+    if(const char* socketpath = std::getenv("NESCOM_SERVER"))
+    {
+        int exitcode;
+        if(RunClient(socketpath, argc, argv, exitcode)) return exitcode;
+    }
+
+    return Assemble(argc, argv);
+}
@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "memmap.hh"
+#include "space.hh"
+#include "romaddr.hh"
+
+namespace
+{
+    struct Range
+    {
+        unsigned begin, end; // inclusive
+    };
+    struct Mirror
+    {
+        unsigned begin, end, real;
+    };
+
+    std::vector<Range> ROM       = { {0, ~0U} }; // Clipped to the ROM size
+    std::vector<Range> ZeroPage  = { {0x0000, 0x00FF} };
+    std::vector<Range> RAM       = { {0x0200, 0x07FF} };
+    std::vector<Mirror> Mirrors  =
+    {
+        {0x0800, 0x08FF, 0x0000}, {0x0A00, 0x0FFF, 0x0200},
+        {0x1000, 0x10FF, 0x0000}, {0x1200, 0x17FF, 0x0200},
+        {0x1800, 0x18FF, 0x0000}, {0x1A00, 0x1FFF, 0x0200}
+    };
+    std::vector<Range> ReservedROM, ReservedRAM;
+    unsigned char Fill = 0x00;
+
+    bool ParseNumber(const char*& s, unsigned& result)
+    {
+        while(*s == ' ' || *s == '\t') ++s;
+        char* end;
+        if(*s == '$')
+            result = std::strtoul(s+1, &end, 16);
+        else if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+            result = std::strtoul(s, &end, 16);
+        else // Not octal, even with leading zeros
+            result = std::strtoul(s, &end, 10);
+        if(end == s || (*s == '$' && end == s+1)) return false;
+        s = end;
+        return true;
+    }
+
+    const std::string ParseWord(const char*& s)
+    {
+        while(*s == ' ' || *s == '\t') ++s;
+        const char* begin = s;
+        while(*s && *s != ' ' && *s != '\t') ++s;
+        std::string result(begin, s);
+        for(char& c: result) c = std::toupper((unsigned char)c);
+        return result;
+    }
+
+    /* Calls func(address, length) for the part of the range in each page */
+    template<typename F>
+    void ForEachPage(unsigned begin, unsigned end, F func)
+    {
+        for(unsigned long pos = begin; pos <= end; )
+        {
+            const unsigned long pageend = (pos / GetPageSize() + 1) * GetPageSize();
+            const unsigned long length = std::min<unsigned long>(end + 1ul, pageend) - pos;
+            func(pos, (unsigned)length);
+            pos += length;
+        }
+    }
+
+    /* ROM offsets are translated into the addresses that freespacemap uses */
+    void ROMrange(freespacemap& space, const Range& r, bool add)
+    {
+        const unsigned long romsize = (unsigned long)ROMmap_npages * GetPageSize();
+        if(r.begin >= romsize) return;
+        const unsigned end = std::min<unsigned long>(r.end, romsize - 1);
+        ForEachPage(r.begin, end, [&](unsigned long pos, unsigned length)
+        {
+            const unsigned addr = ROM2NESaddr(pos);
+            if(add)
+                space.Add(addr / GetPageSize(), addr % GetPageSize(), length);
+            else
+                space.Del(addr / GetPageSize(), addr % GetPageSize(), length);
+        });
+    }
+
+    void RAMrange(freespacemap& space, const Range& r, bool add)
+    {
+        ForEachPage(r.begin, r.end, [&](unsigned long pos, unsigned length)
+        {
+            if(add)
+                space.Add(pos, length);
+            else
+                space.Del(pos, length);
+        });
+    }
+
+    void AddRAMregion(freespacemap& space, const std::vector<Range>& ranges)
+    {
+        for(const Range& r: ranges) RAMrange(space, r, true);
+
+        for(const Mirror& m: Mirrors)
+            for(const Range& r: ranges)
+                if(m.real >= r.begin && m.real <= r.end)
+                {
+                    space.AddAlias(m.begin / GetPageSize(), m.begin % GetPageSize(),
+                                   m.end - m.begin + 1,
+                                   m.real / GetPageSize(), m.real % GetPageSize());
+                    break;
+                }
+
+        for(const Range& r: ReservedRAM) RAMrange(space, r, false);
+    }
+}
+
+bool LoadMemoryMap(const char* filename)
+{
+    std::FILE* fp = std::fopen(filename, "rt");
+    if(!fp)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    std::vector<Range> rom, zeropage, ram;
+    std::vector<Mirror> mirrors;
+    bool mirrors_given = false;
+    bool ok = true;
+
+    char Buf[1024];
+    for(unsigned line = 1; std::fgets(Buf, sizeof Buf, fp); ++line)
+    {
+        Buf[std::strcspn(Buf, "#\r\n")] = '\0';
+        const char* s = Buf;
+
+        const std::string keyword = ParseWord(s);
+        if(keyword.empty()) continue;
+
+        std::vector<Range>* list = nullptr;
+        if(keyword == "ROM") list = &rom;
+        else if(keyword == "ZEROPAGE") list = &zeropage;
+        else if(keyword == "RAM") list = &ram;
+        else if(keyword == "RESERVE")
+        {
+            const std::string what = ParseWord(s);
+            if(what == "ROM") list = &ReservedROM;
+            else if(what == "RAM") list = &ReservedRAM;
+            else
+            {
+                std::fprintf(stderr, "%s:%u: RESERVE requires ROM or RAM\n", filename, line);
+                ok = false;
+                continue;
+            }
+        }
+
+        Range r;
+        unsigned real = 0;
+        if(keyword == "FILL")
+        {
+            if(!ParseNumber(s, real) || real > 0xFF)
+            {
+                std::fprintf(stderr, "%s:%u: FILL requires a byte\n", filename, line);
+                ok = false;
+            }
+            Fill = real;
+        }
+        else if(keyword == "MIRROR")
+        {
+            if(!ParseNumber(s, r.begin) || !ParseNumber(s, r.end) || !ParseNumber(s, real)
+            || r.end < r.begin
+            || r.begin / GetPageSize() != r.end / GetPageSize()
+            || (real + r.end - r.begin) / GetPageSize() != real / GetPageSize())
+            {
+                std::fprintf(stderr, "%s:%u: MIRROR requires <begin> <end> <real> within a page\n",
+                    filename, line);
+                ok = false;
+                continue;
+            }
+            mirrors.push_back(Mirror{r.begin, r.end, real});
+            mirrors_given = true;
+        }
+        else if(list)
+        {
+            if(!ParseNumber(s, r.begin) || !ParseNumber(s, r.end) || r.end < r.begin)
+            {
+                std::fprintf(stderr, "%s:%u: %s requires <begin> <end>\n",
+                    filename, line, keyword.c_str());
+                ok = false;
+                continue;
+            }
+            list->push_back(r);
+        }
+        else
+        {
+            std::fprintf(stderr, "%s:%u: Unknown keyword `%s'\n", filename, line, keyword.c_str());
+            ok = false;
+        }
+    }
+    std::fclose(fp);
+
+    if(!rom.empty()) ROM.swap(rom);
+    if(!zeropage.empty()) ZeroPage.swap(zeropage);
+    if(!ram.empty()) RAM.swap(ram);
+    if(mirrors_given) Mirrors.swap(mirrors);
+    return ok;
+}
+
+void AddROMSpace(freespacemap& space)
+{
+    for(const Range& r: ROM) ROMrange(space, r, true);
+    for(const Range& r: ReservedROM) ROMrange(space, r, false);
+}
+
+void AddZeroPageSpace(freespacemap& space)
+{
+    AddRAMregion(space, ZeroPage);
+}
+
+void AddRAMSpace(freespacemap& space)
+{
+    AddRAMregion(space, RAM);
+}
+
+unsigned char GetFillByte()
+{
+    return Fill;
+}
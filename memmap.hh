@@ -0,0 +1,35 @@
+#ifndef bqtMemMapHH
+#define bqtMemMapHH
+
+/* Memory map of neslink: where the segments may be placed.
+ *
+ * Without a memory map file, all of the ROM is free, the zero page
+ * is $00-$FF and the rest of the RAM is $200-$7FF, both mirrored
+ * thrice. A memory map file describes the layout line by line:
+ *
+ *   # comment
+ *   ROM      <begin> <end>          ROM offsets (without the NES header)
+ *   ZEROPAGE <begin> <end>          for the ZERO segments
+ *   RAM      <begin> <end>          for the BSS segments, e.g. $6000 $7FFF
+ *   MIRROR   <begin> <end> <real>   <begin>..<end> shows the RAM at <real>
+ *   RESERVE  ROM|RAM <begin> <end>  never place anything there
+ *   FILL     <byte>                 fills unused ROM in raw and nes output
+ *
+ * Numbers are decimal, or hexadecimal after $ or 0x. Ends are
+ * inclusive. A kind of region that the file doesn't mention
+ * keeps its default.
+ */
+
+class freespacemap;
+
+/* Returns false if the file can't be read or understood */
+bool LoadMemoryMap(const char* filename);
+
+/* Each of these adds the free space for one kind of segments */
+void AddROMSpace(freespacemap& space);       // CODE and DATA
+void AddZeroPageSpace(freespacemap& space);  // ZERO
+void AddRAMSpace(freespacemap& space);       // BSS
+
+unsigned char GetFillByte();
+
+#endif
@@ -12,6 +12,7 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <algorithm>
 
 #include "o65.hh"
 
@@ -117,6 +118,10 @@ public:
         }
         return result;
     }
+    const std::string& GetName(unsigned a) const
+    {
+        return nosym.find(a)->second;
+    }
     void DumpUndefines() const
     {
         for(std::set<unsigned>::const_iterator
@@ -152,6 +157,7 @@ private:
     friend class O65;
     void Locate(SegmentSelection seg, unsigned diff, bool is_me);
     void LocateSym(unsigned symno, unsigned newaddress);
+    void LocateSyms(const std::vector<std::pair<unsigned,unsigned> >& values);
     void LoadRelocations(FILE* fp);
 };
 
@@ -744,6 +750,40 @@ void O65::LinkSym(const std::string& name, unsigned value)
     defs->Define(symno, value);
 }
 
+void O65::LinkSyms(const std::vector<std::pair<std::string, unsigned> >& values)
+{
+    std::vector<std::pair<unsigned,unsigned> > symvalues; // symno => value
+    symvalues.reserve(values.size());
+    for(const auto& v: values)
+    {
+        unsigned symno = defs->GetSymno(v.first);
+        if(symno == ~0U)
+        {
+            fprintf(stderr, "O65: Attempt to define unknown symbol '%s' as %X\n",
+                v.first.c_str(), v.second);
+            continue;
+        }
+        if(defs->IsDefined(symno))
+        {
+            unsigned oldvalue = defs->GetValue(symno);
+
+            fprintf(stderr, "O65: Attempt to redefine symbol '%s' as %X, old value %X\n",
+                v.first.c_str(),
+                v.second,
+                oldvalue
+                   );
+        }
+        symvalues.emplace_back(symno, v.second);
+    }
+    if(code) code->LocateSyms(symvalues);
+    if(data) data->LocateSyms(symvalues);
+    if(zero) zero->LocateSyms(symvalues);
+    if(bss) bss->LocateSyms(symvalues);
+
+    for(const auto& v: symvalues)
+        defs->Define(v.first, v.second);
+}
+
 void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
 {
     if(is_me)
@@ -844,12 +884,32 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
 
 void O65::Segment::LocateSym(unsigned symno, unsigned value)
 {
-    /* Locate an external symbol */
+    LocateSyms(std::vector<std::pair<unsigned,unsigned> > (1, std::make_pair(symno, value)));
+}
+
+void O65::Segment::LocateSyms(const std::vector<std::pair<unsigned,unsigned> >& values)
+{
+    /* Locate external symbols */
+    if(values.empty()) return;
 
-    /* Fix all references to it */
+    /* symno => value, for a single pass over the relocs */
+    unsigned limit = 0;
+    for(const auto& v: values) limit = std::max(limit, v.first+1);
+    std::vector<std::pair<bool,unsigned> > table(limit);
+    for(const auto& v: values) table[v.first] = std::make_pair(true, v.second);
+
+    auto Find = [&](unsigned symno, unsigned& value) -> bool
+    {
+        if(symno >= limit || !table[symno].first) return false;
+        value = table[symno].second;
+        return true;
+    };
+
+    /* Fix all references to them */
     for(unsigned a=0; a<R.R16.Relocs.size(); ++a)
     {
-        if(R.R16.Relocs[a].second != symno) continue;
+        unsigned symno = R.R16.Relocs[a].second, value;
+        if(!Find(symno, value)) continue;
         unsigned addr = R.R16.Relocs[a].first - base;
         unsigned oldvalue = space[addr] | (space[addr+1] << 8);
         unsigned newvalue = oldvalue + value;
@@ -861,7 +921,8 @@ void O65::Segment::LocateSym(unsigned symno, unsigned value)
     }
     for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)
     {
-        if(R.R16lo.Relocs[a].second != symno) continue;
+        unsigned symno = R.R16lo.Relocs[a].second, value;
+        if(!Find(symno, value)) continue;
         unsigned addr = R.R16lo.Relocs[a].first - base;
         unsigned oldvalue = space[addr];
         unsigned newvalue = oldvalue + value;
@@ -872,7 +933,8 @@ void O65::Segment::LocateSym(unsigned symno, unsigned value)
     }
     for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)
     {
-        if(R.R16hi.Relocs[a].second != symno) continue;
+        unsigned symno = R.R16hi.Relocs[a].second, value;
+        if(!Find(symno, value)) continue;
         unsigned addr = R.R16hi.Relocs[a].first.first - base;
         unsigned oldvalue = (space[addr] << 8) | R.R16hi.Relocs[a].first.second;
         unsigned newvalue = oldvalue + value;
@@ -884,7 +946,8 @@ void O65::Segment::LocateSym(unsigned symno, unsigned value)
     }
     for(unsigned a=0; a<R.R24.Relocs.size(); ++a)
     {
-        if(R.R24.Relocs[a].second != symno) continue;
+        unsigned symno = R.R24.Relocs[a].second, value;
+        if(!Find(symno, value)) continue;
         unsigned addr = R.R24.Relocs[a].first - base;
         unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
         unsigned newvalue = oldvalue + value;
@@ -898,7 +961,8 @@ void O65::Segment::LocateSym(unsigned symno, unsigned value)
     }
     for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a)
     {
-        if(R.R24seg.Relocs[a].second != symno) continue;
+        unsigned symno = R.R24seg.Relocs[a].second, value;
+        if(!Find(symno, value)) continue;
         unsigned addr = R.R24seg.Relocs[a].first.first - base;
         unsigned oldvalue = (space[addr] << 16) | R.R24seg.Relocs[a].first.second;
         unsigned newvalue = oldvalue + value;
@@ -1243,6 +1307,59 @@ const Relocdata<unsigned> O65::GetRelocData(SegmentSelection seg) const
     return (*s)->R;
 }
 
+const std::string O65::GetFoldingKey(SegmentSelection seg, std::set<SegmentSelection>& refers) const
+{
+    std::string result;
+    const Segment*const *s = GetSegRef(seg);
+    if(!s) return result;
+    const Segment& g = **s;
+
+    auto Put = [&](unsigned value) { result.append((const char*)&value, sizeof value); };
+    auto PutSym = [&](unsigned symno)
+    {
+        const std::string& name = defs->GetName(symno);
+        Put(name.size());
+        result += name;
+    };
+    /* The value of a fixup depends on the base of the target segment */
+    auto PutSeg = [&](SegmentSelection target)
+    {
+        if(target != seg) refers.insert(target);
+        Put(target);
+        Put(GetBase(target));
+    };
+
+    Put(g.space.size());
+    result.append(g.space.begin(), g.space.end());
+
+    Put(g.R.R16.Fixups.size());
+    for(const auto& f: g.R.R16.Fixups) { PutSeg(f.first); Put(f.second - g.base); }
+    Put(g.R.R16.Relocs.size());
+    for(const auto& r: g.R.R16.Relocs) { Put(r.first - g.base); PutSym(r.second); }
+
+    Put(g.R.R16lo.Fixups.size());
+    for(const auto& f: g.R.R16lo.Fixups) { PutSeg(f.first); Put(f.second - g.base); }
+    Put(g.R.R16lo.Relocs.size());
+    for(const auto& r: g.R.R16lo.Relocs) { Put(r.first - g.base); PutSym(r.second); }
+
+    Put(g.R.R16hi.Fixups.size());
+    for(const auto& f: g.R.R16hi.Fixups) { PutSeg(f.first); Put(f.second.first - g.base); Put(f.second.second); }
+    Put(g.R.R16hi.Relocs.size());
+    for(const auto& r: g.R.R16hi.Relocs) { Put(r.first.first - g.base); Put(r.first.second); PutSym(r.second); }
+
+    Put(g.R.R24seg.Fixups.size());
+    for(const auto& f: g.R.R24seg.Fixups) { PutSeg(f.first); Put(f.second.first - g.base); Put(f.second.second); }
+    Put(g.R.R24seg.Relocs.size());
+    for(const auto& r: g.R.R24seg.Relocs) { Put(r.first.first - g.base); Put(r.first.second); PutSym(r.second); }
+
+    Put(g.R.R24.Fixups.size());
+    for(const auto& f: g.R.R24.Fixups) { PutSeg(f.first); Put(f.second - g.base); }
+    Put(g.R.R24.Relocs.size());
+    for(const auto& r: g.R.R24.Relocs) { Put(r.first - g.base); PutSym(r.second); }
+
+    return result;
+}
+
 const std::string GetSegmentName(const SegmentSelection seg)
 {
     switch(seg)
@@ -14,6 +14,7 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <set>
 
 /* An xa65 object file loader */
 
@@ -72,6 +73,9 @@ public:
     /*! The symbol must have been accessed in order to be defined. */
     void LinkSym(const std::string& name, unsigned value);
 
+    /*! Defines the values of several symbols with a single pass over the relocations. */
+    void LinkSyms(const std::vector<std::pair<std::string, unsigned> >& values);
+
     /*! Declares a global label in the selected segment */
     void DeclareGlobal(SegmentSelection seg, const std::string& name, unsigned address);
 
@@ -119,6 +123,14 @@ public:
     /*! Get relocation data of the given segment */
     const Relocdata<unsigned> GetRelocData(SegmentSelection seg) const;
 
+    /*! Returns the contents and the relocations of a segment, normalised
+     *  so that two segments have the same key exactly when they become
+     *  byte-identical when located at the same address and linked
+     *  against the same symbols. The other segments that the
+     *  relocations point into are added to "refers".
+     */
+    const std::string GetFoldingKey(SegmentSelection seg, std::set<SegmentSelection>& refers) const;
+
 private:
     class Defs;
     class Segment;
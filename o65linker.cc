@@ -2,10 +2,21 @@
 #include "msginsert.hh"
 
 #include <list>
+#include <cstring>
 #include <utility>
 #include <map>
+#include <set>
+#include <unordered_map>
 
-#include "hash.hh"
+#include "symtab.hh"
+#include "parallel.hh"
+#include "stats.hh"
+
+static StatCounter ObjectCount("objects");
+static StatCounter ReferenceCount("references");
+static StatCounter SymbolCount("symbols");
+static StatCounter DroppedCount("dropped objects");
+static StatCounter FoldedBytes("folded bytes");
 
 class O65linker::Object
 {
@@ -15,7 +26,11 @@ private:
     std::string name;
 
 public:
-    std::vector<std::string> extlist;
+    std::vector<unsigned> extlist; // symbol IDs
+
+    // The object whose identical segment is used instead, or ~0U
+    unsigned foldCODE;
+    unsigned foldDATA;
 
 private:
     LinkageWish linkageCODE;
@@ -32,7 +47,9 @@ public:
       )
     : object(obj),
       name(what),
-      extlist(obj.GetExternList()),
+      extlist(),
+      foldCODE(~0U),
+      foldDATA(~0U),
       linkageCODE(linkCODE),
       linkageDATA(linkDATA),
       linkageZERO(linkZERO),
@@ -44,6 +61,8 @@ public:
     : object(),
       name(),
       extlist(),
+      foldCODE(~0U),
+      foldDATA(~0U),
       linkageCODE(),
       linkageDATA(),
       linkageZERO(),
@@ -85,6 +104,17 @@ public:
             (const_cast<const Object&>(*this)).GetLinkage(seg)
                                      );
     }
+
+    unsigned GetFold(const SegmentSelection seg) const
+    {
+        switch(seg)
+        {
+            case CODE: return foldCODE;
+            case DATA: return foldDATA;
+            default: break;
+        }
+        return ~0U;
+    }
 };
 
 struct ResolvedSymbol
@@ -102,20 +132,43 @@ typedef std::list<ClashItem> clashlist_t;
 
 class O65linker::SymCache
 {
-    typedef hash_map<std::string, ResolvedSymbol> cachetype;
+    struct Entry
+    {
+        bool resolved;
+        ResolvedSymbol res;
+        unsigned define; // index to defines[]
 
-    cachetype sym_cache;
+        Entry(): resolved(false), res(), define(~0U) { }
+    };
+
+    SymbolTable names;
+    std::vector<Entry> entries; // symbol ID => entry
 public:
+    unsigned Intern(const std::string& sym)
+    {
+        unsigned id = names.Intern(sym);
+        if(id >= entries.size()) entries.resize(id+1);
+        return id;
+    }
+    unsigned Find(const std::string& sym) const { return names.Find(sym); }
+    const std::string& GetName(unsigned id) const { return names.GetName(id); }
+    unsigned size() const { return names.size(); }
+
     void Update(const Object& o, unsigned objnum,
                 clashlist_t& clashlist)
     {
-        Update(o, objnum, CODE, clashlist);
-        Update(o, objnum, DATA, clashlist);
-        Update(o, objnum, ZERO, clashlist);
-        Update(o, objnum, BSS,  clashlist);
+        /* Symbols added by this object, to be undone if it clashes */
+        std::vector<unsigned> added;
+        Update(o, objnum, CODE, clashlist, added);
+        Update(o, objnum, DATA, clashlist, added);
+        Update(o, objnum, ZERO, clashlist, added);
+        Update(o, objnum, BSS,  clashlist, added);
+        if(!clashlist.empty())
+            for(unsigned a=0; a<added.size(); ++a)
+                entries[added[a]].resolved = false;
     }
     void Update(const Object& o, unsigned objnum, SegmentSelection seg,
-                clashlist_t& clashlist)
+                clashlist_t& clashlist, std::vector<unsigned>& added)
     {
         ResolvedSymbol res;
         res.objnum = objnum;
@@ -124,28 +177,47 @@ public:
         const std::vector<std::string> symlist = o.object.GetSymbolList(seg);
         for(unsigned a=0; a<symlist.size(); ++a)
         {
-            cachetype::const_iterator i = sym_cache.find(symlist[a]);
-            if(i != sym_cache.end())
+            unsigned id = Intern(symlist[a]);
+            Entry& e = entries[id];
+            if(e.resolved)
             {
                 ClashItem clash;
                 clash.symbol = symlist[a];
                 clash.seg    = seg;
-                clash.found  = i->second;
+                clash.found  = e.res;
                 clashlist.push_back(clash);
                 continue;
             }
-            sym_cache[symlist[a]] = res;
+            e.resolved = true;
+            e.res      = res;
+            added.push_back(id);
         }
     }
 
-    const std::pair<ResolvedSymbol, bool> Find(const std::string& sym) const
+    const std::pair<ResolvedSymbol, bool> Find(unsigned id) const
     {
-        cachetype::const_iterator i = sym_cache.find(sym);
-        if(i == sym_cache.end())
+        if(!entries[id].resolved)
         {
             return std::make_pair(ResolvedSymbol(), false);
         }
-        return std::make_pair(i->second, true);
+        return std::make_pair(entries[id].res, true);
+    }
+
+    unsigned GetDefine(unsigned id) const { return entries[id].define; }
+    void SetDefine(unsigned id, unsigned index) { entries[id].define = index; }
+
+    /* Objects were removed; newnum tells the new number of each,
+     * or ~0U if it's gone, taking its symbols along.
+     */
+    void Renumber(const std::vector<unsigned>& newnum)
+    {
+        for(unsigned a=0; a<entries.size(); ++a)
+        {
+            Entry& e = entries[a];
+            if(!e.resolved) continue;
+            e.res.objnum = newnum[e.res.objnum];
+            if(e.res.objnum == ~0U) e.resolved = false;
+        }
     }
 };
 
@@ -172,10 +244,14 @@ void O65linker::AddObject(const O65& object, const std::string& what, const std:
         return;
     }
 
-    SymCache backup = *symcache;
     Object *newobj = new Object(object, what,
         linkageCODE, linkageDATA, linkageZERO, linkageBSS);
 
+    const std::vector<std::string> externs = object.GetExternList();
+    newobj->extlist.reserve(externs.size());
+    for(unsigned a=0; a<externs.size(); ++a)
+        newobj->extlist.push_back(symcache->Intern(externs[a]));
+
     clashlist_t clashes;
     symcache->Update(*newobj, objects.size(), clashes);
     if(!clashes.empty())
@@ -195,11 +271,11 @@ void O65linker::AddObject(const O65& object, const std::string& what, const std:
                 GetSegmentName(clash.found.seg).c_str()
             );
         }
-        *symcache = backup;
         delete newobj;
         return;
     }
     objects.push_back(newobj);
+    ObjectCount.Add();
 }
 
 /*
@@ -217,10 +293,15 @@ const std::vector<unsigned> O65linker::GetSizeList(const SegmentSelection seg) c
     unsigned n = objects.size();
     result.reserve(n);
     for(unsigned a=0; a<n; ++a)
-        result.push_back(objects[a]->object.GetSegSize(seg));
+        result.push_back(objects[a]->GetFold(seg) != ~0U ? 0 : objects[a]->object.GetSegSize(seg));
     return result;
 }
 
+unsigned O65linker::GetFoldedInto(unsigned objno, const SegmentSelection seg) const
+{
+    return objects[objno]->GetFold(seg);
+}
+
 const std::vector<unsigned> O65linker::GetAddrList(const SegmentSelection seg) const
 {
     std::vector<unsigned> result;
@@ -245,20 +326,42 @@ void O65linker::PutAddrList(const std::vector<unsigned>& addrs, const SegmentSel
 {
     unsigned limit = addrs.size();
     if(objects.size() < limit) limit = objects.size();
-    for(unsigned a=0; a<limit; ++a)
+    // Each object is relocated independently of the others.
+    ParallelFor(limit, [&](unsigned a)
     {
         unsigned addr = addrs[a];
+        // A folded segment goes where its twin went
+        if(objects[a]->GetFold(seg) != ~0U) addr = addrs[objects[a]->GetFold(seg)];
         /*
         if(addr >= 0xC08000 && addr <= 0xC0FFFF)
             addr -= 0x400000; // Put them in 0x808000
         */
         objects[a]->GetLinkage(seg).SetAddress(addr);
-        objects[a]->object.Locate(seg, addrs[a]);
-    }
+        objects[a]->object.Locate(seg, addr);
+    });
+}
+
+void O65linker::SetAddress(unsigned objno, const SegmentSelection seg, unsigned address)
+{
+    objects[objno]->GetLinkage(seg).SetAddress(address);
+}
+
+unsigned long long O65linker::GetFingerprint(unsigned objno, const SegmentSelection seg) const
+{
+    std::set<SegmentSelection> refers;
+    const std::string key = objects[objno]->object.GetFoldingKey(seg, refers);
+
+    /* FNV-1a */
+    unsigned long long h = 14695981039346656037ull;
+    for(unsigned char c: key) { h ^= c; h *= 1099511628211ull; }
+    return h;
 }
 
 const std::vector<unsigned char>& O65linker::GetSeg(const SegmentSelection seg, unsigned objno) const
 {
+    // A folded segment is written out by its twin
+    static const std::vector<unsigned char> none;
+    if(objects[objno]->GetFold(seg) != ~0U) return none;
     return objects[objno]->object.GetSeg(seg);
 }
 
@@ -267,6 +370,24 @@ const std::string& O65linker::GetName(unsigned objno) const
     return objects[objno]->GetName();
 }
 
+const std::vector<std::pair<std::string, unsigned> >
+    O65linker::GetSymbolList(unsigned objno, const SegmentSelection seg) const
+{
+    const O65& object = objects[objno]->object;
+    const std::vector<std::string> names = object.GetSymbolList(seg);
+
+    std::vector<std::pair<std::string, unsigned> > result;
+    result.reserve(names.size());
+    for(unsigned a=0; a<names.size(); ++a)
+        result.emplace_back(names[a], object.GetSymAddress(seg, names[a]));
+    return result;
+}
+
+bool O65linker::IsKnownSymbol(const std::string& name) const
+{
+    return symcache->Find(name) != SymbolTable::None;
+}
+
 void O65linker::Release(unsigned objno)
 {
     objects[objno]->Release();
@@ -278,27 +399,30 @@ void O65linker::DefineSymbol(const std::string& name, unsigned value)
     {
         fprintf(stderr, "O65 linker: Attempt to add symbols after linking\n");
     }
-    for(unsigned c=0; c<defines.size(); ++c)
+    unsigned id  = symcache->Intern(name);
+    unsigned def = symcache->GetDefine(id);
+    if(def != ~0U)
     {
-        if(defines[c].first == name)
+        if(defines[def].second.first != value)
         {
-            if(defines[c].second.first != value)
-            {
-                fprintf(stderr,
-                    "O65 linker: Error: %s previously defined as %X,"
-                    " can not redefine as %X\n",
-                        name.c_str(), defines[c].second.first, value);
-            }
-            return;
+            fprintf(stderr,
+                "O65 linker: Error: %s previously defined as %X,"
+                " can not redefine as %X\n",
+                    name.c_str(), defines[def].second.first, value);
         }
+        return;
     }
 
-    defines.emplace_back(name, std::make_pair(value, false));
+    symcache->SetDefine(id, defines.size());
+    defines.emplace_back(id, std::make_pair(value, false));
 }
 
 void O65linker::AddReference(const std::string& name, const ReferMethod& reference)
 {
-    const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(name);
+    ReferenceCount.Add();
+
+    unsigned id = symcache->Intern(name);
+    const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(id);
     if(tmp.second)
     {
         const Object& o = *objects[tmp.first.objnum];
@@ -316,18 +440,19 @@ void O65linker::AddReference(const std::string& name, const ReferMethod& referen
     {
         fprintf(stderr, "O65 linker: Attempt to add references after linking\n");
     }
-    referers.emplace_back(reference, name);
+    referers.emplace_back(reference, id);
 }
 
 void O65linker::LinkSymbol(const std::string& name, unsigned value)
 {
+    unsigned id = symcache->Intern(name);
     for(unsigned a=0; a<objects.size(); ++a)
     {
         Object& o = *objects[a];
         for(unsigned b=0; b<o.extlist.size(); ++b)
         {
             /* If this module is referring to this symbol */
-            if(o.extlist[b] == name)
+            if(o.extlist[b] == id)
             {
                 o.extlist.erase(o.extlist.begin() + b);
                 o.object.LinkSym(name, value);
@@ -335,16 +460,18 @@ void O65linker::LinkSymbol(const std::string& name, unsigned value)
             }
         }
     }
+    std::vector<std::pair<ReferMethod, unsigned> > remaining;
     for(unsigned a=0; a<referers.size(); ++a)
     {
-        if(name == referers[a].second)
+        if(referers[a].second == id)
         {
             // resolved referer
             FinishReference(referers[a].first, value, name);
-            referers.erase(referers.begin() + a);
-            --a;
         }
+        else
+            remaining.push_back(referers[a]);
     }
+    referers.swap(remaining);
 }
 
 void O65linker::FinishReference(const ReferMethod& reference, unsigned target, const std::string& what)
@@ -402,6 +529,12 @@ void O65linker::Link()
     linked = true;
 
     MessageLinkingModules(objects.size());
+    SymbolCount.Add(symcache->size());
+
+    /* The externs are resolved first, in order. Only after that
+     * are the values written into the objects, in parallel.
+     */
+    std::vector<std::vector<std::pair<std::string, unsigned> > > values(objects.size());
 
     // For each module, satisfy each of their externs one by one.
     for(unsigned a=0; a<objects.size(); ++a)
@@ -441,13 +574,16 @@ void O65linker::Link()
 
         MessageLoadingItem(o.GetName());
 
+        std::vector<unsigned> unresolved;
+
         for(unsigned b=0; b<o.extlist.size(); ++b)
         {
-            const std::string& ext = o.extlist[b];
+            const unsigned     id  = o.extlist[b];
+            const std::string& ext = symcache->GetName(id);
 
             unsigned found=0, addr=0, defcount=0;
 
-            const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(ext);
+            const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(id);
             if(tmp.second)
             {
                 addr = objects[tmp.first.objnum]->object.GetSymAddress(tmp.first.seg, ext);
@@ -455,14 +591,12 @@ void O65linker::Link()
             }
 
             // Or if it was an external definition.
-            for(unsigned c=0; c<defines.size(); ++c)
+            unsigned def = symcache->GetDefine(id);
+            if(def != ~0U)
             {
-                if(defines[c].first == ext)
-                {
-                    addr = defines[c].second.first;
-                    defines[c].second.second = true;
-                    ++defcount;
-                }
+                addr = defines[def].second.first;
+                defines[def].second.second = true;
+                ++defcount;
             }
 
             if(found == 0 && !defcount)
@@ -483,13 +617,12 @@ void O65linker::Link()
 */
 
             if(found > 0 || defcount > 0)
-            {
-                o.object.LinkSym(ext, addr);
-
-                o.extlist.erase(o.extlist.begin() + b);
-                --b;
-            }
+                values[a].emplace_back(ext, addr);
+            else
+                unresolved.push_back(id);
         }
+        o.extlist.swap(unresolved);
+
         if(!o.extlist.empty())
         {
             MessageUndefinedSymbols(o.extlist.size());
@@ -497,23 +630,32 @@ void O65linker::Link()
         }
     }
 
+    ParallelFor(objects.size(), [&](unsigned a)
+    {
+        objects[a]->object.LinkSyms(values[a]);
+    });
+
+    std::vector<std::pair<ReferMethod, unsigned> > remaining;
     for(unsigned c=0; c<referers.size(); ++c)
     {
-        const std::string& name = referers[c].second;
-        const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(name);
+        const unsigned     id   = referers[c].second;
+        const std::string& name = symcache->GetName(id);
+        const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(id);
         if(tmp.second)
         {
             const Object& o = *objects[tmp.first.objnum];
-            if(o.GetLinkage(tmp.first.seg).type != LinkageWish::LinkHere) continue;
-
-            unsigned value = o.object.GetSymAddress(tmp.first.seg, name);
+            if(o.GetLinkage(tmp.first.seg).type == LinkageWish::LinkHere)
+            {
+                unsigned value = o.object.GetSymAddress(tmp.first.seg, name);
 
-            // resolved referer
-            FinishReference(referers[c].first, value, name);
-            referers.erase(referers.begin() + c);
-            --c;
+                // resolved referer
+                FinishReference(referers[c].first, value, name);
+                continue;
+            }
         }
+        remaining.push_back(referers[c]);
     }
+    referers.swap(remaining);
 
     MessageDone();
 
@@ -527,7 +669,7 @@ void O65linker::Link()
         for(unsigned a=0; a<referers.size(); ++a)
             fprintf(stderr,
                 "O65 linker: Unresolved reference: %s\n",
-                    referers[a].second.c_str());
+                    symcache->GetName(referers[a].second).c_str());
     }
 
     for(unsigned c=0; c<defines.size(); ++c)
@@ -535,8 +677,163 @@ void O65linker::Link()
         {
             fprintf(stderr,
                 "O65 linker: Warning: Symbol \"%s\" was defined but never used.\n",
-                defines[c].first.c_str());
+                symcache->GetName(defines[c].first).c_str());
+        }
+}
+
+void O65linker::DropUnreferenced(const std::vector<std::string>& roots)
+{
+    if(linked)
+    {
+        fprintf(stderr, "O65 linker: Attempt to drop objects after linking\n");
+        return;
+    }
+
+    std::vector<bool> reached(objects.size(), false);
+    std::vector<unsigned> pending;
+
+    auto Reach = [&](unsigned objnum)
+    {
+        if(reached[objnum]) return;
+        reached[objnum] = true;
+        pending.push_back(objnum);
+    };
+    auto ReachSymbol = [&](unsigned id)
+    {
+        const std::pair<ResolvedSymbol, bool> tmp = symcache->Find(id);
+        if(tmp.second) Reach(tmp.first.objnum);
+    };
+
+    for(unsigned a=0; a<objects.size(); ++a)
+        if(objects[a]->GetLinkage(CODE).type == LinkageWish::LinkHere)
+            Reach(a);
+    for(unsigned a=0; a<referers.size(); ++a)
+        ReachSymbol(referers[a].second);
+    for(unsigned a=0; a<roots.size(); ++a)
+    {
+        unsigned id = symcache->Find(roots[a]);
+        if(id == SymbolTable::None || !symcache->Find(id).second)
+        {
+            fprintf(stderr,
+                "O65 linker: Warning: Root symbol \"%s\" is not defined by any object\n",
+                roots[a].c_str());
+            continue;
+        }
+        ReachSymbol(id);
+    }
+
+    while(!pending.empty())
+    {
+        const Object& o = *objects[pending.back()];
+        pending.pop_back();
+        for(unsigned b=0; b<o.extlist.size(); ++b)
+            ReachSymbol(o.extlist[b]);
+    }
+
+    std::vector<unsigned> newnum(objects.size(), ~0U);
+    unsigned n = 0;
+    for(unsigned a=0; a<objects.size(); ++a)
+    {
+        if(!reached[a])
+        {
+            fprintf(stderr, "O65 linker: Dropping unreferenced object \"%s\"\n",
+                objects[a]->GetName().c_str());
+            DroppedCount.Add();
+            delete objects[a];
+            continue;
         }
+        newnum[a] = n;
+        objects[n++] = objects[a];
+    }
+    objects.resize(n);
+    symcache->Renumber(newnum);
+}
+
+void O65linker::FoldIdentical(bool all_segments)
+{
+    if(linked)
+    {
+        fprintf(stderr, "O65 linker: Attempt to fold objects after linking\n");
+        return;
+    }
+
+    static const SegmentSelection segs[2] = { CODE, DATA };
+
+    std::vector<std::set<SegmentSelection> > refers[2];
+    std::vector<unsigned> fold[2];
+
+    for(unsigned s=0; s<2; ++s)
+    {
+        const SegmentSelection seg = segs[s];
+        refers[s].resize(objects.size());
+        fold[s].assign(objects.size(), ~0U);
+
+        /* The first object having each key keeps its segment */
+        std::unordered_map<std::string, unsigned> first;
+        for(unsigned a=0; a<objects.size(); ++a)
+        {
+            const Object& o = *objects[a];
+            const LinkageWish& wish = o.GetLinkage(seg);
+            if(wish.type == LinkageWish::LinkHere) continue;
+            if(!o.object.GetSegSize(seg)) continue;
+
+            std::string key = o.object.GetFoldingKey(seg, refers[s][a]);
+
+            /* Variables can't be shared, and in the default mode,
+             * neither can anything that refers to the rest of its object
+             */
+            if(refers[s][a].count(ZERO) || refers[s][a].count(BSS)) continue;
+            if(!all_segments && !refers[s][a].empty()) continue;
+
+            /* Only fold where both would have been placed alike */
+            key += char(wish.type);
+            key.append((const char*)&wish.param, sizeof wish.param);
+
+            auto i = first.emplace(key, a);
+            if(!i.second) fold[s][a] = i.first->second;
+        }
+    }
+
+    /* A segment that refers to another segment of its object
+     * may only be folded if that one is folded into the same object.
+     */
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+        for(unsigned s=0; s<2; ++s)
+            for(unsigned a=0; a<objects.size(); ++a)
+            {
+                if(fold[s][a] == ~0U) continue;
+                for(SegmentSelection r: refers[s][a])
+                {
+                    const unsigned other = r == CODE ? 0 : 1;
+                    if(fold[other][a] != fold[s][a])
+                    {
+                        fold[s][a] = ~0U;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+    }
+
+    unsigned count = 0, saved = 0;
+    for(unsigned a=0; a<objects.size(); ++a)
+    {
+        Object& o = *objects[a];
+        o.foldCODE = fold[0][a];
+        o.foldDATA = fold[1][a];
+        for(unsigned s=0; s<2; ++s)
+            if(fold[s][a] != ~0U)
+            {
+                ++count;
+                saved += o.object.GetSegSize(segs[s]);
+            }
+    }
+    FoldedBytes.Add(saved);
+    if(count)
+        fprintf(stderr, "O65 linker: Folded %u identical segment(s), saving %u bytes\n",
+            count, saved);
 }
 
 O65linker::O65linker()
@@ -562,11 +859,11 @@ namespace
         fread(Buf, 2, 1, fp);
         return (Buf[0] << 8) | Buf[1];
     }
-    unsigned LoadIPSlong(FILE *fp)
+    unsigned LoadIPSlong(FILE *fp, bool ips32)
     {
-        unsigned char Buf[3];
-        fread(Buf, 3, 1, fp);
-        return (Buf[0] << 16) | (Buf[1] << 8) | Buf[2];
+        unsigned char Buf[4] = {0};
+        fread(Buf + !ips32, 3 + ips32, 1, fp);
+        return ((unsigned)Buf[0] << 24) | (Buf[1] << 16) | (Buf[2] << 8) | Buf[3];
     }
 
     struct IPS_item
@@ -606,7 +903,10 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
 
     /* FIXME: No validity checks here */
 
-    for(int a=0; a<5; ++a) fgetc(fp); // Skip header which should be "PATCH"
+    /* The header is "PATCH", or "IPS32" for 32-bit addresses */
+    char header[5] = {0};
+    fread(header, 1, 5, fp);
+    const bool ips32 = !std::memcmp(header, "IPS32", 5);
 
     std::list<IPS_global> globals;
     std::list<IPS_extern> externs;
@@ -614,14 +914,26 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
 
     for(;;)
     {
-        unsigned addr = LoadIPSlong(fp);
-        if(feof(fp) || addr == IPS_EOF_MARKER) break;
+        unsigned addr = LoadIPSlong(fp, ips32);
+        if(feof(fp) || addr == (ips32 ? IPS32_EOF_MARKER : IPS_EOF_MARKER)) break;
 
         unsigned length = LoadIPSword(fp);
 
-        std::vector<unsigned char> Buf2(length);
-        int c = fread(&Buf2[0], 1, length, fp);
-        if(c < 0 || c != (int)length) break;
+        std::vector<unsigned char> Buf2;
+        if(!length)
+        {
+            /* RLE record: 16-bit count and the byte to repeat */
+            length = LoadIPSword(fp);
+            int c = fgetc(fp);
+            if(c == EOF) break;
+            Buf2.assign(length, c);
+        }
+        else
+        {
+            Buf2.resize(length);
+            int c = fread(&Buf2[0], 1, length, fp);
+            if(c < 0 || c != (int)length) break;
+        }
 
         switch(addr)
         {
@@ -632,6 +944,7 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
                 unsigned addr = Buf2[name.size()+1]
                              | (Buf2[name.size()+2] << 8)
                              | (Buf2[name.size()+3] << 16);
+                if(ips32) addr |= (unsigned)Buf2[name.size()+4] << 24;
 
                 if(AddressTransformer) addr = AddressTransformer(addr);
 
@@ -650,7 +963,8 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
                 unsigned addr = Buf2[name.size()+1]
                              | (Buf2[name.size()+2] << 8)
                              | (Buf2[name.size()+3] << 16);
-                unsigned size = Buf2[name.size()+4];
+                if(ips32) addr |= (unsigned)Buf2[name.size()+4] << 24;
+                unsigned size = Buf2[name.size()+4+ips32];
 
                 if(AddressTransformer) addr = AddressTransformer(addr);
 
@@ -682,6 +996,21 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
     externs.sort();
     lumps.sort();
 
+    /* Records that continue each other form one object.
+     * The writer splits blobs into records freely (e.g. for RLE).
+     */
+    for(std::list<IPS_lump>::iterator i = lumps.begin(); i != lumps.end(); )
+    {
+        std::list<IPS_lump>::iterator next = i; ++next;
+        if(next != lumps.end() && next->addr == i->addr + i->data.size())
+        {
+            i->data.insert(i->data.end(), next->data.begin(), next->data.end());
+            lumps.erase(next);
+        }
+        else
+            i = next;
+    }
+
     for(std::list<IPS_lump>::const_iterator next_lump,
         i = lumps.begin(); i != lumps.end(); i=next_lump)
     {
@@ -13,6 +13,7 @@
 #define IPS_ADDRESS_EXTERN 0x01
 #define IPS_ADDRESS_GLOBAL 0x02
 #define IPS_EOF_MARKER     0x454F46
+#define IPS32_EOF_MARKER   0x45454F46 /* IPS32 has 32-bit addresses */
 
 struct LinkageWish
 {
@@ -72,15 +73,48 @@ public:
     const std::vector<LinkageWish> GetLinkageList(const SegmentSelection seg=CODE) const;
     void PutAddrList(const std::vector<unsigned>& addrs, const SegmentSelection seg=CODE);
 
+    // Fixes the address of the segment, to be kept by the placement
+    void SetAddress(unsigned objno, const SegmentSelection seg, unsigned address);
+
+    /* A hash of the segment's contents and relocations. It stays the same
+     * as long as the segment would link into the same bytes.
+     */
+    unsigned long long GetFingerprint(unsigned objno, const SegmentSelection seg) const;
+
     const std::vector<unsigned char>& GetSeg(const SegmentSelection seg, unsigned objno) const;
 
     const std::string& GetName(unsigned objno) const;
 
+    // Public symbols of the given segment of the object, with their addresses
+    const std::vector<std::pair<std::string, unsigned> >
+        GetSymbolList(unsigned objno, const SegmentSelection seg) const;
+
     void DefineSymbol(const std::string& name, unsigned value);
+    // Whether any object defines or refers to the symbol
+    bool IsKnownSymbol(const std::string& name) const;
     void AddReference(const std::string& name, const ReferMethod& reference);
     void Link();
     void SortByAddress();
 
+    /* Removes the objects that can't be reached from the roots
+     * by following their externs. The roots are the objects at
+     * fixed addresses (such as IPS blocks holding the vectors),
+     * the pending references and the given symbols.
+     * Call before placing the objects.
+     */
+    void DropUnreferenced(const std::vector<std::string>& roots);
+
+    /* Places the CODE and DATA segments that have identical contents
+     * and relocations only once; the symbols of the duplicates point
+     * to the one copy. By default, only segments that don't refer to
+     * the other segments of their object are folded. With all_segments,
+     * segments that do are folded when those are folded alike.
+     * Call before placing the objects.
+     */
+    void FoldIdentical(bool all_segments = false);
+    // The object whose copy of the segment is used instead, ~0U if not folded
+    unsigned GetFoldedInto(unsigned objno, const SegmentSelection seg) const;
+
     // Release the memory allocated by given obj
     void Release(unsigned objno); // no range checks
 
@@ -101,8 +135,9 @@ private:
     SymCache *symcache;
 
     std::vector<Object* > objects;
-    std::vector<std::pair<std::string, std::pair<unsigned, bool> > > defines;
-    std::vector<std::pair<ReferMethod, std::string> > referers;
+    // The unsigned keys here are symbol IDs interned in symcache.
+    std::vector<std::pair<unsigned, std::pair<unsigned, bool> > > defines;
+    std::vector<std::pair<ReferMethod, unsigned> > referers;
     unsigned num_groups_used;
     bool linked;
 };
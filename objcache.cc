@@ -0,0 +1,358 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "objcache.hh"
+#include "stats.hh"
+
+namespace
+{
+    std::string CacheDir;
+    unsigned long long CacheLimit = 256ull << 20;
+
+    StatCounter CacheHits("cache hits");
+    StatCounter CacheMisses("cache misses");
+    StatCounter CacheEvictions("cache evictions");
+
+    const unsigned SHA256_K[64] =
+    {
+        0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+        0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+        0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+        0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+        0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+        0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+        0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+        0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+    };
+
+    inline unsigned Rotr(unsigned x, unsigned n)
+    {
+        return ((x >> n) | (x << (32-n))) & 0xFFFFFFFFu;
+    }
+
+    const std::string EntryName(const std::string& key)
+    {
+        return CacheDir + "/" + key;
+    }
+    /* The messages of an entry; it is never used without them */
+    const std::string MessagesName(const std::string& entryname)
+    {
+        return entryname + ".msg";
+    }
+
+    /* stderr while it is captured */
+    int SavedStderr = -1;
+    std::FILE* CapturedStderr = NULL;
+
+    /* Copies the whole of srcfd into fo, cloning the extents when the
+     * filesystem allows it.
+     */
+    bool CopyInto(int srcfd, std::FILE* fo)
+    {
+        std::fflush(fo);
+#ifdef FICLONE
+        {
+            const int destfd = fileno(fo);
+            struct stat st;
+            if(fstat(destfd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0
+            && ioctl(destfd, FICLONE, srcfd) == 0)
+            {
+                struct stat src;
+                if(fstat(srcfd, &src) == 0)
+                    std::fseek(fo, src.st_size, SEEK_SET);
+                return true;
+            }
+        }
+#endif
+        if(lseek(srcfd, 0, SEEK_SET) < 0) return false;
+        char Buf[65536];
+        for(;;)
+        {
+            ssize_t n = read(srcfd, Buf, sizeof Buf);
+            if(n == 0) break;
+            if(n < 0) return false;
+            if(std::fwrite(Buf, 1, n, fo) != (std::size_t)n) return false;
+        }
+        return true;
+    }
+
+    /* Removes the least recently used entries until the cache fits */
+    void TrimCache()
+    {
+        struct Entry
+        {
+            std::string name;
+            time_t      used;
+            unsigned long long size;
+        };
+        std::vector<Entry> entries;
+        unsigned long long total = 0;
+
+        DIR* dir = opendir(CacheDir.c_str());
+        if(!dir) return;
+        while(dirent* ent = readdir(dir))
+        {
+            if(ent->d_name[0] == '.' || std::strchr(ent->d_name, '.')) continue;
+            const std::string name = EntryName(ent->d_name);
+            struct stat st, msg;
+            if(stat(name.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) continue;
+            unsigned long long size = st.st_size;
+            if(stat(MessagesName(name).c_str(), &msg) == 0) size += msg.st_size;
+            entries.push_back(Entry{name, st.st_mtime, size});
+            total += size;
+        }
+        closedir(dir);
+
+        if(total <= CacheLimit) return;
+
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        for(const Entry& e: entries)
+        {
+            if(total <= CacheLimit) break;
+            if(unlink(e.name.c_str()) == 0)
+            {
+                unlink(MessagesName(e.name).c_str());
+                total -= e.size;
+                CacheEvictions.Add();
+            }
+        }
+    }
+}
+
+void SetObjectCacheDir(const std::string& dir)
+{
+    CacheDir = dir;
+    while(CacheDir.size() > 1 && CacheDir[CacheDir.size()-1] == '/')
+        CacheDir.erase(CacheDir.size()-1);
+    if(!CacheDir.empty())
+        mkdir(CacheDir.c_str(), 0777);
+}
+
+void SetObjectCacheSize(unsigned long megabytes)
+{
+    CacheLimit = (unsigned long long)megabytes << 20;
+}
+
+bool ObjectCacheEnabled()
+{
+    return !CacheDir.empty();
+}
+
+ObjectCacheKey::ObjectCacheKey(): length(0)
+{
+    static const unsigned init[8] =
+        { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+    std::memcpy(state, init, sizeof state);
+}
+
+void ObjectCacheKey::Add(const std::string& item)
+{
+    unsigned char size[8];
+    for(unsigned a=0; a<8; ++a) size[a] = (unsigned char)((unsigned long long)item.size() >> (a*8));
+    Update(size, sizeof size);
+    Update((const unsigned char*)item.data(), item.size());
+}
+
+void ObjectCacheKey::Update(const unsigned char* data, std::size_t size)
+{
+    while(size > 0)
+    {
+        const unsigned pos = length % 64;
+        const std::size_t n = std::min<std::size_t>(size, 64 - pos);
+        std::memcpy(block + pos, data, n);
+        length += n; data += n; size -= n;
+        if(length % 64 == 0) Compress();
+    }
+}
+
+void ObjectCacheKey::Compress()
+{
+    unsigned w[64];
+    for(unsigned a=0; a<16; ++a)
+        w[a] = (block[a*4] << 24) | (block[a*4+1] << 16) | (block[a*4+2] << 8) | block[a*4+3];
+    for(unsigned a=16; a<64; ++a)
+    {
+        unsigned s0 = Rotr(w[a-15], 7) ^ Rotr(w[a-15], 18) ^ (w[a-15] >> 3);
+        unsigned s1 = Rotr(w[a-2], 17) ^ Rotr(w[a-2], 19) ^ (w[a-2] >> 10);
+        w[a] = w[a-16] + s0 + w[a-7] + s1;
+    }
+    unsigned v[8];
+    std::memcpy(v, state, sizeof v);
+    for(unsigned a=0; a<64; ++a)
+    {
+        unsigned S1 = Rotr(v[4], 6) ^ Rotr(v[4], 11) ^ Rotr(v[4], 25);
+        unsigned ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        unsigned t1 = v[7] + S1 + ch + SHA256_K[a] + w[a];
+        unsigned S0 = Rotr(v[0], 2) ^ Rotr(v[0], 13) ^ Rotr(v[0], 22);
+        unsigned mj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        unsigned t2 = S0 + mj;
+        v[7] = v[6]; v[6] = v[5]; v[5] = v[4]; v[4] = v[3] + t1;
+        v[3] = v[2]; v[2] = v[1]; v[1] = v[0]; v[0] = t1 + t2;
+    }
+    for(unsigned a=0; a<8; ++a) state[a] += v[a];
+}
+
+const std::string ObjectCacheKey::Hex() const
+{
+    ObjectCacheKey tmp(*this);
+
+    const unsigned long long bits = length * 8;
+    unsigned char pad[128] = { 0x80 };
+    const unsigned padlen = ((length % 64) < 56 ? 56 : 120) - (length % 64);
+    tmp.Update(pad, padlen);
+    unsigned char size[8];
+    for(unsigned a=0; a<8; ++a) size[a] = (unsigned char)(bits >> (56 - a*8));
+    tmp.Update(size, sizeof size);
+
+    std::string result;
+    char Buf[9];
+    for(unsigned a=0; a<8; ++a)
+    {
+        std::sprintf(Buf, "%08x", tmp.state[a]);
+        result += Buf;
+    }
+    return result;
+}
+
+bool FetchCachedObject(const std::string& key, std::FILE* fo)
+{
+    const std::string name = EntryName(key);
+
+    std::string messages;
+    int fd = open(MessagesName(name).c_str(), O_RDONLY);
+    if(fd >= 0)
+    {
+        char Buf[4096];
+        for(ssize_t n; (n = read(fd, Buf, sizeof Buf)) > 0; )
+            messages.append(Buf, n);
+        close(fd);
+        fd = open(name.c_str(), O_RDONLY);
+    }
+    if(fd < 0)
+    {
+        CacheMisses.Add();
+        return false;
+    }
+    bool ok = CopyInto(fd, fo);
+    close(fd);
+    if(!ok)
+    {
+        std::perror(name.c_str());
+        return false;
+    }
+
+    std::fwrite(messages.data(), 1, messages.size(), stderr);
+
+    utimes(name.c_str(), NULL); // Mark as recently used
+    CacheHits.Add();
+    return true;
+}
+
+void BeginCapturingMessages()
+{
+    if(SavedStderr >= 0) return;
+    std::FILE* fp = std::tmpfile();
+    if(!fp) return;
+
+    std::fflush(stderr);
+    SavedStderr = dup(2);
+    if(SavedStderr < 0 || dup2(fileno(fp), 2) < 0)
+    {
+        if(SavedStderr >= 0) close(SavedStderr);
+        SavedStderr = -1;
+        std::fclose(fp);
+        return;
+    }
+    CapturedStderr = fp;
+}
+
+const std::string EndCapturingMessages()
+{
+    std::string result;
+    if(SavedStderr < 0) return result;
+
+    std::fflush(stderr);
+    dup2(SavedStderr, 2);
+    close(SavedStderr);
+    SavedStderr = -1;
+
+    std::rewind(CapturedStderr);
+    char Buf[4096];
+    for(std::size_t n; (n = std::fread(Buf, 1, sizeof Buf, CapturedStderr)) > 0; )
+        result.append(Buf, n);
+    std::fclose(CapturedStderr);
+    CapturedStderr = NULL;
+
+    std::fwrite(result.data(), 1, result.size(), stderr);
+    std::fflush(stderr);
+    return result;
+}
+
+std::FILE* BeginCachedObject(std::string& tempname)
+{
+    tempname = CacheDir + "/.tmpXXXXXX";
+    int fd = mkstemp(&tempname[0]);
+    if(fd < 0)
+    {
+        std::perror(CacheDir.c_str());
+        return NULL;
+    }
+    return fdopen(fd, "w+b");
+}
+
+bool StoreCachedObject(const std::string& key, const std::string& tempname,
+                       std::FILE* written, std::FILE* fo, const std::string& messages)
+{
+    std::fflush(written);
+    bool ok = CopyInto(fileno(written), fo);
+    std::fclose(written);
+
+    /* The messages are filed first, so that the entry is never there without them */
+    std::string msgname = CacheDir + "/.tmpXXXXXX";
+    int fd = ok ? mkstemp(&msgname[0]) : -1;
+    bool filed = fd >= 0;
+    if(filed)
+    {
+        filed = write(fd, messages.data(), messages.size()) == (ssize_t)messages.size();
+        close(fd);
+        if(!filed || rename(msgname.c_str(), MessagesName(EntryName(key)).c_str()) < 0)
+        {
+            unlink(msgname.c_str());
+            filed = false;
+        }
+    }
+
+    if(!filed || rename(tempname.c_str(), EntryName(key).c_str()) < 0)
+    {
+        if(filed) unlink(MessagesName(EntryName(key)).c_str());
+        unlink(tempname.c_str());
+        return ok;
+    }
+    TrimCache();
+    return true;
+}
+
+bool DiscardCachedObject(const std::string& tempname, std::FILE* written, std::FILE* fo)
+{
+    std::fflush(written);
+    bool ok = CopyInto(fileno(written), fo);
+    std::fclose(written);
+    unlink(tempname.c_str());
+    return ok;
+}
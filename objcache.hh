@@ -0,0 +1,64 @@
+#ifndef bqtObjCacheHH
+#define bqtObjCacheHH
+
+#include <cstdio>
+#include <string>
+
+/* On-disk cache of assembled outputs, for nescom.
+ *
+ * The key is a SHA-256 of the tool version, the options that affect
+ * the output and the preprocessed text of every input; the entry
+ * is the output file as it was written, and beside it the messages
+ * that were printed while assembling it. The cache directory is
+ * kept under a size limit by evicting the least recently used
+ * entries. Hits and misses are counted for --stats.
+ */
+
+/* Selects the cache directory; empty disables the cache */
+void SetObjectCacheDir(const std::string& dir);
+/* Sets the size limit of the cache directory, in megabytes */
+void SetObjectCacheSize(unsigned long megabytes);
+bool ObjectCacheEnabled();
+
+class ObjectCacheKey
+{
+public:
+    ObjectCacheKey();
+
+    /* Appends a length-prefixed item, so that the items cannot run together */
+    void Add(const std::string& item);
+
+    const std::string Hex() const;
+private:
+    unsigned       state[8];
+    unsigned char  block[64];
+    unsigned long long length;
+
+    void Update(const unsigned char* data, std::size_t size);
+    void Compress();
+};
+
+/* Copies the cached output into fo and prints its messages again.
+ * Returns false if it wasn't cached.
+ */
+bool FetchCachedObject(const std::string& key, std::FILE* fo);
+
+/* Between these, stderr goes into a buffer. The end prints it out
+ * and returns it, for StoreCachedObject.
+ */
+void BeginCapturingMessages();
+const std::string EndCapturingMessages();
+
+/* Opens a temporary file in the cache directory to write the output into.
+ * Returns NULL if that isn't possible.
+ */
+std::FILE* BeginCachedObject(std::string& tempname);
+
+/* Files the written output and its messages under the key, and copies it into fo. */
+bool StoreCachedObject(const std::string& key, const std::string& tempname,
+                       std::FILE* written, std::FILE* fo, const std::string& messages);
+
+/* Copies the written output into fo without filing it; for failed outputs. */
+bool DiscardCachedObject(const std::string& tempname, std::FILE* written, std::FILE* fo);
+
+#endif
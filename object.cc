@@ -1,18 +1,30 @@
 #include <cstdio>
+#include <cstring>
+#include <array>
 #include <list>
 #include <map>
 #include <set>
 
-#include <unistd.h> // For ftruncate
-
 #include "dataarea.hh"
 #include "assemble.hh"
 #include "object.hh"
 #include "relocdata.hh"
 #include "warning.hh"
+#include "stats.hh"
 
 bool fix_jumps = false;
 
+namespace
+{
+    StatTimer   ScopeTime("scopes");
+    StatTimer   CloseTime("close");
+    StatCounter LabelCount("labels");
+    StatCounter ExternCount("externs");
+    StatCounter FixupCount("fixups");
+    StatCounter RelocCount("relocs");
+    StatCounter ByteCount("bytes");
+}
+
 extern bool assembly_errors;
 
 #define PROGNAME "nescom"
@@ -105,7 +117,8 @@ public:
     /// FLIPPING ///
 private:
     typedef std::set<unsigned> FlipPositionSet;
-    FlipPositionSet FlipPositions;
+    FlipPositionSet FlipPositions; // Branches flipped so far
+    FlipPositionSet NewFlips;      // Branches found out of range in this pass
 public:
     void FixFlipPositions();
 
@@ -132,6 +145,10 @@ public:
     unsigned GetSize() const { return Data.GetSize(); }
 
     unsigned FindNextBlob(unsigned where, unsigned& length) const;
+    unsigned FindNextBlob(unsigned where, unsigned& length,
+                          const unsigned char*& data) const;
+    unsigned FindBlobAt(unsigned where, unsigned& length,
+                        const unsigned char*& data) const;
 
     const std::vector<unsigned char> GetContent() const;
     const std::vector<unsigned char> GetContent(unsigned a,unsigned l) const;
@@ -183,12 +200,14 @@ void Object::Segment::AddByte(unsigned char byte)
 {
     //std::fprintf(stderr, "Generated byte %02X\n", byte);
     Data.WriteByte(Position++, byte);
+    ByteCount.Add();
 }
 
 void Object::Segment::AddLump(const std::vector<unsigned char>& lump)
 {
     Data.WriteLump(Position, lump);
     Position += lump.size();
+    ByteCount.Add(lump.size());
 }
 
 void Object::Segment::SetByte(unsigned offset, unsigned char byte)
@@ -216,6 +235,18 @@ unsigned Object::Segment::FindNextBlob(unsigned where, unsigned& length) const
     return Data.FindNextBlob(where, length);
 }
 
+unsigned Object::Segment::FindNextBlob(unsigned where, unsigned& length,
+                                       const unsigned char*& data) const
+{
+    return Data.FindNextBlob(where, length, data);
+}
+
+unsigned Object::Segment::FindBlobAt(unsigned where, unsigned& length,
+                                     const unsigned char*& data) const
+{
+    return Data.FindBlobAt(where, length, data);
+}
+
 const std::vector<unsigned char> Object::Segment::GetContent() const
 {
     return Data.GetContent();
@@ -381,6 +412,7 @@ void Object::Segment::CheckExterns(unsigned CurScope, const Object& obj)
 
                 Fixup newref(pos, prefix, value, targetseg, targetaddr);
                 Fixups.push_back(newref);
+                FixupCount.Add();
                 Externs.erase(i);
                 break;
             }
@@ -395,6 +427,7 @@ void Object::Segment::AddExtern(char prefix, const std::string& ref,
     Extern newext(pos, prefix, value, ref);
     newext.SetScopeLevel(CurScope);
     Externs.push_back(newext);
+    ExternCount.Add();
 }
 
 void Object::Segment::DumpExterns(const char *segname) const
@@ -424,27 +457,37 @@ bool Object::Segment::ShouldFlipHere() const
 
 bool Object::Segment::NeedsFlipping() const
 {
-    return !FlipPositions.empty();
+    return !NewFlips.empty();
 }
 
 void Object::Segment::FixFlipPositions()
 {
     // Flipping always grows the code a bit.
-    // Count the amount of flipping needed in each segment.
-
-    unsigned offset_amount = 0;
+    // Each newly flipped branch moves everything after it by 3 bytes.
+    // The branches flipped in earlier passes already are in place,
+    // but they still move along with the code in front of them.
 
     FlipPositionSet new_set;
 
+    FlipPositionSet::const_iterator n = NewFlips.begin();
+    unsigned offset_amount = 0;
+
     for(FlipPositionSet::const_iterator
         i = FlipPositions.begin();
         i != FlipPositions.end();
         ++i)
     {
-        unsigned address = *i;
-        new_set.insert(address + offset_amount);
-
-        offset_amount += 3; // grows by 3 bytes
+        for(; n != NewFlips.end() && *n < *i; ++n)
+        {
+            new_set.insert(*n + offset_amount);
+            offset_amount += 3; // grows by 3 bytes
+        }
+        new_set.insert(*i + offset_amount);
+    }
+    for(; n != NewFlips.end(); ++n)
+    {
+        new_set.insert(*n + offset_amount);
+        offset_amount += 3;
     }
 
     FlipPositions = new_set;
@@ -453,7 +496,7 @@ void Object::Segment::FixFlipPositions()
 
 void Object::Segment::CloseSegment()
 {
-    FlipPositions.clear();
+    NewFlips.clear();
 
     for(std::list<Extern>::const_iterator
         i=Externs.begin(); i!=Externs.end(); ++i)
@@ -464,6 +507,8 @@ void Object::Segment::CloseSegment()
               long           value = ref.GetValue();
         const std::string&    name = ref.GetName();
 
+        RelocCount.Add();
+
         switch(ref.GetType())
         {
             case FORCE_LOBYTE:
@@ -571,11 +616,7 @@ void Object::Segment::CloseSegment()
             {
                 const long diff = value - (long)address - 1;
 
-                int threshold = 0;
-                extern bool already_reprocessed; /* Ugly hack */
-                if(!already_reprocessed) threshold = 20;
-
-                if(diff < -0x80+threshold || diff >= 0x80-threshold)
+                if(diff < -0x80 || diff >= 0x80)
                 {
                     if(fix_jumps)
                     {
@@ -586,7 +627,7 @@ void Object::Segment::CloseSegment()
                         }
 
                         const unsigned offset = address-1;
-                        FlipPositions.insert(offset);
+                        NewFlips.insert(offset);
                     }
                     else
                     {
@@ -661,13 +702,102 @@ bool Object::FindLabel(const std::string& name,
     return false;
 }
 
+class Object::Cycles
+{
+public:
+    struct Scope
+    {
+        std::string      name;      // The code label it begins at, if any
+        SegmentSelection seg;
+        unsigned         begin, end;
+        unsigned         level;
+        unsigned         base, max; // Without and with all the penalties
+        unsigned         budget;    // 0 = none
+        std::string      unbounded; // Why there is no bound, if there isn't
+        bool             closed;
+
+        /* Jumps to labels not yet behind; they are fine if the labels
+         * turn out to be later in this scope
+         */
+        struct Jump
+        {
+            std::string      target;
+            SegmentSelection seg;
+            unsigned         from;
+        };
+        std::vector<Jump> jumps;
+    };
+    std::vector<Scope>    scopes; // In the order they begin
+    std::vector<unsigned> open;   // Indexes to scopes, the innermost last
+
+    /* The latest code label; a scope that begins there is named after it */
+    std::string      label;
+    SegmentSelection labelseg;
+    unsigned         labelpos;
+
+    Cycles(): scopes(), open(), label(), labelseg(CODE), labelpos(0) { }
+
+    Scope* Current() { return open.empty() ? nullptr : &scopes[open.back()]; }
+
+    const Scope* FindNamed(const std::string& name) const
+    {
+        for(unsigned a=scopes.size(); a-- > 0; )
+            if(scopes[a].name == name)
+                return &scopes[a];
+        return nullptr;
+    }
+};
+
+namespace
+{
+    const std::string DescribeJump(const std::string& target)
+    {
+        return target[0] == '$' ? "jmp to a branch label" : "jmp " + target;
+    }
+
+    const char* CycleSegName(SegmentSelection seg)
+    {
+        switch(seg)
+        {
+            case CODE: return "TEXT";
+            case DATA: return "DATA";
+            case ZERO: return "ZERO";
+            case BSS:  return "BSS";
+        }
+        return "?";
+    }
+
+    const std::string DescribeScope(const Object::Cycles::Scope& s)
+    {
+        if(!s.name.empty()) return s.name;
+        char Buf[64];
+        std::sprintf(Buf, "The scope at %s $%04X", CycleSegName(s.seg), s.begin);
+        return Buf;
+    }
+}
+
 void Object::StartScope()
 {
     ++CurScope;
+
+    Cycles::Scope s {};
+    s.seg   = CurSegment;
+    s.begin = s.end = GetPos();
+    s.level = CurScope;
+    // The scope of a whole file isn't a routine
+    if(CurScope > 1 && cycles->labelseg == CurSegment && cycles->labelpos == s.begin)
+        s.name = cycles->label;
+
+    cycles->open.push_back(cycles->scopes.size());
+    cycles->scopes.push_back(s);
 }
 
 void Object::EndScope()
 {
+    StatScope timing(ScopeTime);
+
+    EndCycleScope();
+
     code->CheckExterns(CurScope, *this);
     data->CheckExterns(CurScope, *this);
     zero->CheckExterns(CurScope, *this);
@@ -690,6 +820,57 @@ void Object::EndScope()
     --CurScope;
 }
 
+void Object::EndCycleScope()
+{
+    /* This runs before the labels of the scope are forgotten,
+     * so that the jumps into it can still be found.
+     */
+    if(cycles->open.empty()) return;
+
+    Cycles::Scope& s = *cycles->Current();
+    cycles->open.pop_back();
+    s.closed = true;
+    if(CurSegment == s.seg) s.end = GetPos();
+
+    Cycles::Scope* outer = cycles->Current();
+    if(outer)
+    {
+        outer->base += s.base;
+        outer->max  += s.max;
+        if(outer->unbounded.empty()) outer->unbounded = s.unbounded;
+    }
+
+    /* A jump out of this scope is judged again by the outer scope */
+    for(const Cycles::Scope::Jump& j: s.jumps)
+    {
+        SegmentSelection seg;
+        unsigned addr;
+        if(FindLabel(j.target, seg, addr)
+        && seg == j.seg && seg == s.seg
+        && addr > j.from && addr <= s.end)
+        {
+            continue; // Forward within this scope
+        }
+        if(s.unbounded.empty()) s.unbounded = DescribeJump(j.target);
+        if(outer) outer->jumps.push_back(j);
+    }
+    s.jumps.clear();
+
+    if(!s.budget) return;
+    if(!s.unbounded.empty())
+    {
+        std::fprintf(stderr, "Error: %s has a budget of %u cycles, but no bound (%s)\n",
+            DescribeScope(s).c_str(), s.budget, s.unbounded.c_str());
+        assembly_errors = true;
+    }
+    else if(s.max > s.budget)
+    {
+        std::fprintf(stderr, "Error: %s may take %u cycles, over its budget of %u\n",
+            DescribeScope(s).c_str(), s.max, s.budget);
+        assembly_errors = true;
+    }
+}
+
 void Object::AddExtern(char prefix, const std::string& ref, long value)
 {
     GetSeg().AddExtern(prefix, ref, value, CurScope);
@@ -698,6 +879,18 @@ void Object::AddExtern(char prefix, const std::string& ref, long value)
 void Object::DefineLabel(const std::string& label)
 {
     DefineLabel(label, GetPos());
+
+    std::string::size_type begin = label.find_first_not_of("+&");
+    if(begin == label.npos || label[begin] == '$') return; // Branch labels
+
+    cycles->label    = label.substr(begin);
+    cycles->labelseg = CurSegment;
+    cycles->labelpos = GetPos();
+
+    // A label at the beginning of a scope names it, too
+    Cycles::Scope* s = cycles->Current();
+    if(s && s->level > 1 && s->name.empty() && s->seg == CurSegment && s->begin == GetPos())
+        s->name = cycles->label;
 }
 
 unsigned Object::GetPos() const
@@ -755,6 +948,7 @@ void Object::DefineLabel(const std::string& label, unsigned value)
     }
 
     GetSeg().DefineLabel(scopenum, s, value);
+    LabelCount.Add();
 }
 
 void Object::SetPos(unsigned newpos)
@@ -772,6 +966,8 @@ void Object::UndefineLabel(const std::string& label)
 
 void Object::CloseSegments()
 {
+    StatScope timing(CloseTime);
+
     code->CloseSegment();
     data->CloseSegment();
     zero->CloseSegment();
@@ -780,54 +976,79 @@ void Object::CloseSegments()
 
 namespace
 {
+    /* The Put functions write either into a file
+     * or into a buffer that is written out at once.
+     */
     void PutC(unsigned char c, std::FILE* fp)
     {
         // 8-bit output.
         std::fputc(c, fp);
     }
+    void PutC(unsigned char c, std::string& out)
+    {
+        out += (char)c;
+    }
     void PutS(const void* s, unsigned n, std::FILE* fp)
     {
         std::fwrite(s, n, 1, fp);
         //for(unsigned a=0; a<n; ++a) PutC(s[a], fp);
     }
-    void PutW(unsigned short w, std::FILE* fp)
+    void PutS(const void* s, unsigned n, std::string& out)
+    {
+        out.append((const char*)s, n);
+    }
+    template<typename Sink>
+    void PutW(unsigned short w, Sink&& fp)
     {
         // 16-bit lsb-first O65 output.
         PutC(w & 0xFF, fp);
         PutC(w >> 8,  fp);
     }
-    void PutMW(unsigned short w, std::FILE* fp)
+    template<typename Sink>
+    void PutMW(unsigned short w, Sink&& fp)
     {
         // 16-bit msb-first IPS output.
         PutC(w >> 8,  fp);
         PutC(w & 0xFF, fp);
     }
-    void PutD(unsigned int w, std::FILE* fp)
+    template<typename Sink>
+    void PutD(unsigned int w, Sink&& fp)
     {
         // 32-bit lsb-first O65 output.
         PutW(w & 0xFFFF, fp);
         PutW(w >> 16,    fp);
     }
-    void PutL(unsigned int w, std::FILE* fp)
+    template<typename Sink>
+    void PutL(unsigned int w, Sink&& fp)
     {
         // 24-bit msb-first IPS output.
         PutC((w >> 16) & 0xFF, fp);
         PutC((w >> 8) & 0xFF, fp);
         PutC(w & 0xFF, fp);
     }
-    void PutWD(unsigned int w, std::FILE* fp, bool Use32)
+    template<typename Sink>
+    void PutLD(unsigned int w, Sink&& fp, bool Use32)
+    {
+        // 24 or 32-bit msb-first IPS output.
+        if(Use32) PutC(w >> 24, fp);
+        PutL(w, fp);
+    }
+    template<typename Sink>
+    void PutWD(unsigned int w, Sink&& fp, bool Use32)
     {
         // 16 or 32-bit lsb-first O65 output.
         if(Use32) PutD(w, fp); else PutW(w, fp);
     }
-    void PutCustomHeader(std::FILE* fp, int type, int param1, int param2)
+    template<typename Sink>
+    void PutCustomHeader(Sink&& fp, int type, int param1, int param2)
     {
         PutC(7,      fp); // length: 1+1 + 1 + 4
         PutC(type,   fp);
         PutC(param1, fp);
         PutD(param2, fp);
     }
-    void PutCustomHeader(std::FILE* fp, int type, const std::string& s)
+    template<typename Sink>
+    void PutCustomHeader(Sink&& fp, int type, const std::string& s)
     {
         PutC(s.size()+3, fp); // length: 1+1+string+1
         PutC(type,       fp);
@@ -847,7 +1068,7 @@ namespace
             num2str.push_back(name);
         }
 
-        void Put(std::FILE* fp, bool use32)
+        void Put(std::string& fp, bool use32)
         {
             PutWD(size(), fp, use32);
             for(unsigned a=0; a<size(); ++a)
@@ -887,7 +1108,7 @@ namespace
 
     void PutReloc(const Object::Segment& seg,
                   struct Unresolved& syms,
-                  std::FILE* fp)
+                  std::string& fp)
     {
         // Address-sorted table of relocs in binary format.
         RelocMap relocs;
@@ -1010,23 +1231,28 @@ namespace
         PutC(0, fp);
     }
 
-    unsigned PutLabels(const Object::Segment& seg,
-                       SegmentSelection segtype,
-                       std::FILE* fp,
-                       bool use32)
+    unsigned CountLabels(const Object::Segment& seg)
     {
-        const unsigned char segid = GetSegmentID(segtype);
-
         typedef Object::Segment::LabelMap LabelMap;
         const LabelMap& labels = seg.GetLabels();
 
-        // Count labels
         unsigned count = 0;
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
         {
             count += i->second.size();
         }
-        //PutWD(count, fp, use32);
+        return count;
+    }
+
+    void PutLabels(const Object::Segment& seg,
+                   SegmentSelection segtype,
+                   std::string& fp,
+                   bool use32)
+    {
+        const unsigned char segid = GetSegmentID(segtype);
+
+        typedef Object::Segment::LabelMap LabelMap;
+        const LabelMap& labels = seg.GetLabels();
 
         // Put labels
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
@@ -1044,36 +1270,186 @@ namespace
                 PutWD(addr, fp, use32);
             }
         }
-
-        return count;
     }
 
+    /* In IPS32, the addresses in the patches are 32-bit too */
     const std::pair<unsigned, std::string> BuildGlobalPatch
-       (const std::string& varname, unsigned addr)
+       (const std::string& varname, unsigned addr, bool ips32)
     {
         std::string patch(varname);
         patch += (char)0;
         patch += (char)((addr) & 0xFF);
         patch += (char)((addr >> 8) & 0xFF);
         patch += (char)((addr >> 16) & 0xFF);
+        if(ips32) patch += (char)((addr >> 24) & 0xFF);
         return make_pair(IPS_ADDRESS_GLOBAL, patch);
     }
 
     const std::pair<unsigned, std::string> BuildExternPatch
        (unsigned addr,
         const std::string& varname,
-        unsigned size)
+        unsigned size, bool ips32)
     {
         std::string patch(varname);
         patch += (char)0;
         patch += (char)((addr) & 0xFF);
         patch += (char)((addr >> 8) & 0xFF);
         patch += (char)((addr >> 16) & 0xFF);
+        if(ips32) patch += (char)((addr >> 24) & 0xFF);
         patch += (char)(size & 0xFF);
         return make_pair(IPS_ADDRESS_EXTERN, patch);
     }
 
-    void IPSwriteSeg(const Object::Segment& seg, std::FILE* fp)
+    bool IPSreservedAddress(unsigned addr, bool ips32)
+    {
+        return addr == (ips32 ? IPS32_EOF_MARKER : IPS_EOF_MARKER)
+            || addr == IPS_ADDRESS_EXTERN
+            || addr == IPS_ADDRESS_GLOBAL;
+    }
+
+    void IPScheckAddress(unsigned addr, bool ips32)
+    {
+        if(addr == (ips32 ? IPS32_EOF_MARKER : IPS_EOF_MARKER))
+        {
+            fprintf(stderr,
+                "Error: IPS doesn't allow patches that go to $%X\n", addr);
+            assembly_errors = true;
+        }
+        else if(addr == IPS_ADDRESS_EXTERN)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is reserved for IPS_ADDRESS_EXTERN\n", addr);
+            assembly_errors = true;
+        }
+        else if(addr == IPS_ADDRESS_GLOBAL)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is reserved for IPS_ADDRESS_GLOBAL\n", addr);
+            assembly_errors = true;
+        }
+        else if(!ips32 && addr > 0xFFFFFF)
+        {
+            fprintf(stderr,
+                "Error: Address $%X is too big for IPS format\n", addr);
+            assembly_errors = true;
+        }
+    }
+
+    /* Writes size bytes as one or more records of at most $FFFF bytes.
+     * With rle, all the bytes are data[0] and RLE records are used.
+     */
+    void IPSwriteRecords(unsigned addr, const unsigned char* data, unsigned size,
+                         bool rle, std::FILE* fp, bool ips32)
+    {
+        while(size > 0)
+        {
+            unsigned count = std::min(size, 0xFFFFu);
+            /* Don't let the next record start at a reserved address */
+            if(count < size && IPSreservedAddress(addr + count, ips32)) --count;
+
+            IPScheckAddress(addr, ips32);
+            PutLD(addr, fp, ips32);
+            if(rle)
+            {
+                PutMW(0, fp);
+                PutMW(count, fp);
+                PutC(data[0], fp);
+            }
+            else
+            {
+                PutMW(count, fp);
+                PutS(data, count, fp);
+                data += count;
+            }
+            addr += count;
+            size -= count;
+        }
+    }
+
+    /* Writes one contiguous blob using as few bytes as possible.
+     *
+     * A plain record costs 5 bytes plus its data, an RLE record
+     * costs 8 bytes. The blob is split into maximal runs of equal
+     * bytes, and each run is either written as an RLE record, or
+     * literally, merged into the plain record of the previous run
+     * when that one was literal too. The cheapest combination is
+     * found with a dynamic programming pass over the runs.
+     *
+     * A new record is never started at a reserved address
+     * (other than at the start of the blob, which is an error).
+     */
+    void IPSwriteBlob(unsigned addr, const unsigned char* data, unsigned size,
+                      std::FILE* fp, bool ips32)
+    {
+        std::vector<std::pair<unsigned, unsigned> > runs; // begin, length
+        for(unsigned begin = 0; begin < size; )
+        {
+            unsigned end = begin+1;
+            while(end < size && data[end] == data[begin]) ++end;
+            /* A run can't start a record at a reserved address,
+             * but the rest of it still can. */
+            if(begin > 0 && IPSreservedAddress(addr + begin, ips32)) end = begin+1;
+            runs.emplace_back(begin, end-begin);
+            begin = end;
+        }
+
+        /* cost[k][open]: bytes written for runs 0..k-1, where open
+         * tells whether run k-1 left a plain record that can be extended.
+         */
+        const unsigned long Infinite = ~0UL;
+        const unsigned n = runs.size();
+        std::vector<std::array<unsigned long, 2> > cost(n+1, {Infinite,Infinite});
+        std::vector<std::array<bool, 2> > came_open(n+1); // predecessor state
+        cost[0][0] = 0;
+
+        for(unsigned k=0; k<n; ++k)
+        {
+            const auto [begin, length] = runs[k];
+            const bool may_start = begin == 0 || !IPSreservedAddress(addr + begin, ips32);
+
+            for(unsigned open=0; open<2; ++open)
+            {
+                const unsigned long c = cost[k][open];
+                if(c == Infinite) continue;
+
+                if(may_start)
+                {
+                    unsigned long rle = c + 8 * ((length + 0xFFFE) / 0xFFFF);
+                    if(rle < cost[k+1][0]) { cost[k+1][0] = rle; came_open[k+1][0] = open; }
+                }
+                if(open || may_start)
+                {
+                    unsigned long lit = c + length + (open ? 0 : 5);
+                    if(lit < cost[k+1][1]) { cost[k+1][1] = lit; came_open[k+1][1] = open; }
+                }
+            }
+        }
+
+        /* Walk back to find which runs were chosen to be literal */
+        std::vector<bool> literal(n);
+        bool open = cost[n][1] < cost[n][0];
+        for(unsigned k=n; k-- > 0; )
+        {
+            literal[k] = open;
+            open = came_open[k+1][open];
+        }
+
+        for(unsigned k=0; k<n; )
+        {
+            const unsigned begin = runs[k].first;
+            if(!literal[k])
+            {
+                IPSwriteRecords(addr+begin, data+begin, runs[k].second, true, fp, ips32);
+                ++k;
+                continue;
+            }
+            unsigned end = begin;
+            for(; k<n && literal[k]; ++k) end += runs[k].second;
+            IPSwriteRecords(addr+begin, data+begin, end-begin, false, fp, ips32);
+        }
+    }
+
+    void IPSwriteSeg(const Object::Segment& seg, std::FILE* fp, bool ips32)
     {
         typedef Object::Segment::LabelMap LabelMap;
         const LabelMap& labels = seg.GetLabels();
@@ -1088,7 +1464,7 @@ namespace
                 j != i->second.end();
                 ++j)
             {
-                patches.push_back(BuildGlobalPatch(j->first, (j->second)));
+                patches.push_back(BuildGlobalPatch(j->first, (j->second), ips32));
             }
         }
 
@@ -1103,17 +1479,17 @@ namespace
 
         WalkList(R16lo, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 1));
+            patches.push_back(BuildExternPatch((i->first), i->second, 1, ips32));
         }
 
         WalkList(R16, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 2));
+            patches.push_back(BuildExternPatch((i->first), i->second, 2, ips32));
         }
 
         WalkList(R24, Reloc)
         {
-            patches.push_back(BuildExternPatch((i->first), i->second, 3));
+            patches.push_back(BuildExternPatch((i->first), i->second, 3, ips32));
         }
 
         if(!seg.R.R16hi.Relocs.empty())
@@ -1132,7 +1508,7 @@ namespace
             i != patches.end();
             ++i)
         {
-            PutL(i->first, fp);
+            PutLD(i->first, fp, ips32);
             PutMW(i->second.size(), fp);
             PutS(i->second.data(), i->second.size(), fp);
         }
@@ -1141,93 +1517,78 @@ namespace
         for(;;)
         {
             unsigned size;
-            addr = seg.FindNextBlob(addr, size);
+            const unsigned char* data;
+            addr = seg.FindNextBlob(addr, size, data);
             if(!size) break;
 
-            for(unsigned left = size; left > 0; )
-            {
-                unsigned count = std::min(left, 20000u);
-
-                //fprintf(stderr, "Writing %u @ %06X\n", count, addr);
-
-                if(addr == IPS_EOF_MARKER)
-                {
-                    fprintf(stderr,
-                        "Error: IPS doesn't allow patches that go to $%X\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr == IPS_ADDRESS_EXTERN)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is reserved for IPS_ADDRESS_EXTERN\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr == IPS_ADDRESS_GLOBAL)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is reserved for IPS_ADDRESS_GLOBAL\n", addr);
-                    assembly_errors = true;
-                }
-                else if(addr > 0xFFFFFF)
-                {
-                    fprintf(stderr,
-                        "Error: Address $%X is too big for IPS format\n", addr);
-                    assembly_errors = true;
-                }
-
-                PutL(addr, fp);
-                PutMW(count, fp);
-
-                std::vector<unsigned char> data = seg.GetContent(addr, count);
-
-                PutS(&data[0], count, fp);
+            IPSwriteBlob(addr, data, size, fp, ips32);
+            addr += size;
+        }
+    }
 
-                left -= count;
-                addr += count;
-            }
+    /* Calls func(addr, data, length) for each stored part of the segment
+     * that falls within begin..begin+size-1. Bytes in between are zero.
+     */
+    template<typename F>
+    void ForEachPart(const Object::Segment& seg, unsigned begin, unsigned size, F&& func)
+    {
+        const unsigned end = begin + size;
+        for(unsigned pos = begin; pos < end; )
+        {
+            unsigned length;
+            const unsigned char* data;
+            unsigned addr = seg.FindBlobAt(pos, length, data);
+            if(!length || addr >= end) break;
+            if(addr < pos) { data += pos-addr; length -= pos-addr; addr = pos; }
+            if(length > end-addr) length = end-addr;
+            func(addr, data, length);
+            pos = addr + length;
         }
     }
 
-    void RAWwriteSeg(const Object::Segment& seg, std::FILE* fp, unsigned offset,
-                     unsigned skip=0, unsigned limit=0)
+    void PutSegContent(const Object::Segment& seg, std::string& out)
     {
-        if(!limit)
+        const std::size_t at   = out.size();
+        const unsigned    base = seg.GetBase();
+        out.append(seg.GetSize(), '\0');
+        ForEachPart(seg, base, seg.GetSize(), [&](unsigned addr, const unsigned char* data, unsigned length)
         {
-            unsigned base     = seg.GetBase();
-            unsigned length   = seg.GetSize();
-            std::multimap<unsigned, std::pair<unsigned,unsigned>> blobs; //For sorting
-            while(length > 0)
-            {
-                unsigned gran  = 0x2000;
-                unsigned cap   = base - (base % gran) + gran;
-                unsigned limit = std::min(length, cap-base);
-                unsigned fileoffset = offset + NES2ROMaddr(base);
-                blobs.emplace(fileoffset, std::pair<unsigned,unsigned>(base,limit));
-                /*
-                fprintf(stderr, "offs=%u base=$%X cap=$%X length=%u skip=%u limit=$%X fileoffs=$%X\n",
-                    offset,base,cap,length,base+skip,limit,
-                    fileoffset
-                );
-                */
-                length -= limit;
-                skip   += limit;
-                base   += limit;
-            }
-            for(auto& b: blobs)
-            {
-                /*fprintf(stderr, "fileoffs=$%X, skip=$%X limit=$%X\n",
-                    b.first, b.second.first, b.second.second
-                );*/
-                RAWwriteSeg(seg, fp, offset, b.second.first, b.second.second);
-            }
-            return;
+            std::memcpy(&out[at + addr-base], data, length);
+        });
+    }
+
+    void RAWplaceSeg(const Object::Segment& seg, std::vector<unsigned char>& image,
+                     unsigned offset)
+    {
+        unsigned base     = seg.GetBase();
+        unsigned length   = seg.GetSize();
+        std::multimap<unsigned, std::pair<unsigned,unsigned>> blobs; //For sorting
+        while(length > 0)
+        {
+            unsigned gran  = 0x2000;
+            unsigned cap   = base - (base % gran) + gran;
+            unsigned limit = std::min(length, cap-base);
+            unsigned fileoffset = offset + NES2ROMaddr(base);
+            blobs.emplace(fileoffset, std::pair<unsigned,unsigned>(base,limit));
+            length -= limit;
+            base   += limit;
         }
 
-        std::vector<unsigned char> lump = seg.GetContent(skip,
-            std::min(limit, seg.GetSize() - skip)
-        );
-        if(std::any_of(lump.begin(), lump.end(), [&](unsigned n){return n!=0;}))
+        for(auto& b: blobs)
         {
+            const unsigned fileoffset = b.first;
+            const unsigned base       = b.second.first;
+            const unsigned limit      = b.second.second;
+
+            // Granules that are all zero are not written.
+            bool nonzero = false;
+            ForEachPart(seg, base, limit, [&](unsigned, const unsigned char* data, unsigned length)
+            {
+                if(!nonzero)
+                    nonzero = std::any_of(data, data+length, [](unsigned char c){return c!=0;});
+            });
+            if(!nonzero) continue;
+
             if(!seg.R.R16.Relocs.empty())
             {
                 fprintf(stderr, "Error: 16-bit externs aren't supported in RAW format.\n");
@@ -1254,29 +1615,16 @@ namespace
                 assembly_errors = true;
             }
 
-            /*if(!seg.GetLabels().empty())
-            {
-                fprintf(stderr, "Warning: Labels are not written into a RAW file.\n");
-            }*/
-
-            unsigned base = offset + NES2ROMaddr(skip);
-            fprintf(stderr, "Writing a seg with base=$%X, size=$%zX to offset $%X\n",
-                skip, lump.size(), base);
+            fprintf(stderr, "Writing a seg with base=$%X, size=$%X to offset $%X\n",
+                base, limit, fileoffset);
 
-            /*if(base > offset)
+            if(image.size() < fileoffset + limit) image.resize(fileoffset + limit);
+            std::fill_n(image.begin() + fileoffset, limit, 0);
+            ForEachPart(seg, base, limit, [&](unsigned addr, const unsigned char* data, unsigned length)
             {
-                fprintf(stderr,
-                    "Warning: RAW file has no 'origin', but we're writing a segment that is supposed to have origin of $%X.\n"
-                    "         Substituting the 'base' with zero data.\n",
-                    base-offset);
-            }*/
-
-            std::fseek(fp, base, SEEK_SET);
-            PutS(&lump[0], lump.size(), fp);
-            std::fflush(fp);
+                std::copy_n(data, length, image.begin() + fileoffset + (addr-base));
+            });
         }
-        /*else
-            fprintf(stderr, "- skipped, all %zu zero\n", lump.size());*/
     }
 
     void NotWritingSeg(const Object::Segment& seg)
@@ -1322,27 +1670,33 @@ void Object::WriteO65(std::FILE* fp)
 
     if(use32) Mode |= 0x2000; // Use 32-bit addresses
 
+    /* The object is built in memory and written at once,
+     * so that it can be written into a pipe.
+     */
+    std::string out;
+    out.reserve(code->GetSize() + data->GetSize() + 4096);
+
     // Put O65 headerl
-    PutS("\1\0o65\0", 6, fp);
+    PutS("\1\0o65\0", 6, out);
 
     // Put Mode
-    PutW(Mode, fp);
+    PutW(Mode, out);
 
     //text
-    PutWD(code->GetBase(), fp, use32);
-    PutWD(code->GetSize(), fp, use32);
+    PutWD(code->GetBase(), out, use32);
+    PutWD(code->GetSize(), out, use32);
     //data
-    PutWD(data->GetBase(), fp, use32);
-    PutWD(data->GetSize(), fp, use32);
+    PutWD(data->GetBase(), out, use32);
+    PutWD(data->GetSize(), out, use32);
     //bss
-    PutWD(bss->GetBase(), fp, use32);
-    PutWD(bss->GetSize(), fp, use32);
+    PutWD(bss->GetBase(), out, use32);
+    PutWD(bss->GetSize(), out, use32);
     //zero
-    PutWD(zero->GetBase(), fp, use32);
-    PutWD(zero->GetSize(), fp, use32);
+    PutWD(zero->GetBase(), out, use32);
+    PutWD(zero->GetSize(), out, use32);
 
     // stack size - 0 = undefined
-    PutWD(0x0000, fp, use32);
+    PutWD(0x0000, out, use32);
 
     for(auto [segtype,segptr]: std::initializer_list<std::pair<SegmentSelection,Segment*>>
                                {{CODE,code},{DATA,data},{BSS,bss},{ZERO,zero}})
@@ -1350,41 +1704,40 @@ void Object::WriteO65(std::FILE* fp)
         switch(segptr->Linkage.type)
         {
             case LinkageWish::LinkInGroup:
-                PutCustomHeader(fp, 10, segtype*8+1, segptr->Linkage.GetGroup());
+                PutCustomHeader(out, 10, segtype*8+1, segptr->Linkage.GetGroup());
                 break;
             case LinkageWish::LinkThisPage:
-                PutCustomHeader(fp, 10, segtype*8+2, segptr->Linkage.GetPage());
+                PutCustomHeader(out, 10, segtype*8+2, segptr->Linkage.GetPage());
                 break;
 
             default: /* ignore */ break;
         }
     }
 
-    PutCustomHeader(fp, 2, PROGNAME " " VERSION);
+    PutCustomHeader(out, 2, PROGNAME " " VERSION);
 
     // end custom headers
-    PutC(0, fp);
+    PutC(0, out);
 
-    std::fwrite(&code->GetContent()[0], code->GetSize(), 1, fp);
-    std::fwrite(&data->GetContent()[0], data->GetSize(), 1, fp);
+    PutSegContent(*code, out);
+    PutSegContent(*data, out);
 
-    externs.Put(fp, use32);
+    externs.Put(out, use32);
 
-    PutReloc(*code, externs, fp);
-    PutReloc(*data, externs, fp);
+    PutReloc(*code, externs, out);
+    PutReloc(*data, externs, out);
 
-    unsigned n_labels = 0;
-    long labels_pos = std::ftell(fp);
-    std::fseek(fp, use32?4:2, SEEK_CUR);
+    const unsigned n_labels
+        = CountLabels(*code) + CountLabels(*data)
+        + CountLabels(*zero) + CountLabels(*bss);
+    PutWD(n_labels, out, use32);
 
-    n_labels += PutLabels(*code, CODE, fp, use32);
-    n_labels += PutLabels(*data, DATA, fp, use32);
-    n_labels += PutLabels(*zero, ZERO, fp, use32);
-    n_labels += PutLabels( *bss, BSS,  fp, use32);
+    PutLabels(*code, CODE, out, use32);
+    PutLabels(*data, DATA, out, use32);
+    PutLabels(*zero, ZERO, out, use32);
+    PutLabels( *bss, BSS,  out, use32);
 
-    std::fseek(fp, labels_pos, SEEK_SET);
-    PutWD(n_labels, fp, use32);
-    std::fseek(fp, 0, SEEK_END);
+    std::fwrite(out.data(), 1, out.size(), fp);
 }
 
 void Object::WriteIPS(std::FILE* fp)
@@ -1395,17 +1748,32 @@ void Object::WriteIPS(std::FILE* fp)
         fprintf(stderr, "Warning: IPS file is never relocated - .link statement(s) ignored.\n");
     }
 
-    PutS("PATCH", 5, fp);
+    /* Addresses past 24 bits (banks past $FF) need the IPS32 variant */
+    const bool ips32 = code->GetBase() + code->GetSize() > 0x1000000
+                    || data->GetBase() + data->GetSize() > 0x1000000;
+
+    if(ips32) PutS("IPS32", 5, fp); else PutS("PATCH", 5, fp);
 
-    IPSwriteSeg(*code, fp);
-    IPSwriteSeg(*data, fp);
+    IPSwriteSeg(*code, fp, ips32);
+    IPSwriteSeg(*data, fp, ips32);
     NotWritingSeg(*bss);
     NotWritingSeg(*zero);
 
-    PutS("EOF", 3, fp);
+    if(ips32) PutS("EEOF", 4, fp); else PutS("EOF", 3, fp);
 }
 
-void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset)
+void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset, unsigned char fill)
+{
+    std::vector<unsigned char> image;
+    BuildRAW(image, size, offset, fill);
+
+    if(fp && !image.empty())
+    {
+        std::fwrite(&image[0], 1, image.size(), fp);
+    }
+}
+
+void Object::BuildRAW(std::vector<unsigned char>& image, unsigned size, unsigned offset, unsigned char fill)
 {
     if(code->Linkage.type != LinkageWish::LinkAnywhere
     || data->Linkage.type != LinkageWish::LinkAnywhere)
@@ -1413,19 +1781,12 @@ void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset)
         fprintf(stderr, "Warning: RAW file is never relocated - .link statement(s) ignored.\n");
     }
 
-    RAWwriteSeg(*code, fp, offset);
-    RAWwriteSeg(*data, fp, offset);
+    image.assign(offset + size, fill);
+
+    RAWplaceSeg(*code, image, offset);
+    RAWplaceSeg(*data, image, offset);
     NotWritingSeg(*bss);
     NotWritingSeg(*zero);
-
-    if(fp)
-    {
-        std::fseek(fp, 0, SEEK_END);
-        if(std::ftell(fp) < size)
-        {
-            ftruncate(fileno(fp), size);
-        }
-    }
 }
 
 void Object::Dump()
@@ -1476,6 +1837,95 @@ void Object::SetLinkagePage(unsigned page)
 }
 
 
+void Object::AddCycles(unsigned base, unsigned max)
+{
+    if(Cycles::Scope* s = cycles->Current())
+    {
+        s->base += base;
+        s->max  += max;
+    }
+}
+
+void Object::AddUnboundedCycles(const std::string& reason)
+{
+    Cycles::Scope* s = cycles->Current();
+    if(s && s->unbounded.empty()) s->unbounded = reason;
+}
+
+void Object::AddJump(const std::string& target)
+{
+    Cycles::Scope* current = cycles->Current();
+    if(!current) return;
+
+    SegmentSelection seg;
+    unsigned addr;
+    if(!FindLabel(target, seg, addr) || seg != CurSegment || addr > GetPos())
+    {
+        // Forward, or an extern; known when the scope ends
+        current->jumps.push_back(Cycles::Scope::Jump{target, CurSegment, GetPos()});
+        return;
+    }
+
+    for(unsigned index: cycles->open)
+    {
+        Cycles::Scope& s = cycles->scopes[index];
+        if(!s.unbounded.empty()) continue;
+        if(s.seg == seg && s.begin <= addr)
+            s.unbounded = target[0] == '$' ? "a loop" : "a loop to " + target;
+        else
+            s.unbounded = DescribeJump(target); // Back out of the scope
+    }
+}
+
+void Object::AddCall(const std::string& target)
+{
+    /* The label must still mean the same place as
+     * when it named the scope; local labels get reused.
+     */
+    const Cycles::Scope* callee = cycles->FindNamed(target);
+    SegmentSelection seg;
+    unsigned addr;
+    if(!callee || !callee->closed || !callee->unbounded.empty()
+    || !FindLabel(target, seg, addr) || seg != callee->seg || addr != callee->begin)
+    {
+        AddUnboundedCycles("jsr " + target);
+        return;
+    }
+    AddCycles(callee->base, callee->max);
+}
+
+void Object::SetCycleBudget(unsigned max)
+{
+    if(Cycles::Scope* s = cycles->Current())
+        if(!s->budget || max < s->budget)
+            s->budget = max;
+}
+
+void Object::DumpCycles() const
+{
+    bool first = true;
+    for(const Cycles::Scope& s: cycles->scopes)
+    {
+        if(!s.max && !s.budget && s.unbounded.empty()) continue;
+
+        if(first)
+        {
+            std::fprintf(stderr, "Cycles of the scopes:\n");
+            first = false;
+        }
+        const std::string name = std::string(s.level-1, '+') + (s.name.empty() ? "-" : s.name);
+        std::fprintf(stderr, " %4s %04X-%04X %-20s",
+            CycleSegName(s.seg), s.begin, s.end, name.c_str());
+        if(!s.unbounded.empty())
+            std::fprintf(stderr, " unbounded (%s)", s.unbounded.c_str());
+        else
+            std::fprintf(stderr, " %5u-%u cycles", s.base, s.max);
+        if(s.budget)
+            std::fprintf(stderr, ", budget %u", s.budget);
+        std::fprintf(stderr, "\n");
+    }
+}
+
 void Object::DumpLabels() const
 {
     code->DumpLabels("TEXT");
@@ -1504,6 +1954,7 @@ void Object::ClearMost()
 {
     CurScope = 0;
     CurSegment = CODE;
+    *cycles = Cycles();
 
     code->ClearMost();
     data->ClearMost();
@@ -1516,6 +1967,7 @@ Object::Object()
       data(new Segment),
       zero(new Segment),
       bss(new Segment),
+      cycles(new Cycles),
       CurScope(0), CurSegment(CODE)
 {
 }
@@ -1526,4 +1978,5 @@ Object::~Object()
     delete data;
     delete zero;
     delete bss;
+    delete cycles;
 }
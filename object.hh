@@ -47,7 +47,9 @@ public:
 
     void WriteO65(std::FILE* fp);
     void WriteIPS(std::FILE* fp);
-    void WriteRAW(std::FILE* fp, unsigned size=0, unsigned offset=0);
+    void WriteRAW(std::FILE* fp, unsigned size=0, unsigned offset=0, unsigned char fill=0);
+    // Assembles the RAW image in memory, leaving room for a header of offset bytes
+    void BuildRAW(std::vector<unsigned char>& image, unsigned size=0, unsigned offset=0, unsigned char fill=0);
 
     // If a REL8 should be flipped at this position
     bool ShouldFlipHere() const;
@@ -66,13 +68,29 @@ public:
     void SetLinkageGroup(unsigned num);
     void SetLinkagePage(unsigned page);
 
+    // Cycle counting of the scopes. Each instruction is counted once,
+    // as if the code of the scope was executed straight through.
+    void AddCycles(unsigned base, unsigned max);
+    // Makes the cycles of the scope unknown
+    void AddUnboundedCycles(const std::string& reason);
+    // A jump back into an open scope is a loop, and a jump out of
+    // the scope leaves it; neither has a bound
+    void AddJump(const std::string& target);
+    // Adds the cycles of the scope that begins at target, if it is known
+    void AddCall(const std::string& target);
+    // The scope must not take more; checked at its end
+    void SetCycleBudget(unsigned max);
+    void DumpCycles() const;
+
 public:
     class Segment;
+    class Cycles;
 
 private:
     // private variables
 
     Segment *code, *data, *zero, *bss;
+    Cycles *cycles;
     unsigned CurScope;
     SegmentSelection CurSegment;
 
@@ -85,6 +103,8 @@ private:
     Segment& GetSeg();
     const Segment& GetSeg() const;
 
+    void EndCycleScope();
+
     void DumpLabels() const;
     void DumpExterns() const;
     void DumpFixups() const;
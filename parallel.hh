@@ -0,0 +1,41 @@
+#ifndef bqtParallelHH
+#define bqtParallelHH
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+/* Number of worker threads used by ParallelFor. 0 = one per CPU. */
+inline unsigned ParallelThreads = 0;
+
+/* Calls func(n) for each n in 0..count-1, spread over worker threads.
+ * The calls must not depend on each other. Whatever they produce
+ * should be stored by index and consumed in order afterwards,
+ * so that the result does not depend on the scheduling.
+ */
+template<typename F>
+void ParallelFor(unsigned count, F&& func)
+{
+    unsigned nthreads = ParallelThreads;
+    if(!nthreads) nthreads = std::thread::hardware_concurrency();
+    if(nthreads > count) nthreads = count;
+    if(nthreads <= 1)
+    {
+        for(unsigned n=0; n<count; ++n) func(n);
+        return;
+    }
+
+    std::atomic<unsigned> next(0);
+    auto worker = [&]()
+    {
+        for(unsigned n; (n = next++) < count; ) func(n);
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads-1);
+    for(unsigned t=1; t<nthreads; ++t) threads.emplace_back(worker);
+    worker();
+    for(auto& t: threads) t.join();
+}
+
+#endif
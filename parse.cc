@@ -74,22 +74,12 @@ namespace
         return token;
     }
 
-    std::unique_ptr<expression> CreatePlusExpr(std::unique_ptr<expression>&& left, std::unique_ptr<expression>&& right)
-    {
-        return std::unique_ptr<expression>( new sum_group(std::move(left), std::move(right), false) );
-    }
-
-    std::unique_ptr<expression> CreateMinusExpr(std::unique_ptr<expression>&& left, std::unique_ptr<expression>&& right)
-    {
-        return std::unique_ptr<expression>( new sum_group(std::move(left), std::move(right), true) );
-    }
-
-    std::unique_ptr<expression> RealParseExpression(ParseData& data, int prio=0,
-                                                    char disallow_local_label=0)
+    expression RealParseExpression(ParseData& data, int prio=0,
+                                   char disallow_local_label=0)
     {
         std::string s = ParseToken(data);
 
-        std::unique_ptr<expression> left; // NULL
+        expression left; // empty
 
         if(s.empty()) /* If no number or symbol */
         {
@@ -120,7 +110,7 @@ namespace
                 {
                     left = RealParseExpression(data, prio_negate, c);
                 }
-                if(!left)
+                if(left.empty())
                 {
                     const std::string RestAfter = data.GetRest();
                     data.LoadState(state);
@@ -136,7 +126,7 @@ namespace
                 }
                 else
                 {
-                    left = std::unique_ptr<expression>( new expr_negate(std::move(left)) );
+                    left = expression::Unary(expression::Negate, std::move(left));
                 }
             }
             else if(c == '~')
@@ -144,8 +134,8 @@ namespace
                 ParseData::StateType state = data.SaveState();
                 data.GetC(); // eat
                 left = RealParseExpression(data, prio_bitnot);
-                if(!left) { data.LoadState(state); return std::move(left); }
-                left = std::unique_ptr<expression>( new expr_bitnot(std::move(left)) );
+                if(left.empty()) { data.LoadState(state); return std::move(left); }
+                left = expression::Unary(expression::BitNot, std::move(left));
             }
             else if(c == '(')
             {
@@ -154,8 +144,8 @@ namespace
                 left = RealParseExpression(data, 0);
                 data.SkipSpace();
                 if(data.PeekC() == ')') data.GetC();
-                else if(left) { left.reset(); } // set NULL
-                if(!left) { data.LoadState(state); return std::move(left); }
+                else if(!left.empty()) { left = expression(); } // set empty
+                if(left.empty()) { data.LoadState(state); return std::move(left); }
             }
             else
             {
@@ -163,11 +153,11 @@ namespace
                 switch(local_label)
                 {
                     case '-':
-                        left = std::unique_ptr<expression>( new expr_label(GetPrevBranchLabel(local_length)) );
+                        left = expression(GetPrevBranchLabel(local_length));
                         for(unsigned a=0; a<local_length; ++a) data.GetC();
                         break;
                     case '+':
-                        left = std::unique_ptr<expression>( new expr_label(GetNextBranchLabel(local_length)) );
+                        left = expression(GetNextBranchLabel(local_length));
                         for(unsigned a=0; a<local_length; ++a) data.GetC();
                         break;
                 }
@@ -202,7 +192,7 @@ namespace
             }
 
             if(negative) value = -value;
-            left = std::unique_ptr<expression>( new expr_number(value) );
+            left = expression(value);
         }
         else
         {
@@ -212,16 +202,16 @@ namespace
                 return std::move(left);
             }
 
-            left = std::unique_ptr<expression>( new expr_label(std::move(s)) );
+            left = expression(s);
         }
 
         data.SkipSpace();
-        if(!left) return std::move(left);
+        if(left.empty()) return std::move(left);
 
     Reop:
         if(!data.EOF())
         {
-            #define op2(reqprio, c1,c2, create_binaryexpr) \
+            #define op2(reqprio, c1,c2, optype) \
                 if(prio < reqprio && data.PeekC() == c1) \
                 { \
                     ParseData::StateType state = data.SaveState(); \
@@ -236,29 +226,25 @@ namespace
                     if(ok) \
                     { \
                         data.GetC(); \
-                        std::unique_ptr<expression> right = RealParseExpression(data, reqprio); \
-                        if(!right) \
+                        expression right = RealParseExpression(data, reqprio); \
+                        if(right.empty()) \
                         { \
                             data.LoadState(state); \
                             return std::move(left); \
                         } \
-                        left = std::unique_ptr<expression>( create_binaryexpr(std::move(left), std::move(right)) ); \
-                        if(left->IsConst()) \
-                        { \
-                            left = std::unique_ptr<expression>( new expr_number(left->GetConst()) ); \
-                        } \
+                        left = expression::Binary(optype, std::move(left), std::move(right)); \
                         goto Reop; \
                 }   }
 
-            op2(prio_addsub, '+',   0, CreatePlusExpr);
-            op2(prio_addsub, '-',   0, CreateMinusExpr);
-            op2(prio_divmul, '*',   0, new expr_mul);
-            op2(prio_divmul, '/',   0, new expr_div);
-            op2(prio_shifts, '<', '<', new expr_shl);
-            op2(prio_shifts, '>', '>', new expr_shr);
-            op2(prio_bitand, '&',   0, new expr_bitand);
-            op2(prio_bitor,  '|',   0, new expr_bitor);
-            op2(prio_bitxor, '^',   0, new expr_bitxor);
+            op2(prio_addsub, '+',   0, expression::Add);
+            op2(prio_addsub, '-',   0, expression::Sub);
+            op2(prio_divmul, '*',   0, expression::Mul);
+            op2(prio_divmul, '/',   0, expression::Div);
+            op2(prio_shifts, '<', '<', expression::Shl);
+            op2(prio_shifts, '>', '>', expression::Shr);
+            op2(prio_bitand, '&',   0, expression::BitAnd);
+            op2(prio_bitor,  '|',   0, expression::BitOr);
+            op2(prio_bitxor, '^',   0, expression::BitXor);
         }
         return std::move(left);
     }
@@ -287,17 +273,11 @@ bool ParseExpression(ParseData& data, ins_parameter& result)
         prefix = 0;
     }
 
-    std::unique_ptr<expression> e = RealParseExpression(data);
-    if(e)
-    {
-        e->Optimize(e);
-    }
-
     result.prefix = prefix;
-    result.exp    = std::move(e);
+    result.exp    = RealParseExpression(data);
 
     //std::fprintf(stderr, "ParseExpression returned: '%s'\n", result.Dump().c_str());
-    return result.exp.get() != nullptr;
+    return !result.exp.empty();
 }
 
 static bool CompareChar(char c1, char c2)
@@ -368,19 +348,19 @@ tristate ins_parameter::is_byte(const Object& obj) const
         return prefix == FORCE_LOBYTE || prefix == FORCE_HIBYTE || prefix == FORCE_SEGBYTE;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
-        auto p = IsLabelSumExpression(exp);
+        auto p = exp.GetLabelSum();
         if(p.second < -0x80 || p.second >= 0x100) return false;
         // If it's a sum expression or a label, 
         // check if the label is in .zero segment (ZERO)
         // and the offset is smaller than 256.
         // If so, this is a byte param.
-        if(!p.first.empty())
+        if(p.first)
         {
             SegmentSelection seg;
             unsigned         value=0;
-            if(obj.FindLabel(p.first, seg, value) && seg==ZERO && value+p.second < 0x100)
+            if(obj.FindLabel(LabelName(p.first), seg, value) && seg==ZERO && value+p.second < 0x100)
             {
                 // Yes, this fits in a byte
                 return true;
@@ -391,7 +371,7 @@ tristate ins_parameter::is_byte(const Object& obj) const
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x80 && value < 0x100;
     }
 }
@@ -403,16 +383,16 @@ tristate ins_parameter::is_word(const Object& obj) const
         return prefix == FORCE_ABSWORD;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
-        auto p = IsLabelSumExpression(exp);
+        auto p = exp.GetLabelSum();
         if(p.second < -0x8000 || p.second >= 0x10000) return false;
         // Could be.
         return maybe;
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x8000 && value < 0x10000;
     }
 }
@@ -424,13 +404,13 @@ tristate ins_parameter::is_long(const Object& obj) const
         return prefix == FORCE_LONG;
     }
 
-    if(!exp->IsConst())
+    if(!exp.IsConst())
     {
         return maybe;
     }
     else
     {
-        long value = exp->GetConst();
+        long value = exp.GetConst();
         return value >= -0x800000 && value < 0x1000000;
     }
 }
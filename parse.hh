@@ -36,14 +36,14 @@ class Object;
 struct ins_parameter
 {
     char prefix;
-    std::unique_ptr<expression> exp;
+    expression exp;
 
     ins_parameter(): prefix(0), exp(/*NULL*/)
     {
     }
 
     ins_parameter(unsigned char num)
-    : prefix(FORCE_LOBYTE), exp(new expr_number(num))
+    : prefix(FORCE_LOBYTE), exp(num)
     {
     }
 
@@ -55,7 +55,7 @@ struct ins_parameter
     {
         std::string result;
         if(prefix) result += prefix;
-        if(exp) result += exp->Dump(); else result += "(nil)";
+        result += exp.Dump();
         return result;
     }
 };
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "placement.hh"
+#include "o65linker.hh"
+#include "space.hh"
+#include "romaddr.hh"
+#include "stats.hh"
+
+static StatCounter KeptCount("kept segments");
+
+namespace
+{
+    std::string PlacementFile;
+
+    struct Previous
+    {
+        unsigned addr, size;
+        unsigned long long fingerprint;
+    };
+    /* (segment, object name) => previous placements, in file order */
+    std::map<std::pair<std::string, std::string>, std::vector<Previous> > previous;
+
+    /* objno => fingerprint, per segment; taken before relocation changes them */
+    std::map<SegmentSelection, std::vector<unsigned long long> > fingerprints;
+
+    const SegmentSelection segs[4] = { CODE, DATA, ZERO, BSS };
+}
+
+void SetPlacementFile(const char* filename)
+{
+    PlacementFile = filename;
+}
+
+void LoadPlacement(const O65linker& linker)
+{
+    if(PlacementFile.empty()) return;
+
+    for(SegmentSelection seg: segs)
+    {
+        const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+        std::vector<unsigned long long>& f = fingerprints[seg];
+        f.resize(sizes.size());
+        for(unsigned a=0; a<sizes.size(); ++a)
+            if(sizes[a]) f[a] = linker.GetFingerprint(a, seg);
+    }
+
+    std::FILE* fp = std::fopen(PlacementFile.c_str(), "rt");
+    if(!fp) return; // First link
+
+    char Buf[4096];
+    while(std::fgets(Buf, sizeof Buf, fp))
+    {
+        if(Buf[0] == '#') continue;
+        Buf[std::strcspn(Buf, "\r\n")] = '\0';
+
+        char segname[16];
+        Previous p;
+        int namepos = 0;
+        if(std::sscanf(Buf, "%15s %X %u %llx %n",
+                       segname, &p.addr, &p.size, &p.fingerprint, &namepos) < 4
+        || !namepos)
+        {
+            continue;
+        }
+        previous[std::make_pair(std::string(segname), std::string(Buf + namepos))].push_back(p);
+    }
+    std::fclose(fp);
+}
+
+void KeepPlacement(O65linker& linker, freespacemap& space, SegmentSelection seg)
+{
+    if(previous.empty()) return;
+
+    const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+    const std::vector<LinkageWish> linkages = linker.GetLinkageList(seg);
+    const std::vector<unsigned long long>& f = fingerprints[seg];
+
+    /* The same name may occur several times; they are matched in order */
+    std::map<std::string, unsigned> seen;
+
+    unsigned kept = 0, total = 0;
+    for(unsigned a=0; a<sizes.size(); ++a)
+    {
+        if(!sizes[a]) continue;
+        const std::string& name = linker.GetName(a);
+        const unsigned nth = seen[name]++;
+
+        if(linkages[a].type == LinkageWish::LinkHere) continue;
+        ++total;
+
+        /* A group must end up in one page, which can't be
+         * promised if only some of its members are kept.
+         */
+        if(linkages[a].type == LinkageWish::LinkInGroup) continue;
+
+        auto i = previous.find(std::make_pair(GetSegmentName(seg), name));
+        if(i == previous.end() || nth >= i->second.size()) continue;
+
+        const Previous& p = i->second[nth];
+        if(p.size != sizes[a] || p.fingerprint != f[a]) continue;
+
+        /* Keep within the page it was asked for */
+        if(linkages[a].type == LinkageWish::LinkThisPage
+        && p.addr / GetPageSize() != linkages[a].GetPage()) continue;
+
+        if(!space.IsFree(p.addr, p.size)) continue;
+
+        space.Del(p.addr, p.size);
+        linker.SetAddress(a, seg, p.addr);
+        ++kept;
+    }
+    KeptCount.Add(kept);
+    if(total)
+        std::fprintf(stderr, "Kept %u of %u %s segments at their previous addresses\n",
+            kept, total, GetSegmentName(seg).c_str());
+}
+
+void SavePlacement(const O65linker& linker)
+{
+    if(PlacementFile.empty()) return;
+
+    std::FILE* fp = std::fopen(PlacementFile.c_str(), "wt");
+    if(!fp)
+    {
+        std::perror(PlacementFile.c_str());
+        return;
+    }
+    std::fprintf(fp, "# neslink placement: segment address size fingerprint object\n");
+    for(SegmentSelection seg: segs)
+    {
+        const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+        const std::vector<unsigned> addrs = linker.GetAddrList(seg);
+        const std::vector<unsigned long long>& f = fingerprints[seg];
+        for(unsigned a=0; a<sizes.size() && a<f.size(); ++a)
+        {
+            if(!sizes[a]) continue;
+            std::fprintf(fp, "%s %05X %u %016llx %s\n",
+                GetSegmentName(seg).c_str(), addrs[a], sizes[a], f[a],
+                linker.GetName(a).c_str());
+        }
+    }
+    std::fclose(fp);
+}
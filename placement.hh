@@ -0,0 +1,34 @@
+#ifndef bqtPlacementHH
+#define bqtPlacementHH
+
+#include "o65.hh" /* For SegmentSelection */
+
+/* Placement memory of neslink, kept with --placement <file>.
+ *
+ * After linking, the address, size and fingerprint of every placed
+ * segment is written into the file. On the next link, the segments
+ * whose fingerprint hasn't changed are put back at their previous
+ * addresses, provided the space is still free; only the changed and
+ * new segments go through the placement. That way routines don't
+ * move around between builds.
+ */
+
+class O65linker;
+class freespacemap;
+
+void SetPlacementFile(const char* filename);
+
+/* Reads the previous placement and takes the fingerprints of
+ * the objects. Call before anything is placed.
+ */
+void LoadPlacement(const O65linker& linker);
+
+/* Fixes the unchanged segments of the given type at their previous
+ * addresses, taking the space from "space". Call before organizing.
+ */
+void KeepPlacement(O65linker& linker, freespacemap& space, SegmentSelection seg);
+
+/* Writes the placement of this link. Call after placing. */
+void SavePlacement(const O65linker& linker);
+
+#endif
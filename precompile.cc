@@ -11,6 +11,13 @@
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+#include <sys/stat.h>
 
 #if SUPPORT_FORK
 #include <sys/wait.h>
@@ -27,6 +34,13 @@
 
 #include "precompile.hh"
 #include "assemble.hh"
+#include "stats.hh"
+
+namespace
+{
+    /* Not seen in the report when the preprocessor runs in a forked child */
+    StatTimer PrecompileTime("precompile");
+}
 
 /*
   Prior preprocessing:
@@ -190,6 +204,8 @@ namespace
 
 void Precompile(std::FILE *fp, std::FILE *fo)
 {
+    StatScope timing(PrecompileTime);
+
     if(!fp || !fo) return;
 
     switch(GccMethod)
@@ -271,8 +287,8 @@ void Precompile(std::FILE *fp, std::FILE *fo)
             PostProcess(result, fo);    // input: gcc
             std::fclose(result);        //output: outputfile
 
-            wait(NULL); // wait for gcc    to die
-            wait(NULL); // wait for feeder to die
+            waitpid(cpp_pid,  NULL, 0); // wait for gcc    to die
+            waitpid(feed_pid, NULL, 0); // wait for feeder to die
 
             break;
         }
@@ -298,7 +314,7 @@ void Precompile(std::FILE *fp, std::FILE *fo)
                 _exit(-1);
             }
             std::fclose(temp);
-            wait(NULL);
+            waitpid(cpp_pid, NULL, 0);
 #else
             int org_stdin = dup(0);  dup2(fileno(temp), 0);
             int org_stdout = dup(1); dup2(fileno(temp2), 1);
@@ -323,8 +339,302 @@ void Precompile(std::FILE *fp, std::FILE *fo)
     }
 }
 
+namespace
+{
+    /* Preprocessed inputs, keyed by the working directory, the
+     * environment that gcc reads and the source text. gcc marks the
+     * files it included in its output; an entry is only used while
+     * those files are unchanged.
+     */
+    const char* const PrecompileEnvironment[] =
+    {
+        "PATH", "CPATH", "C_INCLUDE_PATH", "GCC_EXEC_PREFIX", "COMPILER_PATH",
+        "SOURCE_DATE_EPOCH", "LANG", "LC_ALL", "LC_CTYPE", "LC_MESSAGES"
+    };
+    struct FileStamp
+    {
+        long long mtime, mtime_ns, size;
+
+        bool operator==(const FileStamp& b) const
+            { return mtime==b.mtime && mtime_ns==b.mtime_ns && size==b.size; }
+    };
+    struct PrecompileCacheEntry
+    {
+        std::string text;
+        std::vector<std::pair<std::string, FileStamp> > deps;
+    };
+    std::map<std::string, PrecompileCacheEntry> PrecompileCache;
+    std::mutex PrecompileCacheLock; // Inputs may be preprocessed in parallel
+    int PrecompileCacheFd = -1; // -1 = cache not in use
+
+    FileStamp GetFileStamp(const std::string& filename)
+    {
+        FileStamp result = {-1,0,0};
+        struct stat st;
+        if(stat(filename.c_str(), &st) == 0)
+        {
+            result.mtime    = st.st_mtime;
+#ifdef __APPLE__
+            result.mtime_ns = st.st_mtimespec.tv_nsec;
+#elif !defined(WIN32)
+            result.mtime_ns = st.st_mtim.tv_nsec;
+#endif
+            result.size     = st.st_size;
+        }
+        return result;
+    }
+
+    /* Finds the files named in the line markers (# 12 "file.inc" 1) */
+    void FindIncludedFiles(const std::string& text,
+                           std::vector<std::pair<std::string, FileStamp> >& deps)
+    {
+        std::map<std::string, bool> seen;
+        for(std::string::size_type pos = 0; pos < text.size(); )
+        {
+            std::string::size_type end = text.find('\n', pos);
+            if(end == text.npos) end = text.size();
+
+            if(text.compare(pos, 2, "# ") == 0)
+            {
+                std::string::size_type q1 = text.find('"', pos);
+                if(q1 < end)
+                {
+                    std::string::size_type q2 = text.find('"', q1+1);
+                    if(q2 < end && text[q1+1] != '<')
+                    {
+                        std::string name = text.substr(q1+1, q2-q1-1);
+                        if(!seen[name])
+                        {
+                            seen[name] = true;
+                            deps.emplace_back(name, GetFileStamp(name));
+                        }
+                    }
+                }
+            }
+            pos = end+1;
+        }
+    }
+
+    void PutString(std::string& out, const std::string& s)
+    {
+        unsigned length = s.size();
+        out.append((const char*)&length, sizeof length);
+        out += s;
+    }
+    bool GetString(const std::string& in, std::string::size_type& pos, std::string& s)
+    {
+        unsigned length;
+        if(in.size() - pos < sizeof length) return false;
+        std::memcpy(&length, in.data()+pos, sizeof length);
+        pos += sizeof length;
+        if(in.size() - pos < length) return false;
+        s.assign(in, pos, length);
+        pos += length;
+        return true;
+    }
+
+    void ReportCacheEntry(const std::string& key, const PrecompileCacheEntry& entry)
+    {
+        std::string out;
+        PutString(out, key);
+        PutString(out, entry.text);
+        unsigned ndeps = entry.deps.size();
+        out.append((const char*)&ndeps, sizeof ndeps);
+        for(const auto& d: entry.deps)
+        {
+            PutString(out, d.first);
+            out.append((const char*)&d.second, sizeof d.second);
+        }
+
+        for(std::string::size_type pos = 0; pos < out.size(); )
+        {
+            int n = write(PrecompileCacheFd, out.data()+pos, out.size()-pos);
+            if(n <= 0) break;
+            pos += n;
+        }
+    }
+
+    const std::string UncachedPrecompile(std::FILE *fp)
+    {
+        std::string result;
+
+        std::FILE *temp = std::tmpfile();
+        if(!temp)
+        {
+            std::perror("Error: Unable to create a temp file");
+            return result;
+        }
+
+        Precompile(fp, temp);
+
+        rewind(temp);
+        char Buf[8192];
+        for(std::size_t n; (n = std::fread(Buf, 1, sizeof Buf, temp)) > 0; )
+            result.append(Buf, n);
+        std::fclose(temp);
+
+        return result;
+    }
+
+    const std::string CachedPrecompile(std::FILE *fp)
+    {
+        std::string source;
+        char Buf[8192];
+        for(std::size_t n; (n = std::fread(Buf, 1, sizeof Buf, fp)) > 0; )
+            source.append(Buf, n);
+
+        char* cwd = getcwd(NULL, 0);
+        std::string key = cwd ? cwd : "";
+        std::free(cwd);
+        key += '\0';
+        for(const char* name: PrecompileEnvironment)
+        {
+            const char* value = std::getenv(name);
+            key += value ? value : "";
+            key += '\0';
+        }
+        key += source;
+
+        {
+            std::lock_guard<std::mutex> lock(PrecompileCacheLock);
+            auto i = PrecompileCache.find(key);
+            if(i != PrecompileCache.end())
+            {
+                bool valid = true;
+                for(const auto& d: i->second.deps)
+                    if(!(GetFileStamp(d.first) == d.second)) { valid = false; break; }
+                if(valid) return i->second.text;
+            }
+        }
+
+        std::FILE *temp = std::tmpfile();
+        if(!temp)
+        {
+            std::perror("Error: Unable to create a temp file");
+            return std::string();
+        }
+        std::fwrite(source.data(), 1, source.size(), temp);
+        std::rewind(temp);
+
+        PrecompileCacheEntry entry;
+        entry.text = UncachedPrecompile(temp);
+        std::fclose(temp);
+
+        FindIncludedFiles(entry.text, entry.deps);
+
+        std::lock_guard<std::mutex> lock(PrecompileCacheLock);
+        ReportCacheEntry(key, entry);
+        PrecompileCacheEntry& stored = PrecompileCache[key];
+        stored = std::move(entry);
+        return stored.text;
+    }
+}
+
+void UsePrecompileCache(int report_fd)
+{
+    PrecompileCacheFd = report_fd;
+}
+
+void AbsorbPrecompileCache(const std::string& reports)
+{
+    std::string::size_type pos = 0;
+    for(;;)
+    {
+        std::string key;
+        PrecompileCacheEntry entry;
+        unsigned ndeps;
+
+        if(!GetString(reports, pos, key)
+        || !GetString(reports, pos, entry.text)
+        || reports.size() - pos < sizeof ndeps) break;
+        std::memcpy(&ndeps, reports.data()+pos, sizeof ndeps);
+        pos += sizeof ndeps;
+
+        bool ok = true;
+        for(unsigned a=0; a<ndeps && ok; ++a)
+        {
+            std::string name;
+            FileStamp stamp;
+            ok = GetString(reports, pos, name) && reports.size() - pos >= sizeof stamp;
+            if(!ok) break;
+            std::memcpy(&stamp, reports.data()+pos, sizeof stamp);
+            pos += sizeof stamp;
+            entry.deps.emplace_back(name, stamp);
+        }
+        if(!ok) break;
+
+        PrecompileCache[key] = std::move(entry);
+    }
+}
+
+const std::string PrecompileToMemory(std::FILE *fp)
+{
+    if(PrecompileCacheFd >= 0)
+        return CachedPrecompile(fp);
+    return UncachedPrecompile(fp);
+}
+
+const std::vector<std::string> PrecompileFilesToMemory
+    (const std::vector<std::string>& files, unsigned jobs)
+{
+    std::vector<std::string> result(files.size());
+    std::vector<char> opened(files.size());
+
+    if(jobs > 1)
+    {
+        /* Concurrent preprocessors must not inherit each
+         * other's pipes, or none of them would see the end
+         * of its input. Temp files don't have that problem.
+         */
+        GccMethod = TempFile;
+    }
+
+    std::atomic<unsigned> next(0);
+    auto worker = [&]()
+    {
+        for(unsigned a; (a = next++) < files.size(); )
+        {
+            std::FILE *fp = NULL;
+
+            const std::string& filename = files[a];
+            if(filename != "-" && !filename.empty())
+            {
+                fp = std::fopen(filename.c_str(), "rt");
+                if(!fp)
+                {
+                    std::perror(filename.c_str());
+                    continue;
+                }
+            }
+            result[a] = PrecompileToMemory(fp ? fp : stdin);
+            opened[a] = true;
+            if(fp)
+                std::fclose(fp);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned a=1; a<jobs && a<files.size(); ++a)
+        threads.emplace_back(worker);
+    worker();
+    for(auto& t: threads) t.join();
+
+    /* Inputs that couldn't be opened are skipped, as in the serial case */
+    std::vector<std::string> texts;
+    for(unsigned a=0; a<files.size(); ++a)
+        if(opened[a])
+            texts.push_back(std::move(result[a]));
+    return texts;
+}
+
 void PrecompileAndAssemble(std::FILE *fp, Object& obj)
 {
+    if(PrecompileCacheFd >= 0)
+    {
+        AssemblePrecompiled(CachedPrecompile(fp), obj);
+        return;
+    }
+
     switch(AsmMethod)
     {
 #if SUPPORT_THREADS
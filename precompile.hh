@@ -1,10 +1,26 @@
 #include <cstdio>
+#include <string>
+#include <vector>
 
 #include "object.hh"
 
 void Precompile(std::FILE *fp, std::FILE *fo);
 void PrecompileAndAssemble(std::FILE *fp, Object& obj);
 
+// Preprocesses into memory, so that the result can be assembled many times
+const std::string PrecompileToMemory(std::FILE *fp);
+
+// Preprocesses the named files ("-" is stdin) into memory, using up to
+// <jobs> threads. The results are in the order of the names; files
+// that could not be opened are reported and left out.
+const std::vector<std::string> PrecompileFilesToMemory
+    (const std::vector<std::string>& files, unsigned jobs);
+
+// Daemon mode: reuse preprocessed inputs that were seen before.
+// New results are reported into report_fd, for the daemon to absorb.
+void UsePrecompileCache(int report_fd);
+void AbsorbPrecompileCache(const std::string& reports);
+
 void UseTemps();
 void UseThreads();
 void UseFork();
@@ -226,6 +226,23 @@ to a symbol from those modules.
 <p>
 <em>This is not completely ready for NES yet.</em>
 
+", 'cycles:1.1. Cycle budgets' => "
+
+nescom counts the 6502 cycles of each scope (<code>.(</code> ... <code>.)</code>),
+as if its code was executed straight through once: the best case
+without page crossings and with no branches taken, and the worst case
+with them all. A page is known not to be crossed only when an
+absolute indexed address is a constant at the start of a page.
+<code>jsr</code> to a label that begins an earlier scope adds the cycles
+of that scope.
+ <p>
+<code>.cycles 2000</code> declares that the scope must not take more
+than 2000 cycles. If the worst case is more, or can't be known because
+of a loop, a jump out of the scope, <code>brk</code>, an indirect
+<code>jmp</code> or a <code>jsr</code> elsewhere, the assembly fails.
+ <p>
+<code>--cycles</code> lists the cycles of every scope.
+
 ", 'changelog:1. Changelog' => "
 
 Nov 20 2005; 0.0.0 import from snescom-1.5.0.1.<br>
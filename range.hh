@@ -2,6 +2,9 @@
 #define bqt_RangeHH
 
 #include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
 
 template<typename Key>
 struct rangetype
@@ -39,12 +42,93 @@ struct rangetype
 };
 
 
-template<typename Key, typename Valueholder, typename Allocator = std::allocator<Key> >
-class rangecollection
+/***************
+ *
+ * A sorted vector that looks like a std::map to rangecollection.
+ * When the key domain is small (such as a ROM page), a collection
+ * has only a handful of changepoints, and keeping them contiguous
+ * is much cheaper to search, copy and iterate than a tree.
+ */
+template<typename Key, typename Value>
+class sortedvectormap
+{
+public:
+    typedef std::pair<Key, Value> value_type;
+private:
+    typedef std::vector<value_type> Vec;
+    Vec data;
+
+    struct KeyLess
+    {
+        bool operator() (const value_type& a, const Key& b) const { return a.first < b; }
+        bool operator() (const Key& a, const value_type& b) const { return a < b.first; }
+    };
+public:
+    typedef typename Vec::iterator               iterator;
+    typedef typename Vec::const_iterator         const_iterator;
+    typedef typename Vec::const_reverse_iterator const_reverse_iterator;
+    typedef typename Vec::size_type              size_type;
+
+    sortedvectormap(): data() {}
+
+    iterator begin() { return data.begin(); }
+    iterator end()   { return data.end(); }
+    const_iterator begin() const { return data.begin(); }
+    const_iterator end() const   { return data.end(); }
+    const_reverse_iterator rbegin() const { return data.rbegin(); }
+
+    iterator lower_bound(const Key& k)
+        { return std::lower_bound(data.begin(), data.end(), k, KeyLess()); }
+    iterator upper_bound(const Key& k)
+        { return std::upper_bound(data.begin(), data.end(), k, KeyLess()); }
+    const_iterator lower_bound(const Key& k) const
+        { return std::lower_bound(data.begin(), data.end(), k, KeyLess()); }
+    const_iterator upper_bound(const Key& k) const
+        { return std::upper_bound(data.begin(), data.end(), k, KeyLess()); }
+
+    /* The hint is ignored; the position is always searched. */
+    template<typename K, typename V>
+    iterator insert(const_iterator, const std::pair<K,V>& v)
+    {
+        iterator i = lower_bound(v.first);
+        if(i != data.end() && i->first == v.first) return i;
+        return data.insert(i, value_type(v.first, v.second));
+    }
+    iterator erase(iterator i) { return data.erase(i); }
+
+    size_type size() const { return data.size(); }
+    bool empty() const { return data.empty(); }
+    void clear() { data.clear(); }
+
+    bool operator==(const sortedvectormap& b) const { return data == b.data; }
+};
+
+/* Tag for selecting the sorted vector container for a rangecollection.
+ * Example: rangeset<unsigned, flat_allocator<unsigned> >
+ */
+template<typename T>
+struct flat_allocator: public std::allocator<T>
+{
+    template<typename U> struct rebind { typedef flat_allocator<U> other; };
+};
+
+template<typename Key, typename Valueholder, typename Allocator>
+struct rangecontainer
 {
     typedef std::map<Key, Valueholder, std::less<Key>,
         typename Allocator::template rebind<std::pair<const Key, Valueholder> >::other
-                    > Cont;
+                    > type;
+};
+template<typename Key, typename Valueholder, typename T>
+struct rangecontainer<Key, Valueholder, flat_allocator<T> >
+{
+    typedef sortedvectormap<Key, Valueholder> type;
+};
+
+template<typename Key, typename Valueholder, typename Allocator = std::allocator<Key> >
+class rangecollection
+{
+    typedef typename rangecontainer<Key, Valueholder, Allocator>::type Cont;
     Cont data;
 public:
     rangecollection(): data() {}
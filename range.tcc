@@ -36,12 +36,10 @@ size_t rangecollection<Key,Valueholder,Allocator>::erase(const Key& lo, const Ke
     /*
      -  Erase all elements that are left inside our range
     */
-    for(typename Cont::iterator j,i = data.lower_bound(lo);
-        i != data.end() && i->first < up;
-        i=j)
+    for(typename Cont::iterator i = data.lower_bound(lo);
+        i != data.end() && i->first < up; )
     {
-        j=i; ++j;
-        data.erase(i);
+        i = data.erase(i);
         ++n_removed;
     }
 
@@ -73,8 +71,9 @@ size_t rangecollection<Key,Valueholder,Allocator>::erase_before(const Key& lo)
 {
     if(!empty())
     {
-        const_iterator b = begin();
-        if(b->first < lo) return erase(b->first, lo);
+        /* Copy the key: erase() may remove the node it lives in */
+        const Key first = begin()->first;
+        if(first < lo) return erase(first, lo);
     }
     return 0;
 }
@@ -84,8 +83,8 @@ size_t rangecollection<Key,Valueholder,Allocator>::erase_after(const Key& hi)
 {
     if(!empty())
     {
-        typename Cont::const_reverse_iterator b = data.rbegin();
-        if(b->first > hi) return erase(hi, b->first);
+        const Key last = data.rbegin()->first;
+        if(last > hi) return erase(hi, last);
     }
     return 0;
 }
@@ -129,12 +128,10 @@ void rangecollection<Key,Valueholder,Allocator>::set(const Key& lo, const Key& u
     /*
      -  Erase all elements that are left inside our range
     */
-    for(typename Cont::iterator j,i = data.lower_bound(lo);
-        i != data.end() && i->first < up;
-        i=j)
+    for(typename Cont::iterator i = data.lower_bound(lo);
+        i != data.end() && i->first < up; )
     {
-        j=i; ++j;
-        data.erase(i);
+        i = data.erase(i);
     }
 
     /*
@@ -36,7 +36,7 @@ typename rangeset<Key,Allocator>::const_iterator& rangeset<Key,Allocator>::const
     while(i != data.end())
     {
         ++i;
-        if(!i->second.is_nil())break;
+        if(i != data.end() && !i->second.is_nil())break;
     }
     Reconstruct();
     return *this;
@@ -1,71 +1,149 @@
 #include "romaddr.hh"
-#include <stdio.h>
+#include <cstdlib>
+#include <array>
+#include <utility>
 
 unsigned ROMmap_npages = 8;
 
-unsigned long MakeNESaddr(unsigned char bank, unsigned offs)
+namespace
 {
-    if(bank >= ROMmap_npages-1)
+    struct FixedBank
     {
-        return offs | 0xC000;
+        unsigned fromend; // 1 = the last bank
+        unsigned address; // where the CPU sees it
+    };
+    struct MapperInfo
+    {
+        const char* name;
+        unsigned number;   // iNES
+        unsigned banksize; // a power of two
+        unsigned window;   // where the CPU sees the switchable banks
+        unsigned nfixed;
+        FixedBank fixed[2];
+    };
+
+    constexpr MapperInfo Mappers[] =
+    {
+        /* 16k at $8000, last 16k fixed at $C000 */
+        { "unrom", 2, 0x4000, 0x8000, 1, { {1,0xC000}, {0,0} } },
+        /* No banking: 16k or 32k at $8000-$FFFF */
+        { "nrom",  0, 0x4000, 0x8000, 2, { {1,0xC000}, {2,0x8000} } },
+        /* As it powers up: like UNROM */
+        { "mmc1",  1, 0x4000, 0x8000, 1, { {1,0xC000}, {0,0} } },
+        /* 8k at $8000 (or $A000), last two 8k fixed at $C000 and $E000 */
+        { "mmc3",  4, 0x2000, 0x8000, 2, { {1,0xE000}, {2,0xC000} } },
+        /* 32k at $8000, nothing fixed */
+        { "axrom", 7, 0x8000, 0x8000, 0, { {0,0}, {0,0} } }
+    };
+    constexpr std::size_t MapperCount = sizeof(Mappers) / sizeof(*Mappers);
+
+    unsigned CurrentMapper = 0;
+
+    /* The translations are instantiated for each mapper,
+     * so that the bank sizes and windows are constants.
+     */
+    template<std::size_t M>
+    unsigned long ToNES(unsigned long addr)
+    {
+        constexpr const MapperInfo& m = Mappers[M];
+        const unsigned long bank = addr / m.banksize;
+        const unsigned      offs = addr % m.banksize;
+        for(unsigned f=0; f<m.nfixed; ++f)
+            if(bank + m.fixed[f].fromend == ROMmap_npages
+            || (m.fixed[f].fromend == 1 && bank >= ROMmap_npages))
+                return m.fixed[f].address | offs;
+        return (bank << 16) | m.window | offs;
+    }
+
+    template<std::size_t M>
+    unsigned long ToROM(unsigned long addr)
+    {
+        constexpr const MapperInfo& m = Mappers[M];
+        const unsigned long bank = (addr >> 16) & 0xFFFF;
+        const unsigned      cpu  = addr & 0xFFFF;
+        if(!bank)
+        {
+            if(cpu < 0x8000) return addr; // Not in the ROM
+            for(unsigned f=0; f<m.nfixed; ++f)
+                if(cpu >= m.fixed[f].address && cpu < m.fixed[f].address + m.banksize
+                && ROMmap_npages >= m.fixed[f].fromend)
+                    return (ROMmap_npages - m.fixed[f].fromend) * m.banksize
+                         + (cpu - m.fixed[f].address);
+        }
+        return bank * m.banksize + (cpu & (m.banksize-1));
     }
-    return (bank << 16) | offs | 0x8000;
+
+    typedef unsigned long (*Translator)(unsigned long);
+    struct Translators
+    {
+        Translator toNES, toROM;
+    };
+    template<std::size_t... M>
+    constexpr std::array<Translators, sizeof...(M)> MakeTranslators(std::index_sequence<M...>)
+    {
+        return {{ Translators{ ToNES<M>, ToROM<M> }... }};
+    }
+    constexpr std::array<Translators, MapperCount> Translate
+        = MakeTranslators(std::make_index_sequence<MapperCount>());
 }
 
-void SplitNESaddr(unsigned addr, unsigned char& bank, unsigned& offs)
+bool SelectMapper(const std::string& name)
 {
-    unsigned ROMaddr = NES2ROMaddr(addr);
-    bank = ROMaddr >> 14;
-    offs = ROMaddr & 0x3FFF;
+    char* end;
+    const unsigned long number = std::strtoul(name.c_str(), &end, 10);
+    const bool numeric = !name.empty() && !*end;
+    for(unsigned a=0; a<MapperCount; ++a)
+        if(numeric ? Mappers[a].number == number : name == Mappers[a].name)
+        {
+            CurrentMapper = a;
+            return true;
+        }
+    return false;
 }
 
-static unsigned long ROM2NESaddr_(unsigned long addr)
+unsigned GetMapperNumber()
 {
-    unsigned bank = addr >> 14;
-    unsigned offs = addr & 0x3FFF;
-    return MakeNESaddr(bank, offs);
+    return Mappers[CurrentMapper].number;
 }
 
-static unsigned long NES2ROMaddr_(unsigned long addr)
+const std::string GetMapperNames()
 {
-    switch(addr / 0x4000)
+    std::string result;
+    for(unsigned a=0; a<MapperCount; ++a)
     {
-        case 0: case 1: break; // 0..7
-        case 3: // C..F
-        {
-            // C000..FFFF is translated into LastPage*0x4000 + 0x3FFF
+        if(a) result += ",";
+        result += Mappers[a].name;
+    }
+    return result;
+}
 
-            unsigned bank = ROMmap_npages-1;
-            unsigned offs = addr & 0x3FFF;
-            return bank * 0x4000 + offs;
-        }
-        case 2:  // 8..B
-        default: // 10...
-            // 8000..BFFF, 18000..1BFFF, 28000..2BFFF and so on
-            // are translated into 0000-3FFF, 4000-7FFF, 8000-BFFF respectively
+unsigned long MakeNESaddr(unsigned bank, unsigned offs)
+{
+    return ROM2NESaddr((unsigned long)bank * GetPageSize() + (offs & (GetPageSize()-1)));
+}
 
-            unsigned bank = addr >> 16;
-            unsigned offs = addr & 0x3FFF;
-            return bank * 0x4000 + offs;
-    }
-    return addr;
+void SplitNESaddr(unsigned addr, unsigned& bank, unsigned& offs)
+{
+    unsigned ROMaddr = NES2ROMaddr(addr);
+    bank = ROMaddr / GetPageSize();
+    offs = ROMaddr % GetPageSize();
 }
 
 unsigned long ROM2NESaddr(unsigned long addr)
 {
-    unsigned long ret = ROM2NESaddr_(addr);
+    unsigned long ret = Translate[CurrentMapper].toNES(addr);
     //fprintf(stderr, "ROM %X -> NES %X\n", addr, ret);
     return ret;
 }
 
 unsigned long NES2ROMaddr(unsigned long addr)
 {
-    unsigned long ret = NES2ROMaddr_(addr);
+    unsigned long ret = Translate[CurrentMapper].toROM(addr);
     //fprintf(stderr, "NES %X -> ROM %X\n", addr, ret);
     return ret;
 }
 
 unsigned GetPageSize()
 {
-    return 0x4000;
+    return Mappers[CurrentMapper].banksize;
 }
@@ -1,14 +1,31 @@
 #ifndef bqtRomAddrHH
 #define bqtRomAddrHH
 
+#include <string>
+
+/* Number of PRG-ROM banks, each GetPageSize() bytes */
 extern unsigned ROMmap_npages;
 
+/* NES addresses are CPU addresses; a switchable bank is told
+ * apart by its bank number in the bits above 16. Bank numbers
+ * are 16-bit, so a NES address takes up to 32 bits.
+ */
 unsigned long ROM2NESaddr(unsigned long addr);
 unsigned long NES2ROMaddr(unsigned long addr);
 
-unsigned long MakeNESaddr(unsigned char bank, unsigned addr);
-void SplitNESaddr(unsigned addr, unsigned char& bank, unsigned& offs);
+unsigned long MakeNESaddr(unsigned bank, unsigned addr);
+void SplitNESaddr(unsigned addr, unsigned& bank, unsigned& offs);
+
+/* Selects how the mapper shows the PRG-ROM to the CPU, by name
+ * or by iNES mapper number. Returns false if it isn't known.
+ * The default is UNROM (mapper 2).
+ */
+bool SelectMapper(const std::string& name);
+unsigned GetMapperNumber();
+/* The names of the known mappers, for help texts */
+const std::string GetMapperNames();
 
+/* The bank size of the selected mapper */
 unsigned GetPageSize()
 #ifdef __GNUC__
  __attribute__((pure))
@@ -0,0 +1,309 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "server.hh"
+#include "stats.hh"
+
+#ifndef WIN32
+
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "precompile.hh"
+
+/*
+  Request, client to daemon, sent with the client's
+  stdin, stdout and stderr attached as SCM_RIGHTS:
+     unsigned length of the rest
+     unsigned argc
+     working directory '\0'
+     argv[0] '\0' ... argv[argc-1] '\0'
+     the environment: "name=value" '\0' ... until the end
+  Reply, daemon to client:
+     int exit code
+*/
+
+namespace
+{
+    bool ReadAll(int fd, void* buf, std::size_t length)
+    {
+        char* p = (char*)buf;
+        while(length > 0)
+        {
+            ssize_t n = read(fd, p, length);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return false;
+            p += n; length -= n;
+        }
+        return true;
+    }
+    bool WriteAll(int fd, const void* buf, std::size_t length)
+    {
+        const char* p = (const char*)buf;
+        while(length > 0)
+        {
+            ssize_t n = write(fd, p, length);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return false;
+            p += n; length -= n;
+        }
+        return true;
+    }
+
+    bool MakeAddress(const char* socketpath, sockaddr_un& addr)
+    {
+        std::memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if(std::strlen(socketpath) >= sizeof addr.sun_path)
+        {
+            std::fprintf(stderr, "Error: Socket path `%s' is too long\n", socketpath);
+            return false;
+        }
+        std::strcpy(addr.sun_path, socketpath);
+        return true;
+    }
+
+    /* Runs in the forked child: receives one request and executes it */
+    int ServeRequest(int conn, ServerEntry entry)
+    {
+        unsigned length = 0;
+        int fds[3] = {-1,-1,-1};
+
+        char control[CMSG_SPACE(sizeof fds)];
+        iovec iov = { &length, sizeof length };
+        msghdr msg;
+        std::memset(&msg, 0, sizeof msg);
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof control;
+
+        if(recvmsg(conn, &msg, 0) != (ssize_t)sizeof length) return -1;
+        for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+            if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS
+            && c->cmsg_len == CMSG_LEN(sizeof fds))
+                std::memcpy(fds, CMSG_DATA(c), sizeof fds);
+        if(fds[0] < 0) return -1;
+
+        std::string request(length, '\0');
+        if(!ReadAll(conn, &request[0], length)) return -1;
+
+        unsigned argc;
+        if(length < sizeof argc) return -1;
+        std::memcpy(&argc, request.data(), sizeof argc);
+
+        std::vector<char*> argv;
+        const char* cwd = request.data() + sizeof argc;
+        std::string::size_type pos = sizeof argc + std::strlen(cwd) + 1;
+        for(; pos < request.size() && argv.size() < argc;
+            pos += std::strlen(&request[pos]) + 1)
+        {
+            argv.push_back(&request[pos]);
+        }
+        if(argv.size() != argc) return -1;
+        argv.push_back(nullptr);
+
+        /* The client's environment replaces the daemon's, so that
+         * NESCOM_CACHE, and the PATH and CPATH for gcc, are the same
+         * as in a local run. The strings live in "request" until exit.
+         */
+        clearenv();
+        for(; pos < request.size(); pos += std::strlen(&request[pos]) + 1)
+            putenv(&request[pos]);
+
+        for(int a=0; a<3; ++a) { dup2(fds[a], a); close(fds[a]); }
+
+        if(chdir(cwd) < 0)
+        {
+            std::perror(cwd);
+            return -1;
+        }
+
+        // Not the daemon's uptime, nor what it counted before forking
+        ResetStats();
+
+        return entry(argc, &argv[0]);
+    }
+}
+
+int RunServer(const char* socketpath, ServerEntry entry)
+{
+    sockaddr_un addr;
+    if(!MakeAddress(socketpath, addr)) return -1;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) { std::perror("socket"); return -1; }
+
+    /* Remove a stale socket, but nothing else */
+    struct stat st;
+    if(lstat(socketpath, &st) == 0)
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            std::fprintf(stderr, "Error: %s exists and is not a socket\n", socketpath);
+            close(listener);
+            return -1;
+        }
+        unlink(socketpath);
+    }
+    if(bind(listener, (sockaddr*)&addr, sizeof addr) < 0
+    || listen(listener, 64) < 0)
+    {
+        std::perror(socketpath);
+        close(listener);
+        return -1;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::fprintf(stderr, "nescom: serving on %s\n", socketpath);
+    std::fflush(stderr);
+
+    /* Each child reports what it preprocessed through a pipe */
+    std::map<int, std::string> reports;
+
+    for(;;)
+    {
+        while(waitpid(-1, NULL, WNOHANG) > 0) { }
+
+        std::vector<pollfd> polls;
+        polls.push_back(pollfd{listener, POLLIN, 0});
+        for(const auto& r: reports) polls.push_back(pollfd{r.first, POLLIN, 0});
+
+        if(poll(&polls[0], polls.size(), 1000) < 0)
+        {
+            if(errno == EINTR) continue;
+            std::perror("poll");
+            return -1;
+        }
+
+        for(std::size_t a=1; a<polls.size(); ++a)
+        {
+            if(!polls[a].revents) continue;
+            const int fd = polls[a].fd;
+            char Buf[65536];
+            ssize_t n = read(fd, Buf, sizeof Buf);
+            if(n > 0) { reports[fd].append(Buf, n); continue; }
+            if(n < 0 && errno == EINTR) continue;
+
+            AbsorbPrecompileCache(reports[fd]);
+            reports.erase(fd);
+            close(fd);
+        }
+
+        if(!(polls[0].revents & POLLIN)) continue;
+
+        int conn = accept(listener, NULL, NULL);
+        if(conn < 0) continue;
+
+        int report[2];
+        if(pipe(report) < 0) { close(conn); continue; }
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(listener);
+            close(report[0]);
+            for(const auto& r: reports) close(r.first);
+            std::signal(SIGPIPE, SIG_DFL);
+
+            UsePrecompileCache(report[1]);
+
+            int code = ServeRequest(conn, entry);
+            std::fflush(stdout);
+            std::fflush(stderr);
+            WriteAll(conn, &code, sizeof code);
+            _exit(code);
+        }
+        close(conn);
+        close(report[1]);
+        if(pid < 0)
+        {
+            std::perror("fork");
+            close(report[0]);
+            continue;
+        }
+        reports[report[0]];
+    }
+}
+
+bool RunClient(const char* socketpath, int argc, char** argv, int& exitcode)
+{
+    sockaddr_un addr;
+    if(!MakeAddress(socketpath, addr)) return false;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0) return false;
+    if(connect(sock, (sockaddr*)&addr, sizeof addr) < 0)
+    {
+        close(sock);
+        return false;
+    }
+
+    std::string request;
+    unsigned count = argc;
+    request.append((const char*)&count, sizeof count);
+    char* cwd = getcwd(NULL, 0);
+    request += cwd ? cwd : ".";
+    request += '\0';
+    std::free(cwd);
+    for(int a=0; a<argc; ++a) { request += argv[a]; request += '\0'; }
+    for(char** e = environ; *e; ++e) { request += *e; request += '\0'; }
+
+    unsigned length = request.size();
+    int fds[3] = {0, 1, 2};
+
+    char control[CMSG_SPACE(sizeof fds)];
+    std::memset(control, 0, sizeof control);
+    iovec iov = { &length, sizeof length };
+    msghdr msg;
+    std::memset(&msg, 0, sizeof msg);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof control;
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof fds);
+    std::memcpy(CMSG_DATA(c), fds, sizeof fds);
+
+    if(sendmsg(sock, &msg, 0) != (ssize_t)sizeof length
+    || !WriteAll(sock, request.data(), request.size()))
+    {
+        close(sock);
+        return false;
+    }
+
+    if(!ReadAll(sock, &exitcode, sizeof exitcode))
+    {
+        std::fprintf(stderr, "Error: The nescom server at %s did not finish the job\n", socketpath);
+        exitcode = 1;
+    }
+    close(sock);
+    return true;
+}
+
+#else
+
+int RunServer(const char*, ServerEntry)
+{
+    std::fprintf(stderr, "Error: Server mode is not supported on this platform\n");
+    return -1;
+}
+
+bool RunClient(const char*, int, char**, int&)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef bqtServerHH
+#define bqtServerHH
+
+/* Daemon mode for nescom.
+ *
+ * "nescom --server <socket>" stays running and listens on a Unix socket.
+ * When NESCOM_SERVER names that socket, nescom hands its command line,
+ * working directory and standard streams over to the daemon, which
+ * assembles in a forked child and reports back the exit code.
+ * Preprocessed inputs are cached in the daemon between requests.
+ */
+
+typedef int (*ServerEntry)(int argc, char** argv);
+
+/* Runs the daemon. Returns only on failure. */
+int RunServer(const char* socketpath, ServerEntry entry);
+
+/* Forwards the command line to a running daemon.
+ * Returns false if there is no daemon to talk to.
+ */
+bool RunClient(const char* socketpath, int argc, char** argv, int& exitcode);
+
+#endif
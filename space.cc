@@ -1,11 +1,17 @@
 #include <cstdio>
+#include <algorithm>
 
 #include "space.hh"
 #include "logfiles.hh"
-#include "binpacker.hh"
 #include "romaddr.hh"
 
-freespacemap::freespacemap() : quiet(false)
+freespacemap::freespacemap()
+    : quiet(false), pagesize(GetPageSize()), packmethod(BinPackGreedy), packbudget(1000)
+{
+}
+
+freespacemap::freespacemap(unsigned page_size)
+    : quiet(false), pagesize(page_size), packmethod(BinPackGreedy), packbudget(1000)
 {
 }
 
@@ -60,7 +66,7 @@ unsigned freespacemap::Find(unsigned page, unsigned length)
             //break;
         }
     }
-    if(!bestscore)
+    if(bestpos == NOWHERE)
     {
         if(!quiet)
         {
@@ -117,7 +123,7 @@ void freespacemap::VerboseDump() const
             unsigned recpos = reci->lower;
             unsigned reclen = reci->upper - recpos;
 
-            unsigned pos = page * GetPageSize() + recpos;
+            unsigned pos = page * pagesize + recpos;
 
             //MarkFree(pos, reclen, "free");
         }
@@ -176,8 +182,25 @@ unsigned freespacemap::Size(unsigned page) const
 
 unsigned freespacemap::GetFragmentation(unsigned page) const
 {
-    if(auto i = data.find(page); i != data.end()) return i->second.size();
-    return 0;
+    // The set keeps changepoints, so count the ranges instead of its size
+    unsigned hunkcount = 0;
+    if(auto i = data.find(page); i != data.end())
+        for(auto j = i->second.begin(); j != i->second.end(); ++j)
+            ++hunkcount;
+    return hunkcount;
+}
+
+bool freespacemap::IsFree(unsigned page, unsigned begin, unsigned length) const
+{
+    if(auto i = data.find(page); i != data.end())
+        for(auto j = i->second.begin(); j != i->second.end(); ++j)
+            if(j->lower <= begin && begin + length <= j->upper)
+                return true;
+    return false;
+}
+bool freespacemap::IsFree(unsigned longaddr, unsigned length) const
+{
+    return IsFree(longaddr / pagesize, longaddr % pagesize, length);
 }
 
 const std::set<unsigned> freespacemap::GetPageList() const
@@ -194,11 +217,11 @@ const freespaceset &freespacemap::GetList(unsigned pagenum) const
 void freespacemap::Add(unsigned page, unsigned begin, unsigned length)
 {
     //std::fprintf(stderr, "Adding %u bytes of free space at %02X:%04X\n", length, page, begin);
-    if(begin + length > GetPageSize())
+    if(begin + length > pagesize)
     {
         std::fprintf(stderr,
             "freespacemap::Add: Error in Add($%02X,$%X, %u): Page is greater than %u bytes!\n",
-            page,begin,length, GetPageSize());
+            page,begin,length, pagesize);
     }
 
     data[page].set(begin, begin+length);
@@ -206,17 +229,17 @@ void freespacemap::Add(unsigned page, unsigned begin, unsigned length)
 }
 void freespacemap::Add(unsigned longaddr, unsigned length)
 {
-    Add(longaddr / GetPageSize(), longaddr % GetPageSize(), length);
+    Add(longaddr / pagesize, longaddr % pagesize, length);
 }
 
 void freespacemap::Del(unsigned page, unsigned begin, unsigned length)
 {
     //std::fprintf(stderr, "Deleting %u bytes of free space at %02X:%04X\n", length, page, begin);
-    if(begin + length > GetPageSize())
+    if(begin + length > pagesize)
     {
         std::fprintf(stderr,
             "freespacemap::Del: Error in Del($%02X,$%X, %u): Page is greater than %u bytes!\n",
-            page,begin,length, GetPageSize());
+            page,begin,length, pagesize);
     }
 
     unsigned end = begin+length;
@@ -254,7 +277,7 @@ void freespacemap::Del(unsigned page, unsigned begin, unsigned length)
 }
 void freespacemap::Del(unsigned longaddr, unsigned length)
 {
-    Del(longaddr / GetPageSize(), longaddr % GetPageSize(), length);
+    Del(longaddr / pagesize, longaddr % pagesize, length);
 }
 
 void freespacemap::AddAlias(unsigned aliaspage, unsigned aliasbegin, unsigned aliaslength,
@@ -298,61 +321,29 @@ freespaceset freespacemap::CalculateMapOf(unsigned pagenum) const
     return pagemap;
 }
 
-bool freespacemap::Organize(std::vector<freespacerec> &blocks, unsigned pagenum)
+bool freespacemap::PlanOrganize(std::vector<freespacerec> &blocks,
+                                const freespaceset& pagemap,
+                                BinPackingMethod method, unsigned budget_ms) const
 {
-    FILE *log = GetLogFile("mem", "log_addrs");
-
-    freespaceset pagemap = CalculateMapOf(pagenum);
-
-    if(pagemap.empty())
-    {
-        if(!quiet)
-        {
-            std::fprintf(stderr, "ERROR: Page %02X is totally empty.\n", pagenum);
-            if(log)
-            std::fprintf(log, "ERROR: Page %02X is totally empty.\n", pagenum);
-        }
-        return true;
-    }
-
     std::vector<unsigned> items;
     std::vector<unsigned> holes;
     std::vector<unsigned> holeaddrs;
 
     items.reserve(blocks.size());
-
-    unsigned totalsize = 0;
     for(unsigned a=0; a<blocks.size(); ++a)
-    {
-        totalsize += blocks[a].len;
         items.push_back(blocks[a].len);
-    }
 
-    unsigned totalspace = 0;
     holes.reserve(pagemap.size());
     holeaddrs.reserve(pagemap.size());
     for(freespaceset::const_iterator i = pagemap.begin(); i != pagemap.end(); ++i)
     {
         const unsigned recpos = i->lower;
         const unsigned reclen = i->upper - recpos;
-        totalspace += reclen;
         holes.push_back(reclen);
         holeaddrs.push_back(recpos);
     }
 
-    if(totalspace < totalsize)
-    {
-        if(!quiet)
-        {
-            std::fprintf(stderr, "ERROR: Page %02X doesn't have %u bytes of space (only %u there)!\n",
-                pagenum, totalsize, totalspace);
-            if(log)
-            std::fprintf(log, "ERROR: Page %02X doesn't have %u bytes of space (only %u there)!\n",
-                pagenum, totalsize, totalspace);
-        }
-    }
-
-    std::vector<unsigned> organization = PackBins(holes, items);
+    std::vector<unsigned> organization = PackBins(holes, items, method, budget_ms);
 
     bool Errors = false;
     for(unsigned a=0; a<blocks.size(); ++a)
@@ -367,7 +358,6 @@ bool freespacemap::Organize(std::vector<freespacerec> &blocks, unsigned pagenum)
             spaceptr = holeaddrs[holeid];
             holeaddrs[holeid] += itemsize;
             holes[holeid]     -= itemsize;
-            Del(pagenum, spaceptr, itemsize);
         }
         else
         {
@@ -375,6 +365,88 @@ bool freespacemap::Organize(std::vector<freespacerec> &blocks, unsigned pagenum)
         }
         blocks[a].pos = spaceptr;
     }
+    return Errors;
+}
+
+unsigned freespacemap::SizeAfter(unsigned pagenum, const std::vector<freespacerec> &blocks) const
+{
+    /* Replays what Del() would do to this page for each planned
+     * block, but on a private copy of this one page only.
+     */
+    auto i = data.find(pagenum);
+    if(i == data.end()) return 0;
+
+    freespaceset spaceset = i->second;
+    auto a = aliases.find(pagenum);
+    for(const auto& b: blocks)
+    {
+        if(b.pos == NOWHERE) continue;
+        unsigned begin = b.pos, end = b.pos + b.len;
+        spaceset.erase(begin, end);
+        if(a == aliases.end()) continue;
+        for(const auto& j: a->second)
+        {
+            if(j.second.realpage != pagenum) continue;
+            unsigned alias_begin = j.first;
+            unsigned alias_end   = alias_begin + j.second.length;
+            if(alias_begin < end && alias_end > begin)
+            {
+                unsigned delete_begin = std::max(begin, alias_begin) - alias_begin + j.second.realbegin;
+                unsigned delete_end   = std::min(end,   alias_end)   - alias_begin + j.second.realbegin;
+                spaceset.erase(delete_begin, delete_end);
+            }
+        }
+    }
+
+    unsigned total = 0;
+    for(auto j = spaceset.begin(); j != spaceset.end(); ++j)
+        total += j->length();
+    return total;
+}
+
+bool freespacemap::Organize(std::vector<freespacerec> &blocks, unsigned pagenum)
+{
+    FILE *log = GetLogFile("mem", "log_addrs");
+
+    freespaceset pagemap = CalculateMapOf(pagenum);
+
+    if(pagemap.empty())
+    {
+        if(!quiet)
+        {
+            std::fprintf(stderr, "ERROR: Page %02X is totally empty.\n", pagenum);
+            if(log)
+            std::fprintf(log, "ERROR: Page %02X is totally empty.\n", pagenum);
+        }
+        return true;
+    }
+
+    unsigned totalsize = 0;
+    for(unsigned a=0; a<blocks.size(); ++a)
+        totalsize += blocks[a].len;
+
+    unsigned totalspace = 0;
+    for(freespaceset::const_iterator i = pagemap.begin(); i != pagemap.end(); ++i)
+        totalspace += i->length();
+
+    if(totalspace < totalsize)
+    {
+        if(!quiet)
+        {
+            std::fprintf(stderr, "ERROR: Page %02X doesn't have %u bytes of space (only %u there)!\n",
+                pagenum, totalsize, totalspace);
+            if(log)
+            std::fprintf(log, "ERROR: Page %02X doesn't have %u bytes of space (only %u there)!\n",
+                pagenum, totalsize, totalspace);
+        }
+    }
+
+    bool Errors = PlanOrganize(blocks, pagemap, packmethod, packbudget);
+
+    for(unsigned a=0; a<blocks.size(); ++a)
+        if(blocks[a].pos != NOWHERE)
+            Del(pagenum, blocks[a].pos, blocks[a].len);
+
     if(Errors)
         if(!quiet)
         {
@@ -443,7 +515,7 @@ bool freespacemap::OrganizeToAnyPage(std::vector<freespacerec> &blocks)
                 continue;
         }
 
-        std::vector<unsigned> organization = PackBins(holes, items);
+        std::vector<unsigned> organization = PackBins(holes, items, packmethod, packbudget);
 
         Errors = false;
         for(unsigned a=0; a<blocks.size(); ++a)
@@ -455,7 +527,7 @@ bool freespacemap::OrganizeToAnyPage(std::vector<freespacerec> &blocks)
             if(holes[holeid] >= itemsize)
             {
                 unsigned pagenum = holepages[holeid];
-                spaceptr = holeaddrs[holeid] + (pagenum * GetPageSize());
+                spaceptr = holeaddrs[holeid] + (pagenum * pagesize);
                 holeaddrs[holeid] += itemsize;
                 holes[holeid]     -= itemsize;
                 Del(spaceptr, itemsize);
@@ -484,33 +556,61 @@ bool freespacemap::OrganizeToAnySamePage(std::vector<freespacerec> &blocks, unsi
     //   1. Pick a page where they all fit the best
     //   2. Organize there.
 
-    freespacemap saved_this = *this;
-    quiet = true;
+    /* The candidates are only planned, not committed, so nothing
+     * in the map is modified until the best page has been chosen.
+     *
+     * Planning every page with the exact packer would spend its time
+     * limit once per page. So the pages are compared by a quick plan,
+     * and only the chosen one is packed exactly. If the quick plan
+     * fits nowhere, the exact packer tries the pages that may fit,
+     * and they share one time limit.
+     */
+    const BinPackingMethod quick = packmethod == BinPackExact ? BinPackGreedy : packmethod;
 
     unsigned bestpagenum = 0xFF; /* Guess */
     unsigned bestpagesize = 0;
     bool first = true;
     bool candidates = false;
+
+    /* With thousands of pages, most can be ruled out
+     * by their total and largest free space alone.
+     */
+    unsigned totalsize = 0, largest = 0;
+    for(const auto& b: blocks)
+    {
+        totalsize += b.len;
+        largest = std::max(largest, b.len);
+    }
+    auto MayFit = [&](const freespaceset& pagemap)
+    {
+        unsigned total = 0, hole = 0;
+        for(auto j = pagemap.begin(); j != pagemap.end(); ++j)
+        {
+            total += j->length();
+            hole = std::max(hole, j->length());
+        }
+        return total >= totalsize && hole >= largest;
+    };
+
+    std::vector<unsigned> mayfit;
     for(auto i = data.begin(); i != data.end(); ++i)
     {
         unsigned pagenum = i->first;
 
+        const bool aliased = aliases.find(pagenum) != aliases.end();
+        if(!aliased && !MayFit(i->second)) continue;
+
+        freespaceset pagemap = CalculateMapOf(pagenum);
+        if(pagemap.empty()) continue;
+        if(aliased && !MayFit(pagemap)) continue;
+        mayfit.push_back(pagenum);
+
         std::vector<freespacerec> tmpblocks = blocks;
 
-        if(!Organize(tmpblocks, pagenum))
+        if(!PlanOrganize(tmpblocks, pagemap, quick, packbudget))
         {
             // candidate!
-
-            // Can't use previous reference because things have changed
-            // FIXME: Is this really the case?
-            const freespaceset &pagemap = data.find(pagenum)->second;
-
-            unsigned freesize = 0;
-            for(auto j = pagemap.begin(); j != pagemap.end(); ++j)
-            {
-                unsigned reclen = j->length();
-                freesize += reclen;
-            }
+            unsigned freesize = SizeAfter(pagenum, tmpblocks);
 
             if(first || freesize < bestpagesize)
             {
@@ -523,7 +623,34 @@ bool freespacemap::OrganizeToAnySamePage(std::vector<freespacerec> &blocks, unsi
         }
     }
 
-    *this = saved_this;
+    if(!candidates && quick != packmethod && !mayfit.empty())
+    {
+        const unsigned budget = std::max(1u, packbudget / (unsigned)mayfit.size());
+        std::vector<freespacerec> bestblocks;
+        for(unsigned pagenum: mayfit)
+        {
+            std::vector<freespacerec> tmpblocks = blocks;
+            if(PlanOrganize(tmpblocks, CalculateMapOf(pagenum), packmethod, budget)) continue;
+
+            unsigned freesize = SizeAfter(pagenum, tmpblocks);
+            if(!candidates || freesize < bestpagesize)
+            {
+                bestpagenum  = pagenum;
+                bestpagesize = freesize;
+                bestblocks   = tmpblocks;
+                candidates   = true;
+            }
+        }
+        if(candidates)
+        {
+            // Already packed; packing again might not succeed in time
+            page = bestpagenum;
+            blocks = bestblocks;
+            for(unsigned a=0; a<blocks.size(); ++a)
+                Del(page, blocks[a].pos, blocks[a].len);
+            return false;
+        }
+    }
 
     page = bestpagenum;
 
@@ -559,19 +686,29 @@ unsigned freespacemap::FindFromAnyPage(unsigned length)
     }
     if(first)
     {
-        std::fprintf(stderr, "No %u-byte free space block available!\n", length);
-        if(log)
-            std::fprintf(log, "No %u-byte free space block available!\n", length);
+        if(!quiet)
+        {
+            std::fprintf(stderr, "No %u-byte free space block available!\n", length);
+            if(log)
+                std::fprintf(log, "No %u-byte free space block available!\n", length);
+        }
         return NOWHERE;
     }
-    return Find(bestpage, length) + (bestpage * GetPageSize());
+    const unsigned pos = Find(bestpage, length);
+    if(pos == NOWHERE) return NOWHERE;
+    return pos + (bestpage * pagesize);
 }
 
 #include "o65linker.hh"
+#include "stats.hh"
+
+static StatTimer OrganizeTime("organize");
 
 void freespacemap::OrganizeO65linker
     (O65linker& objects, const SegmentSelection seg)
 {
+    StatScope timing(OrganizeTime);
+
     Compact();
 
     std::vector<unsigned> sizes = objects.GetSizeList(seg);
@@ -629,7 +766,7 @@ void freespacemap::OrganizeO65linker
             unsigned addr = Organization[d++].pos;
             if(addr != NOWHERE)
             {
-                addr += page * GetPageSize();
+                addr += page * pagesize;
             }
             addrs[items[c]] = addr;
         }
@@ -658,7 +795,7 @@ void freespacemap::OrganizeO65linker
             unsigned addr = Organization[d++].pos;
             if(addr != NOWHERE)
             {
-                addr += page * GetPageSize();
+                addr += page * pagesize;
             }
             addrs[items[c]] = addr;
         }
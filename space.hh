@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "rangeset.hh"
+#include "binpacker.hh"
 #include "o65.hh" /* For SegmentSelection */
 
 #define NOWHERE 0x10000
@@ -26,12 +27,16 @@ struct freespacerec
     }
 };
 
-typedef rangeset<unsigned> freespaceset;
+/* Keys are bounded by GetPageSize(), so the changepoints are kept in a sorted vector */
+typedef rangeset<unsigned, flat_allocator<unsigned> > freespaceset;
 
 /* (rom)page -> list */
 class freespacemap
 {
     bool quiet;
+    unsigned pagesize;
+    BinPackingMethod packmethod;
+    unsigned packbudget;
     std::map<unsigned/*bank*/, freespaceset> data;
     struct alias
     {
@@ -42,8 +47,8 @@ public:
     /*
 
     Note: 16-bit here denotes addresses that do not need a page number.
-          The actual bitness is deduced from the GetPageSize() routine
-          in romaddr.hh.
+          The actual bitness is deduced from the page size, which is
+          by default that of the GetPageSize() routine in romaddr.hh.
           24-bit denotes an address that has the page number built in.
     */
 
@@ -52,6 +57,8 @@ public:
     */
 
     freespacemap();
+    // For pages of another size than GetPageSize(), such as CHR banks
+    explicit freespacemap(unsigned page_size);
 
     void Report() const;
     void DumpPageMap(unsigned pagenum) const;
@@ -70,6 +77,16 @@ public:
     void AddAlias(unsigned aliaspage, unsigned aliasbegin, unsigned aliaslength,
                   unsigned realpage, unsigned realbegin);
 
+    // Suppresses the messages about space that wasn't found
+    void SetQuiet(bool q) { quiet = q; }
+
+    // Selects how blocks are assigned to free space holes
+    void SetPackingMethod(BinPackingMethod method, unsigned budget_ms = 1000)
+    {
+        packmethod = method;
+        packbudget = budget_ms;
+    }
+
     void OrganizeO65linker(class O65linker& objects, const SegmentSelection seg = CODE);
 
     const std::set<unsigned> GetPageList() const;
@@ -80,19 +97,30 @@ public:
     // Returns abbsolute address (24-bit)
     unsigned FindFromAnyPage(unsigned length);
 
-    /* These don't need to be private, but they are
-     * now to ensure Chronotools doesn't use them.
-     */
-private:
-
+    // Free bytes, in total or in the given page
     unsigned Size() const;
     unsigned Size(unsigned page) const;
+    // Number of separate holes in the given page
     unsigned GetFragmentation(unsigned page) const;
 
+    // Whether the whole range is free
+    bool IsFree(unsigned page, unsigned begin, unsigned length) const;
+    bool IsFree(unsigned longaddr, unsigned length) const;
+
+private:
+
     // Uses segment-relative addresses (16-bit)
     bool Organize(std::vector<freespacerec> &blocks, unsigned pagenum);
     // Return value: errors-flag
 
+    // Like Organize, but only decides the positions; the map is not modified.
+    bool PlanOrganize(std::vector<freespacerec> &blocks, const freespaceset& pagemap,
+                      BinPackingMethod method, unsigned budget_ms) const;
+    // Return value: errors-flag
+
+    // Free space that would remain in the page if the planned blocks were deleted.
+    unsigned SizeAfter(unsigned page, const std::vector<freespacerec> &blocks) const;
+
     // Uses absolute addresses (24-bit)
     bool OrganizeToAnyPage(std::vector<freespacerec> &blocks);
     // Return value: errors-flag
@@ -0,0 +1,154 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#include "stats.hh"
+
+bool StatsEnabled = false;
+
+namespace
+{
+    /* Function-local statics, so that counters defined in
+     * other translation units can register during their
+     * static initialization regardless of the link order.
+     */
+    std::vector<StatCounter*>& Counters()
+    {
+        static std::vector<StatCounter*> list;
+        return list;
+    }
+    std::vector<StatTimer*>& Timers()
+    {
+        static std::vector<StatTimer*> list;
+        return list;
+    }
+
+    std::chrono::steady_clock::time_point StartTime
+        = std::chrono::steady_clock::now();
+
+    bool        StatsJSON = false;
+    std::string StatsFile;
+
+    /* Peak resident set size in kilobytes, 0 if unknown */
+    unsigned long PeakMemory()
+    {
+#ifndef WIN32
+        struct rusage usage;
+        if(getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+    #ifdef __APPLE__
+            return usage.ru_maxrss / 1024; // bytes there
+    #else
+            return usage.ru_maxrss;
+    #endif
+        }
+#endif
+        return 0;
+    }
+
+    double Milliseconds(unsigned long long ns)
+    {
+        return ns / 1e6;
+    }
+}
+
+StatCounter::StatCounter(const char* n): name(n), value(0)
+{
+    Counters().push_back(this);
+}
+
+StatTimer::StatTimer(const char* n): name(n), nanoseconds(0), calls(0)
+{
+    Timers().push_back(this);
+}
+
+void ResetStats()
+{
+    StartTime = std::chrono::steady_clock::now();
+    for(StatCounter* c: Counters()) c->value = 0;
+    for(StatTimer* t: Timers()) { t->nanoseconds = 0; t->calls = 0; }
+}
+
+bool SetStatsOption(const char* arg)
+{
+    StatsEnabled = true;
+    if(!arg) return true;
+
+    std::string format = arg;
+    std::string::size_type colon = format.find(':');
+    if(colon != format.npos)
+    {
+        StatsFile = format.substr(colon+1);
+        format.erase(colon);
+    }
+
+    if(format == "json") StatsJSON = true;
+    else if(format == "text" || format.empty()) StatsJSON = false;
+    else
+    {
+        std::fprintf(stderr, "Error: --stats requires 'text' or 'json'\n");
+        return false;
+    }
+    return true;
+}
+
+void ReportStats(const char* progname)
+{
+    if(!StatsEnabled) return;
+
+    const unsigned long long total = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now() - StartTime).count();
+
+    std::FILE* fp = stderr;
+    if(!StatsFile.empty() && StatsFile != "-")
+    {
+        fp = std::fopen(StatsFile.c_str(), "wt");
+        if(!fp)
+        {
+            std::perror(StatsFile.c_str());
+            return;
+        }
+    }
+
+    if(StatsJSON)
+    {
+        std::fprintf(fp, "{\"program\":\"%s\",\"total_ms\":%.3f,\"peak_kb\":%lu,\n \"phases\":{",
+            progname, Milliseconds(total), PeakMemory());
+        const char* sep = "";
+        for(const StatTimer* t: Timers())
+        {
+            std::fprintf(fp, "%s\n  \"%s\":{\"ms\":%.3f,\"calls\":%lu}",
+                sep, t->name, Milliseconds(t->nanoseconds), (unsigned long)t->calls);
+            sep = ",";
+        }
+        std::fprintf(fp, "},\n \"counters\":{");
+        sep = "";
+        for(const StatCounter* c: Counters())
+        {
+            std::fprintf(fp, "%s\n  \"%s\":%lu", sep, c->name, (unsigned long)c->value);
+            sep = ",";
+        }
+        std::fprintf(fp, "}}\n");
+    }
+    else
+    {
+        std::fprintf(fp, "%s statistics:\n", progname);
+        std::fprintf(fp, "  %-20s %10.3f ms\n", "total", Milliseconds(total));
+        for(const StatTimer* t: Timers())
+        {
+            std::fprintf(fp, "  %-20s %10.3f ms  (%lu calls)\n",
+                t->name, Milliseconds(t->nanoseconds), (unsigned long)t->calls);
+        }
+        for(const StatCounter* c: Counters())
+        {
+            std::fprintf(fp, "  %-20s %10lu\n", c->name, (unsigned long)c->value);
+        }
+        std::fprintf(fp, "  %-20s %10lu kB\n", "peak memory", PeakMemory());
+    }
+
+    if(fp != stderr) std::fclose(fp);
+}
@@ -0,0 +1,78 @@
+#ifndef bqtStatsHH
+#define bqtStatsHH
+
+#include <atomic>
+#include <chrono>
+
+/* Phase timers and counters, reported with --stats.
+ * Define them as statics next to the code they measure:
+ *
+ *     static StatTimer   ParseTime("parse");
+ *     static StatCounter LinesRead("lines");
+ *
+ *     StatScope timing(ParseTime);
+ *     LinesRead.Add();
+ *
+ * While statistics are disabled, they cost a flag test.
+ * They may be updated from several threads at once.
+ */
+extern bool StatsEnabled;
+
+class StatCounter
+{
+public:
+    explicit StatCounter(const char* name);
+
+    void Add(unsigned long n = 1) { if(StatsEnabled) value += n; }
+
+    const char* const name;
+    std::atomic<unsigned long> value;
+};
+
+class StatTimer
+{
+public:
+    explicit StatTimer(const char* name);
+
+    const char* const name;
+    std::atomic<unsigned long long> nanoseconds;
+    std::atomic<unsigned long> calls;
+};
+
+/* Adds the time spent in the enclosing block into the timer */
+class StatScope
+{
+public:
+    explicit StatScope(StatTimer& t): timer(StatsEnabled ? &t : nullptr), begin()
+    {
+        if(timer) begin = std::chrono::steady_clock::now();
+    }
+    ~StatScope()
+    {
+        if(!timer) return;
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        timer->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        ++timer->calls;
+    }
+private:
+    StatTimer* timer;
+    std::chrono::steady_clock::time_point begin;
+
+    StatScope(const StatScope&) = delete;
+    StatScope& operator=(const StatScope&) = delete;
+};
+
+/* Starts the measurements over, as if the program had just started.
+ * A forked server process calls this for each request.
+ */
+void ResetStats();
+
+/* Handles the argument of --stats: [text|json][:<file>].
+ * Returns false if it wasn't understood.
+ */
+bool SetStatsOption(const char* arg);
+
+/* Writes the report, if --stats was given */
+void ReportStats(const char* progname);
+
+#endif
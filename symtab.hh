@@ -0,0 +1,84 @@
+#ifndef bqtSymTabHH
+#define bqtSymTabHH
+
+#include <string>
+#include <vector>
+
+/* Interns symbol names into small consecutive integer IDs,
+ * so that the rest of the linker can use the IDs as vector
+ * indices instead of comparing strings.
+ *
+ * Open addressing with linear probing. The full hash of each
+ * name is remembered, so strings are only compared when the
+ * hashes already match. The table is kept at most half full.
+ */
+class SymbolTable
+{
+public:
+    static const unsigned None = ~0U;
+
+    SymbolTable(): names(), hashes(), slots(16, 0) { }
+
+    /* Returns the ID of the name, adding it if it's new */
+    unsigned Intern(const std::string& name)
+    {
+        unsigned hash = Hash(name);
+        unsigned pos  = Probe(name, hash);
+        if(slots[pos]) return slots[pos]-1;
+
+        unsigned id = names.size();
+        names.push_back(name);
+        hashes.push_back(hash);
+        slots[pos] = id+1;
+        if(names.size()*2 > slots.size()) Grow();
+        return id;
+    }
+
+    /* Returns the ID of the name, or None if it was never interned */
+    unsigned Find(const std::string& name) const
+    {
+        unsigned pos = Probe(name, Hash(name));
+        return slots[pos] ? slots[pos]-1 : None;
+    }
+
+    const std::string& GetName(unsigned id) const { return names[id]; }
+    unsigned size() const { return names.size(); }
+
+private:
+    std::vector<std::string> names;  // id => name
+    std::vector<unsigned>    hashes; // id => hash
+    std::vector<unsigned>    slots;  // id+1, or 0 when unused
+
+    static unsigned Hash(const std::string& s)
+    {
+        /* FNV-1a */
+        unsigned h = 2166136261u;
+        for(unsigned char c: s) { h ^= c; h *= 16777619u; }
+        return h;
+    }
+
+    unsigned Probe(const std::string& name, unsigned hash) const
+    {
+        unsigned mask = slots.size()-1;
+        for(unsigned pos = hash & mask; ; pos = (pos+1) & mask)
+        {
+            unsigned s = slots[pos];
+            if(!s) return pos;
+            if(hashes[s-1] == hash && names[s-1] == name) return pos;
+        }
+    }
+
+    void Grow()
+    {
+        slots.assign(slots.size()*2, 0);
+        unsigned mask = slots.size()-1;
+        for(unsigned id=0; id<names.size(); ++id)
+        {
+            unsigned pos = hashes[id] & mask;
+            while(slots[pos]) pos = (pos+1) & mask;
+            slots[pos] = id+1;
+        }
+    }
+};
+
+#endif